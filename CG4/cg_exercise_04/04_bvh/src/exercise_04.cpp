@@ -3,7 +3,18 @@
 #include <cglib/rt/triangle_soup.h>
 
 #include <cglib/core/image.h>
+#include <cglib/core/parallel.h>
+#include <algorithm>
 #include <complex>
+#include <cstdint>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define CG_CONVOLUTION_SSE
+#endif
 
 /*
  * Create a 1 dimensional normalized gauss kernel
@@ -75,6 +86,174 @@ void Image::create_gaussian_kernel_2d(
 	}
 }
 
+namespace {
+
+/*
+ * The coordinate that tap k of an axis with the given size reads for
+ * the wrap mode, or -1 if the tap is zero.
+ */
+int wrap_coordinate(int k, int size, Image::WrapMode wrap_mode)
+{
+	if (k >= 0 && k < size) {
+		return k;
+	}
+	switch (wrap_mode) {
+		case Image::CLAMP:  return std::min(std::max(k, 0), size-1);
+		case Image::REPEAT: return (k % size + size) % size;
+		default:            return -1;
+	}
+}
+
+/*
+ * The source rows of one output row. pixels[i] is the row read by the
+ * kernel row taps[i], rows that are zero are not listed.
+ */
+struct ConvolutionRows
+{
+	explicit ConvolutionRows(int kernel_height) :
+		pixels(kernel_height), taps(kernel_height)
+	{}
+
+	// Resolve the rows of output row j of an image with the wrap mode.
+	void wrap(glm::vec4 const* image, int width, int height, int j, Image::WrapMode wrap_mode)
+	{
+		int const radius = int(taps.size())/2;
+		count = 0;
+		for (int q = 0; q < int(taps.size()); q++) {
+			int const q1 = wrap_coordinate(j + q - radius, height, wrap_mode);
+			if (q1 >= 0) {
+				pixels[count] = image + q1*width;
+				taps[count] = q;
+				count++;
+			}
+		}
+	}
+
+	std::vector<glm::vec4 const*> pixels;
+	std::vector<int> taps;
+	int count = 0;
+};
+
+/*
+ * The source column of every tap column -radius..width+radius-1 of an
+ * image, -1 for taps that are zero.
+ */
+std::vector<int> wrap_columns(int width, int radius, Image::WrapMode wrap_mode)
+{
+	std::vector<int> columns(width + 2*radius);
+	for (int k = 0; k < int(columns.size()); ++k) {
+		columns[k] = wrap_coordinate(k - radius, width, wrap_mode);
+	}
+	return columns;
+}
+
+/*
+ * The convolution helpers below apply a kernel_width wide kernel, whose
+ * weight for column k and row taps[q] is kernel[k*kernel_stride + taps[q]].
+ * A 2d kernel has a stride of kernel_width, a horizontal 1d kernel uses a
+ * single row with a stride of 1 and a vertical 1d kernel has a width of 1.
+ */
+
+/*
+ * Convolve the pixels [begin, end) of one row, wrapping every tap column
+ * through columns (see wrap_columns).
+ */
+void convolve_border(glm::vec4* row, ConvolutionRows const& rows, int const* columns,
+	float const* kernel, int kernel_width, int kernel_stride, int begin, int end)
+{
+	for (int i = begin; i < end; i++) {
+		glm::vec4 sum(0.f);
+		for (int k = 0; k < kernel_width; k++) {
+			int const k1 = columns[i + k];
+			if (k1 < 0) {
+				continue;
+			}
+			float const* weights = kernel + k*kernel_stride;
+			for (int q = 0; q < rows.count; q++) {
+				sum += rows.pixels[q][k1] * weights[rows.taps[q]];
+			}
+		}
+		row[i] = sum;
+	}
+}
+
+/*
+ * Convolve the pixels [begin, end) of one row, all of whose taps lie inside
+ * the row. Vectorized over neighbouring pixels, each pixel keeps the
+ * summation order of convolve_border so both paths give identical results.
+ */
+void convolve_interior(glm::vec4* row, ConvolutionRows const& rows,
+	float const* kernel, int kernel_width, int kernel_stride, int begin, int end)
+{
+	int const radius = kernel_width/2;
+	int i = begin;
+#if defined(__AVX__)
+	// Two pixels per register, four registers per step.
+	for (; i + 8 <= end; i += 8) {
+		__m256 sum0 = _mm256_setzero_ps();
+		__m256 sum1 = _mm256_setzero_ps();
+		__m256 sum2 = _mm256_setzero_ps();
+		__m256 sum3 = _mm256_setzero_ps();
+		for (int k = 0; k < kernel_width; k++) {
+			float const* weights = kernel + k*kernel_stride;
+			int const k1 = i + k - radius;
+			for (int q = 0; q < rows.count; q++) {
+				float const* p = reinterpret_cast<float const*>(rows.pixels[q] + k1);
+				__m256 const w = _mm256_set1_ps(weights[rows.taps[q]]);
+				sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(p),      w));
+				sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(p + 8),  w));
+				sum2 = _mm256_add_ps(sum2, _mm256_mul_ps(_mm256_loadu_ps(p + 16), w));
+				sum3 = _mm256_add_ps(sum3, _mm256_mul_ps(_mm256_loadu_ps(p + 24), w));
+			}
+		}
+		float* o = reinterpret_cast<float*>(row + i);
+		_mm256_storeu_ps(o,      sum0);
+		_mm256_storeu_ps(o + 8,  sum1);
+		_mm256_storeu_ps(o + 16, sum2);
+		_mm256_storeu_ps(o + 24, sum3);
+	}
+#endif
+#if defined(CG_CONVOLUTION_SSE)
+	// One pixel per register, four registers per step.
+	for (; i + 4 <= end; i += 4) {
+		__m128 sum0 = _mm_setzero_ps();
+		__m128 sum1 = _mm_setzero_ps();
+		__m128 sum2 = _mm_setzero_ps();
+		__m128 sum3 = _mm_setzero_ps();
+		for (int k = 0; k < kernel_width; k++) {
+			float const* weights = kernel + k*kernel_stride;
+			int const k1 = i + k - radius;
+			for (int q = 0; q < rows.count; q++) {
+				float const* p = reinterpret_cast<float const*>(rows.pixels[q] + k1);
+				__m128 const w = _mm_set1_ps(weights[rows.taps[q]]);
+				sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(p),      w));
+				sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(p + 4),  w));
+				sum2 = _mm_add_ps(sum2, _mm_mul_ps(_mm_loadu_ps(p + 8),  w));
+				sum3 = _mm_add_ps(sum3, _mm_mul_ps(_mm_loadu_ps(p + 12), w));
+			}
+		}
+		float* o = reinterpret_cast<float*>(row + i);
+		_mm_storeu_ps(o,      sum0);
+		_mm_storeu_ps(o + 4,  sum1);
+		_mm_storeu_ps(o + 8,  sum2);
+		_mm_storeu_ps(o + 12, sum3);
+	}
+#endif
+	for (; i < end; i++) {
+		glm::vec4 sum(0.f);
+		for (int k = 0; k < kernel_width; k++) {
+			float const* weights = kernel + k*kernel_stride;
+			int const k1 = i + k - radius;
+			for (int q = 0; q < rows.count; q++) {
+				sum += rows.pixels[q][k1] * weights[rows.taps[q]];
+			}
+		}
+		row[i] = sum;
+	}
+}
+
+} // namespace
+
 /*
  * Convolve an image with a 2d filter kernel
  *
@@ -83,56 +262,40 @@ void Image::create_gaussian_kernel_2d(
  *  - kernel:      the 2d-kernel with kernel_size*kernel_size elements
  *  - wrap_mode:   needs to be known to handle repeating 
  *                 textures correctly
+ *
+ * The image is processed row by row. For every output row, the source rows
+ * of the kernel are resolved once with the wrap mode, so only the columns
+ * closer than the kernel radius to the left and right border need to wrap
+ * per tap. All other pixels take a branch-free, vectorized path. Taps are
+ * summed in the same order as a straightforward loop over the kernel.
  */
 void Image::filter(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode) const
 {
 	cg_assert (kernel_size%2==1 && "kernel size should be odd.");
 	cg_assert (kernel_size > 0 && "kernel size should be greater than 0.");
 	cg_assert (target);
+	cg_assert (target != this);
 	cg_assert (target->getWidth() == m_width && target->getHeight() == m_height);
-	int radius = kernel_size/2;
-	glm::vec4 targetValue = glm::vec4(0.f);
-	int kernel_index = 0;
-	int k1,q1;
-	glm::vec4 pixel_value;
-	//get the value of each target pixel
-	for(int i =0; i < m_width; i++){
-		for(int j = 0; j < m_height; j++){
-			targetValue = glm::vec4(0.f);
-			kernel_index = 0;
-			//traverse the values in corresponding original pixels
-			for(int k = i-radius; k <= i+radius; k++){
-				for(int q = j-radius; q <= j+radius; q++){
-					if (k >= 0 && q >= 0&&k <m_width&& q <m_height){
-						pixel_value = getPixel(k,q);
-					}
-					else{
-						k1 = k;q1 =q;
-						switch(wrap_mode){//ZERO
-							case 0:{
-								pixel_value = glm::vec4(0.f);break;
-							}
-							case 1 :{//CLAMP
-								if (k1 < 0) k1 =0;
-								if(q1 < 0) q1 = 0;
-								if (k1 >= m_width) k1 =m_width-1;
-								if(q1 >= m_height) q1 = m_height-1;
-								pixel_value = getPixel(k1,q1);break;
-							}
-							case 2 :{//REPEAT
-								while (k1 < 0) k1 =k1+m_width;
-								while(q1 < 0) q1 = q1+m_height;
-								if (k1 >= m_width) k1 =k1%m_width;
-								if(q1 >= m_height) q1 = q1%m_height;
-								pixel_value = getPixel(k1,q1);break;
-							}}}
-					targetValue+= pixel_value*kernel[kernel_index];
-					kernel_index++;
-				}
-			}
-			target->setPixel(i,j,targetValue);
-			}}
+	int const radius = kernel_size/2;
+	int const width = m_width;
+	int const height = m_height;
 
+	std::vector<int> const columns = wrap_columns(width, radius, wrap_mode);
+	int const interior_begin = std::min(radius, width);
+	int const interior_end   = std::max(width - radius, interior_begin);
+
+	glm::vec4 const* source = m_pixels.data();
+	glm::vec4* destination = target->m_pixels.data();
+	parallel_for(BlockedRange(0, m_height), 4, [&](BlockedRange const& r) {
+		ConvolutionRows rows(kernel_size);
+		for (int j = r.begin; j < r.end; j++) {
+			rows.wrap(source, width, height, j, wrap_mode);
+			glm::vec4* row = destination + j*width;
+			convolve_border  (row, rows, columns.data(), kernel, kernel_size, kernel_size, 0, interior_begin);
+			convolve_interior(row, rows, kernel, kernel_size, kernel_size, interior_begin, interior_end);
+			convolve_border  (row, rows, columns.data(), kernel, kernel_size, kernel_size, interior_end, width);
+		}
+	});
 }
 
 /*
@@ -143,90 +306,63 @@ void Image::filter(Image *target, int kernel_size, float* kernel, WrapMode wrap_
  *  - kernel:      the 1d-kernel with kernel_size elements
  *  - wrap_mode:   needs to be known to handle repeating 
  *                 textures correctly
+ *
+ * The horizontal pass runs row by row into a single scratch image. The
+ * vertical pass then runs in blocks of columns and rows, so the rows a
+ * block reads stay in the cache. Both passes are parallel.
  */
 void Image::filter_separable(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode) const
+{
+	filter_separable(target, kernel_size, kernel, kernel, wrap_mode);
+}
+
+/*
+ * Convolve an image with the separable 2d kernel horizontal[dx]*vertical[dy],
+ * see filter_separable above.
+ */
+void Image::filter_separable(Image *target, int kernel_size, float* horizontal, float* vertical,
+	WrapMode wrap_mode) const
 {
 	cg_assert (kernel_size%2==1 && "kernel size should be odd.");
 	cg_assert (kernel_size > 0 && "kernel size should be greater than 0.");
 	cg_assert (target);
 	cg_assert (target->getWidth() == m_width && target->getHeight() == m_height);
-	// TODO: realize the 2d convolution with two
-	// convolutions of the image with a 1d-kernel.
-	// convolve the image horizontally and then convolve
-	// the result vertically (or vise-versa).
-	//
-	// use the methods getPixel(x, y, wrap_mode) and
-	// setPixel(x, y, value) to get and set pixels of an image
-	std::vector<std::vector<glm::vec4>> target_horizontal(m_width, std::vector<glm::vec4>(m_height, glm::vec4(0.f)));
-	int radius = kernel_size/2;
-	glm::vec4 targetValue = glm::vec4(0.f);
-	int kernel_index = 0;
-	int k1,q1;
-	glm::vec4 pixel_value;
-	//do the horizontal convolution.
-	for(int i =0; i < m_width; i++){
-		for(int j = 0; j < m_height; j++){
-			targetValue = glm::vec4(0.f);
-			kernel_index = 0;
-			//traverse the values in corresponding original pixels
-			for(int k = i-radius; k <= i+radius; k++){
-					if (k >= 0 && k <m_width){
-						pixel_value = getPixel(k,j);
-					}
-					else{
-						k1 = k;
-						switch(wrap_mode){//ZERO
-							case 1 :{//CLAMP
-								if (k1 < 0) k1 =0;
-								if (k1 >= m_width) k1 =m_width-1;
-								pixel_value = getPixel(k1,j);break;
-							}
-							case 2 :{//REPEAT
-								while (k1 < 0) k1 =k1+m_width;
-								if (k1 >= m_width) k1 =k1%m_width;
-								pixel_value = getPixel(k1,j);break;
-							}
-							default:{
-								pixel_value = glm::vec4(0.f);break;
-							}}}
-					targetValue+= pixel_value*kernel[kernel_index];
-					kernel_index++;
-				}
-			target_horizontal[i][j]=targetValue;
+	int const radius = kernel_size/2;
+	int const width = m_width;
+	int const height = m_height;
+
+	// One scratch image for the horizontal pass, aligned to a cache line.
+	std::vector<glm::vec4> scratch_storage(std::size_t(width)*height + 4);
+	std::uintptr_t const address = reinterpret_cast<std::uintptr_t>(scratch_storage.data());
+	glm::vec4* scratch = reinterpret_cast<glm::vec4*>((address + 63) & ~std::uintptr_t(63));
+
+	//do the horizontal convolution, row by row.
+	std::vector<int> const columns = wrap_columns(width, radius, wrap_mode);
+	int const interior_begin = std::min(radius, width);
+	int const interior_end   = std::max(width - radius, interior_begin);
+	glm::vec4 const* source = m_pixels.data();
+	parallel_for(BlockedRange(0, height), 8, [&](BlockedRange const& r) {
+		ConvolutionRows rows(1);
+		rows.count = 1;
+		for (int j = r.begin; j < r.end; j++) {
+			rows.pixels[0] = source + j*width;
+			glm::vec4* row = scratch + j*width;
+			convolve_border  (row, rows, columns.data(), horizontal, kernel_size, 1, 0, interior_begin);
+			convolve_interior(row, rows, horizontal, kernel_size, 1, interior_begin, interior_end);
+			convolve_border  (row, rows, columns.data(), horizontal, kernel_size, 1, interior_end, width);
 		}
-	}
-	//do the vertical convolution.
-	for(int i =0; i < m_width; i++){
-		for(int j = 0; j < m_height; j++){
-			targetValue = glm::vec4(0.f);
-			kernel_index = 0;
-			//traverse the values in corresponding original pixels
-			for(int q = j-radius; q <= j+radius; q++){
-					if (q >= 0 && q <m_height){
-						pixel_value = target_horizontal[i][q];
-					}
-					else{
-						q1 = q;
-						switch(wrap_mode){//ZERO
-							case 0:{
-								pixel_value = glm::vec4(0.f);break;
-							}
-							case 1 :{//CLAMP
-								if (q1 < 0) q1 =0;
-								if (q1 >= m_height) q1 =m_height-1;
-								pixel_value = target_horizontal[i][q1];break;
-							}
-							case 2 :{//REPEAT
-								while (q1 < 0) q1 =q1+m_width;
-								if (q1 >= m_height) q1 =q1%m_height;
-								pixel_value = target_horizontal[i][q1];break;
-							}}}
-					targetValue+= pixel_value*kernel[kernel_index];
-					kernel_index++;
-				}
-			target->setPixel(i,j,targetValue);
+	});
+
+	//do the vertical convolution in strips of columns, so that the
+	//kernel_size rows of a strip stay in the cache from one row to the next.
+	glm::vec4* destination = target->m_pixels.data();
+	parallel_for(BlockedRange2D(0, width, 0, height), 64, [&](BlockedRange2D const& r) {
+		ConvolutionRows rows(kernel_size);
+		for (int j = r.y.begin; j < r.y.end; j++) {
+			rows.wrap(scratch, width, height, j, wrap_mode);
+			convolve_interior(destination + j*width, rows, vertical, 1, 0, r.x.begin, r.x.end);
 		}
-	}
+	});
 }
 bool comp(std::pair<int,float> np1,std::pair<int,float> np2){
 	return np1.second<np2.second;
@@ -461,29 +597,33 @@ void DiscreteFourier2D::reconstruct(
 	std::complex<float>	* reconstruction)
 {
 	std::complex<float> i(0.f, 1.f);
-	std::complex<float> innen_l_m(0.0f, 0.0f);
 	std::vector<std::complex<float>> innen (M*N, std::complex<float>(0.0f, 0.0f));
-	for(int l =0; l < M; l++){
-		for(int m = 0; m< N; m++){
-			innen_l_m = std::complex<float>(0.0f, 0.0f);
-			for(int n = 0; n < M; n++){
-				float rea = 2*M_PI*l*((float)n/M-(1.f/2.f));
-				innen_l_m += spectrum[m*M+n]*exp(i*std::complex<float>(rea,0.f));
+	parallel_for(BlockedRange(0, M), 4, [&](BlockedRange const& r) {
+		std::complex<float> innen_l_m(0.0f, 0.0f);
+		for(int l = r.begin; l < r.end; l++){
+			for(int m = 0; m< N; m++){
+				innen_l_m = std::complex<float>(0.0f, 0.0f);
+				for(int n = 0; n < M; n++){
+					float rea = 2*M_PI*l*((float)n/M-(1.f/2.f));
+					innen_l_m += spectrum[m*M+n]*exp(i*std::complex<float>(rea,0.f));
+				}
+				innen[l*N+m]= innen_l_m;
 			}
-			innen[l*N+m]= innen_l_m;
 		}
-	}
-	std::complex<float> recon_k_l(0.0f, 0.0f);
+	});
 	float com1 = 1/sqrt(M*N);
-	for(int k = 0; k < N; k++){
-		for(int l =0; l < M; l++){
-			recon_k_l = std::complex<float>(0.0f, 0.0f);
-			for(int m = 0; m < N; m++){
-				float rea = 2*M_PI*k*((float)m/N-(1.f/2.f));
-				recon_k_l += innen[l*N+m]*exp(i*std::complex<float>(rea,0.f));
+	parallel_for(BlockedRange(0, N), 4, [&](BlockedRange const& r) {
+		std::complex<float> recon_k_l(0.0f, 0.0f);
+		for(int k = r.begin; k < r.end; k++){
+			for(int l =0; l < M; l++){
+				recon_k_l = std::complex<float>(0.0f, 0.0f);
+				for(int m = 0; m < N; m++){
+					float rea = 2*M_PI*k*((float)m/N-(1.f/2.f));
+					recon_k_l += innen[l*N+m]*exp(i*std::complex<float>(rea,0.f));
+				}
+				reconstruction[k*M+l]= com1*recon_k_l;
 			}
-			reconstruction[k*M+l]= com1*recon_k_l;
 		}
-	}
+	});
 }
 // CG_REVISION 923b9bac8f5225422060a543872d939f9f9f68dd
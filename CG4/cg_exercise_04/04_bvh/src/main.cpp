@@ -11,6 +11,7 @@
 
 #include <cglib/core/glmstream.h>
 #include <cglib/core/image.h>
+#include <cglib/core/pfm.h>
 #include <cglib/core/parameters.h>
 #include <cglib/core/thread_local_data.h>
 #include <cglib/core/thread_local_data.h>
@@ -31,6 +32,95 @@ using std::cerr;
 using std::endl;
 
 
+/*
+ * Adaptive variant of the sampling loop in render_pixel.
+ *
+ * Samples are taken in batches of a (stratified) grid. After min_spp samples,
+ * sampling stops as soon as the standard error of the mean pixel luminance,
+ * estimated with a running variance, drops below adaptive_threshold times
+ * the mean. At most max_spp samples are taken.
+ */
+static glm::vec3 render_pixel_adaptive(int x, int y, RenderData &data)
+{
+	RaytracingParameters const& params = data.context.params;
+	int const min_samples = std::max(1, params.min_spp);
+	int const max_samples = std::max(min_samples, params.max_spp);
+	int const grid_size   = std::max(1, int(sqrtf(static_cast<float>(min_samples))));
+
+	std::vector<glm::vec2> samples;
+	glm::vec3 accum(0.0f);
+	float mean = 0.0f;
+	float m2   = 0.0f;
+	int n      = 0;
+
+	while (n < max_samples) {
+		if(params.stratified)
+			generate_stratified_samples(&samples, grid_size, grid_size, data.tld);
+		else
+			generate_random_samples(&samples, grid_size, grid_size, data.tld);
+
+		for(size_t i = 0; i < samples.size() && n < max_samples; i++) {
+			float fx = float(x) + samples[i].x;
+			float fy = float(y) + samples[i].y;
+
+			data.x = fx;
+			data.y = fy;
+
+			Ray ray = createPrimaryRay(data, fx, fy);
+			glm::vec3 const color = trace_recursive(data, ray, 0/*depth*/);
+			accum += color;
+
+			// Welford's running mean and variance of the luminance.
+			float const lum   = luminance(color);
+			float const delta = lum - mean;
+			++n;
+			mean += delta / float(n);
+			m2   += delta * (lum - mean);
+		}
+
+		if (params.adaptive_converged(n, mean, m2))
+			break;
+	}
+
+	data.num_samples = n;
+	return accum / float(n);
+}
+
+/*
+ * Take only sample number data.sample_pass of the pixel (progressive rendering).
+ *
+ * The passes of a pixel cycle through the cells of an n x n grid, with n*n
+ * the spp (max_spp when adaptive) rounded down to a square. Pass i jitters
+ * inside cell i, so every complete cycle of passes is stratified. Adaptive
+ * renders stop shading a pixel once it converged, see HostRender.
+ */
+static glm::vec3 render_pixel_single_sample(int x, int y, RenderData &data)
+{
+	RaytracingParameters const& params = data.context.params;
+	int const num_cells = params.get_progressive_passes();
+
+	glm::vec2 offset(0.5f);
+	if(num_cells > 1) {
+		int const grid_size = std::max(1, int(sqrtf(static_cast<float>(num_cells))));
+		int const cell      = data.sample_pass % num_cells;
+		glm::vec2 const jitter(data.tld->rand(), data.tld->rand());
+		if(params.stratified)
+			offset = (glm::vec2(cell % grid_size, cell / grid_size) + jitter) / float(grid_size);
+		else
+			offset = jitter;
+	}
+
+	float fx = float(x) + offset.x;
+	float fy = float(y) + offset.y;
+
+	data.x = fx;
+	data.y = fy;
+
+	data.num_samples = 1;
+	Ray ray = createPrimaryRay(data, fx, fy);
+	return trace_recursive(data, ray, 0/*depth*/);
+}
+
 /*
  * This is the main rendering kernel.
  *
@@ -48,7 +138,7 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 		float u = float(x)/context.params.image_width;
 		float v = float(y)/context.params.image_height;
 		const auto &scene = context.get_active_scene();
-		const char *tex_names[RaytracingParameters::GAUSS_MODE_COUNT] = { "input", "filtered_naive", "filtered_separable" };
+		const char *tex_names[RaytracingParameters::GAUSS_MODE_COUNT] = { "input", "filtered_naive", "filtered_separable", "filtered_recursive", "filtered_auto" };
 		const auto &texture = scene->textures.find(tex_names[context.params.gauss_mode])->second;
 		auto &mip = texture->get_mip_levels()[0];
 		float a = float(mip->getWidth()) / float(mip->getHeight());
@@ -70,6 +160,12 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 				: glm::vec2(u / a - (1.0f - a) * 0.5f, v));
 	}
 	
+	if(data.sample_pass >= 0)
+		return render_pixel_single_sample(x, y, data);
+
+	if(data.context.params.adaptive_sampling)
+		return render_pixel_adaptive(x, y, data);
+
 	std::vector<glm::vec2> samples;
 	int spp = data.context.params.spp;
 
@@ -92,6 +188,7 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 			accum += trace_recursive(data, ray, 0/*depth*/);
 		}
 
+		data.num_samples = int(samples.size());
 		return accum / float(samples.size());
 	}
 	else {
@@ -101,11 +198,24 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 		data.x = fx;
 		data.y = fy;
 
+		data.num_samples = 1;
 		Ray ray = createPrimaryRay(data, fx, fy);
 		return trace_recursive(data, ray, 0/*depth*/);
 	}
 }
 
+/*
+ * render_pixel as a functor, so that the tile loops of HostRender call it
+ * directly instead of through a function pointer.
+ */
+struct RenderPixel
+{
+	glm::vec3 operator()(int x, int y, RaytracingContext const& context, RenderData &data) const
+	{
+		return render_pixel(x, y, context, data);
+	}
+};
+
 static const std::string image_prefix = "assignment_images/";
 
 static void render_triangles(std::string const& output_name, int num_triangles)
@@ -119,7 +229,7 @@ static void render_triangles(std::string const& output_name, int num_triangles)
 
 	context.params.output_file_name = image_prefix + output_name;
 	context.add_scene(std::make_shared<TriangleScene>(context.params));
-	HostRender::run(context, render_pixel);
+	HostRender::run(context, RenderPixel());
 }
 
 static void render_monkey(std::string const& output_name)
@@ -132,7 +242,7 @@ static void render_monkey(std::string const& output_name)
 
 	context.params.output_file_name = image_prefix + output_name;
 	context.add_scene(std::make_shared<MonkeyScene>(context.params));
-	HostRender::run(context, render_pixel);
+	HostRender::run(context, RenderPixel());
 }
 
 static void render_sponza(std::string const& output_name)
@@ -145,17 +255,18 @@ static void render_sponza(std::string const& output_name)
 
 	context.params.output_file_name = image_prefix + output_name;
 	context.add_scene(std::make_shared<SponzaScene>(context.params));
-	HostRender::run(context, render_pixel);
+	HostRender::run(context, RenderPixel());
 }
 
 void fourier()
 {
 	// load the fourier transform from image
-	Image img_spec;
-	img_spec.load_pfm("assets/mystery.pfm");
+	PfmView img_spec;
+	if (!img_spec.open("assets/mystery.pfm"))
+		return;
 	int sx = img_spec.getWidth(), sy = img_spec.getHeight();
 	std::vector<std::complex<float>> spectrum (sx*sy, std::complex<float>(0.0f, 0.0f));
-	Image::image_to_complex(img_spec, &spectrum, false);
+	Image::image_to_complex(img_spec.pixels(), &spectrum, false);
 
 	// reconstruct the loaded spectrum and store it as png
 	std::vector<std::complex<float>> reconstruction(sx*sy, std::complex<float>(0.0f, 0.0f));
@@ -165,6 +276,36 @@ void fourier()
 	img_rec.save(image_prefix+"reconstruction.png", 1.f);
 }
 
+/*
+ * A normalized disc of the given radius, like the bokeh of a lens. Unlike
+ * the Gaussian it is not separable.
+ */
+static void create_disc_kernel(int radius, float* kernel)
+{
+	int const kernel_size = 2 * radius + 1;
+	float sum = 0.f;
+	for (int dx = -radius; dx <= radius; ++dx) {
+		for (int dy = -radius; dy <= radius; ++dy) {
+			float const w = (dx * dx + dy * dy <= radius * radius) ? 1.f : 0.f;
+			kernel[(dx + radius) * kernel_size + (dy + radius)] = w;
+			sum += w;
+		}
+	}
+	for (int i = 0; i < kernel_size * kernel_size; ++i)
+		kernel[i] /= sum;
+}
+
+// Run filter_fn and print how long it took.
+template <class FilterFn>
+static void timed_filter(char const* name, FilterFn const& filter_fn)
+{
+	Timer timer;
+	timer.start();
+	filter_fn();
+	timer.stop();
+	cout << name << ": " << timer.getElapsedTimeInMilliSec() << "ms" << endl;
+}
+
 void gauss_filter()
 {
 	// load the fourier transform from image
@@ -181,8 +322,73 @@ void gauss_filter()
 	Image filtered_seperable(img.getWidth(), img.getHeight());
 	img.filter_gaussian_separable(&filtered_seperable, sigma, kernel_size);
 
+	Image filtered_recursive(img.getWidth(), img.getHeight());
+	img.filter_gaussian_recursive(&filtered_recursive, sigma);
+
 	filtered_naive.save(image_prefix+"gauss_filtered_naive.png", 1.f);
 	filtered_seperable.save(image_prefix+"gauss_filtered_seperable.png", 1.f);
+	filtered_recursive.save(image_prefix+"gauss_filtered_recursive.png", 1.f);
+
+	// The recursive filter approximates the untruncated kernel, so compare
+	// it with a kernel that is wide enough.
+	float const error = img.recursive_gaussian_error(sigma);
+	cout << "recursive gauss: largest relative error " << error << endl;
+	if (error > 1e-3f)
+		cerr << "warning: recursive gauss is inaccurate" << endl;
+
+	// filter_auto picks the fastest algorithm for the kernel, check it
+	// against filter. The Gaussian is separable.
+	std::vector<float> gauss_kernel(kernel_size * kernel_size);
+	Image::create_gaussian_kernel_2d(sigma, kernel_size, gauss_kernel.data());
+	Image filtered_auto(img.getWidth(), img.getHeight());
+	Image::FilterAlgorithm algorithm = img.filter_auto(&filtered_auto, kernel_size, gauss_kernel.data());
+	float const auto_error = img.filter_error(filtered_auto, filtered_naive);
+	cout << "auto gauss: " << Image::filter_algorithm_name(algorithm)
+		<< ", largest relative error " << auto_error << endl;
+	if (auto_error > 1e-4f)
+		cerr << "warning: auto gauss is inaccurate" << endl;
+
+	// A wide disc is not separable, so filter_auto chooses between filter
+	// and filter_fft by their cost.
+	int const disc_radius = 24;
+	int const disc_size   = 2 * disc_radius + 1;
+	std::vector<float> disc(disc_size * disc_size);
+	create_disc_kernel(disc_radius, disc.data());
+
+	Image disc_direct(img.getWidth(), img.getHeight());
+	Image disc_fft(img.getWidth(), img.getHeight());
+	Image disc_auto(img.getWidth(), img.getHeight());
+	timed_filter("disc direct", [&] { img.filter(&disc_direct, disc_size, disc.data()); });
+	timed_filter("disc fft", [&] { img.filter_fft(&disc_fft, disc_size, disc.data()); });
+	timed_filter("disc auto", [&] { algorithm = img.filter_auto(&disc_auto, disc_size, disc.data()); });
+
+	float const fft_error = img.filter_error(disc_fft, disc_direct);
+	cout << "fft disc: largest relative error " << fft_error << endl;
+	if (fft_error > 1e-4f)
+		cerr << "warning: fft filter is inaccurate" << endl;
+	float const disc_auto_error = img.filter_error(disc_auto, disc_direct);
+	cout << "auto disc: " << Image::filter_algorithm_name(algorithm)
+		<< ", largest relative error " << disc_auto_error << endl;
+	if (disc_auto_error > 1e-4f)
+		cerr << "warning: auto disc is inaccurate" << endl;
+
+	// A difference of Gaussians (an edge detector) is not separable either,
+	// but filter_low_rank needs only two separable terms for it.
+	std::vector<float> wide_kernel(kernel_size * kernel_size);
+	Image::create_gaussian_kernel_2d(2.f * sigma, kernel_size, wide_kernel.data());
+	std::vector<float> dog(kernel_size * kernel_size);
+	for (int i = 0; i < kernel_size * kernel_size; ++i)
+		dog[i] = gauss_kernel[i] - wide_kernel[i];
+
+	Image dog_direct(img.getWidth(), img.getHeight());
+	Image dog_low_rank(img.getWidth(), img.getHeight());
+	int rank = 0;
+	timed_filter("dog direct", [&] { img.filter(&dog_direct, kernel_size, dog.data()); });
+	timed_filter("dog low rank", [&] { rank = img.filter_low_rank(&dog_low_rank, kernel_size, dog.data()); });
+	float const low_rank_error = img.filter_error(dog_low_rank, dog_direct);
+	cout << "low rank dog: " << rank << " separable terms, largest relative error " << low_rank_error << endl;
+	if (low_rank_error > 1e-3f)
+		cerr << "warning: low rank dog is inaccurate" << endl;
 }
 
 void create_images()
@@ -221,7 +427,7 @@ main(int argc, char const**argv)
 	context.add_scene(std::make_shared<GaussScene>(context.params));
 	context.add_scene(std::make_shared<FourierScene>(context.params));
 
-	return HostRender::run(context, render_pixel);
+	return HostRender::run(context, RenderPixel());
 }
 
 // CG_REVISION 923b9bac8f5225422060a543872d939f9f9f68dd
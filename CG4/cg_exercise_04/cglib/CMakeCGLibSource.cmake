@@ -1,11 +1,18 @@
 set(CGLIB_SOURCE_FILES
 	src/core/camera.cpp
+	src/core/compact_image.cpp
+	src/core/fft.cpp
 	src/core/gui.cpp
 	src/core/image.cpp
+	src/core/image_writer.cpp
 	src/core/parameters.cpp
+	src/core/pfm.cpp
+	src/core/png_writer.cpp
 	src/core/stb.cpp
+	src/core/task_graph.cpp
 	src/core/thread_pool.cpp
 	src/core/timer.cpp
+	src/core/topology.cpp
 	src/imgui/imgui.cpp
 	src/imgui/imgui_draw.cpp
 	src/imgui/imgui_orient.cpp
@@ -0,0 +1,229 @@
+#pragma once
+
+/*
+ * Images in compact pixel formats, converted to glm::vec4 on every read.
+ *
+ * Image always stores four floats per pixel, which is what the filters
+ * and the renderer work with. Textures are only read, so their mip levels
+ * can be kept in a smaller format that holds the data well enough: 8 bit
+ * for images that were loaded from 8 bit files, half floats for HDR data,
+ * or a single float for grey data.
+ *
+ * The conversion of every format is defined by PixelTraits, getPixel
+ * dispatches on the format of the image.
+ *
+ * Example:
+ *
+ *		CompactImage compact(image, CompactImage::smallest_exact_format(image, 2.2f), 2.2f);
+ *		glm::vec4 texel = compact.getPixel(x, y);
+ */
+
+#include <cglib/core/image.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <cstdint>
+#include <vector>
+
+enum PixelFormat
+{
+	PIXEL_RGBA8,   // 8 bit, the colour encoded with a gamma as in Image::load, linear alpha
+	PIXEL_RGB16F,  // half floats, alpha is 1
+	PIXEL_RGBA16F, // half floats
+	PIXEL_R32F,    // one float, read as grey (r, r, r, 1)
+	PIXEL_RGBA32F, // like Image
+	PIXEL_FORMAT_COUNT
+};
+
+extern const char* pixel_format_names[PIXEL_FORMAT_COUNT];
+
+/*
+ * The decoding table of the 8 bit format: to_linear[i] = pow(i/255, gamma).
+ */
+struct GammaCurve
+{
+	explicit GammaCurve(float gamma_ = 1.f);
+
+	// The nearest 8 bit code of a linear value.
+	std::uint8_t encode(float linear) const;
+
+	float gamma;
+	float to_linear[256];
+};
+
+/*
+ * The storage type of a pixel format and its conversion from and to
+ * glm::vec4.
+ */
+template <PixelFormat F> struct PixelTraits;
+
+template <> struct PixelTraits<PIXEL_RGBA8>
+{
+	struct Storage { std::uint8_t r, g, b, a; };
+	static Storage encode(glm::vec4 const& v, GammaCurve const& curve);
+	static glm::vec4 decode(Storage const& s, GammaCurve const& curve);
+};
+
+template <> struct PixelTraits<PIXEL_RGB16F>
+{
+	struct Storage { std::uint16_t r, g, b; };
+	static Storage encode(glm::vec4 const& v, GammaCurve const& curve);
+	static glm::vec4 decode(Storage const& s, GammaCurve const& curve);
+};
+
+template <> struct PixelTraits<PIXEL_RGBA16F>
+{
+	typedef glm::uint64 Storage;
+	static Storage encode(glm::vec4 const& v, GammaCurve const& curve);
+	static glm::vec4 decode(Storage const& s, GammaCurve const& curve);
+};
+
+template <> struct PixelTraits<PIXEL_R32F>
+{
+	typedef float Storage;
+	static Storage encode(glm::vec4 const& v, GammaCurve const& curve);
+	static glm::vec4 decode(Storage const& s, GammaCurve const& curve);
+};
+
+template <> struct PixelTraits<PIXEL_RGBA32F>
+{
+	typedef glm::vec4 Storage;
+	static Storage encode(glm::vec4 const& v, GammaCurve const& curve);
+	static glm::vec4 decode(Storage const& s, GammaCurve const& curve);
+};
+
+class CompactImage
+{
+public:
+	CompactImage();
+	CompactImage(int width, int height, PixelFormat format, float gamma = 1.f);
+	// Convert an image. gamma is the encoding of PIXEL_RGBA8.
+	CompactImage(Image const& image, PixelFormat format, float gamma = 1.f);
+
+	/*
+	 * The smallest format in which the image is stored without loss, e.g.
+	 * PIXEL_RGBA8 for an image that was loaded from an 8 bit file with the
+	 * same gamma. PIXEL_RGBA32F if no other format is exact.
+	 */
+	static PixelFormat smallest_exact_format(Image const& image, float gamma = 1.f);
+	static std::size_t bytes_per_pixel(PixelFormat format);
+
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+	PixelFormat getFormat() const { return m_format; }
+	std::size_t size_bytes() const { return m_data.size(); }
+
+	glm::vec4 getPixel(int i, int j) const;
+	void setPixel(int i, int j, glm::vec4 const& pixel);
+
+	// Read a pixel of an image whose format is known to be F.
+	template <PixelFormat F>
+	glm::vec4 fetch(int i, int j) const;
+
+	void to_image(Image* image) const;
+
+private:
+	template <PixelFormat F>
+	typename PixelTraits<F>::Storage* pixels();
+	template <PixelFormat F>
+	typename PixelTraits<F>::Storage const* pixels() const;
+
+	int                       m_width;
+	int                       m_height;
+	PixelFormat               m_format;
+	GammaCurve                m_curve;
+	std::vector<std::uint8_t> m_data;
+};
+
+// -----------------------------------------------------------------------------
+
+inline PixelTraits<PIXEL_RGBA8>::Storage
+PixelTraits<PIXEL_RGBA8>::encode(glm::vec4 const& v, GammaCurve const& curve)
+{
+	float const a = glm::clamp(v.a, 0.f, 1.f) * 255.f + 0.5f;
+	Storage const s = { curve.encode(v.r), curve.encode(v.g), curve.encode(v.b), std::uint8_t(a) };
+	return s;
+}
+
+inline glm::vec4 PixelTraits<PIXEL_RGBA8>::decode(Storage const& s, GammaCurve const& curve)
+{
+	return glm::vec4(curve.to_linear[s.r], curve.to_linear[s.g], curve.to_linear[s.b], s.a / 255.0f);
+}
+
+inline PixelTraits<PIXEL_RGB16F>::Storage
+PixelTraits<PIXEL_RGB16F>::encode(glm::vec4 const& v, GammaCurve const&)
+{
+	Storage const s = { glm::packHalf1x16(v.r), glm::packHalf1x16(v.g), glm::packHalf1x16(v.b) };
+	return s;
+}
+
+inline glm::vec4 PixelTraits<PIXEL_RGB16F>::decode(Storage const& s, GammaCurve const&)
+{
+	return glm::vec4(glm::unpackHalf1x16(s.r), glm::unpackHalf1x16(s.g), glm::unpackHalf1x16(s.b), 1.f);
+}
+
+inline PixelTraits<PIXEL_RGBA16F>::Storage
+PixelTraits<PIXEL_RGBA16F>::encode(glm::vec4 const& v, GammaCurve const&)
+{
+	return glm::packHalf4x16(v);
+}
+
+inline glm::vec4 PixelTraits<PIXEL_RGBA16F>::decode(Storage const& s, GammaCurve const&)
+{
+	return glm::unpackHalf4x16(s);
+}
+
+inline PixelTraits<PIXEL_R32F>::Storage
+PixelTraits<PIXEL_R32F>::encode(glm::vec4 const& v, GammaCurve const&)
+{
+	return v.r;
+}
+
+inline glm::vec4 PixelTraits<PIXEL_R32F>::decode(Storage const& s, GammaCurve const&)
+{
+	return glm::vec4(s, s, s, 1.f);
+}
+
+inline PixelTraits<PIXEL_RGBA32F>::Storage
+PixelTraits<PIXEL_RGBA32F>::encode(glm::vec4 const& v, GammaCurve const&)
+{
+	return v;
+}
+
+inline glm::vec4 PixelTraits<PIXEL_RGBA32F>::decode(Storage const& s, GammaCurve const&)
+{
+	return s;
+}
+
+// -----------------------------------------------------------------------------
+
+template <PixelFormat F>
+typename PixelTraits<F>::Storage* CompactImage::pixels()
+{
+	return reinterpret_cast<typename PixelTraits<F>::Storage*>(m_data.data());
+}
+
+template <PixelFormat F>
+typename PixelTraits<F>::Storage const* CompactImage::pixels() const
+{
+	return reinterpret_cast<typename PixelTraits<F>::Storage const*>(m_data.data());
+}
+
+template <PixelFormat F>
+glm::vec4 CompactImage::fetch(int i, int j) const
+{
+	return PixelTraits<F>::decode(pixels<F>()[j * m_width + i], m_curve);
+}
+
+inline glm::vec4 CompactImage::getPixel(int i, int j) const
+{
+	switch (m_format)
+	{
+		case PIXEL_RGBA8:   return fetch<PIXEL_RGBA8>(i, j);
+		case PIXEL_RGB16F:  return fetch<PIXEL_RGB16F>(i, j);
+		case PIXEL_RGBA16F: return fetch<PIXEL_RGBA16F>(i, j);
+		case PIXEL_R32F:    return fetch<PIXEL_R32F>(i, j);
+		default:            return fetch<PIXEL_RGBA32F>(i, j);
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * Radix-2 fast Fourier transform of complex data.
+ *
+ * The forward transform computes X[k] = sum_n x[n] exp(-2 pi i k n / N),
+ * the inverse transform includes the factor 1/N, so that it undoes the
+ * forward transform. Sizes must be powers of two, see next_size.
+ *
+ * Example:
+ *
+ *		FFT fft(FFT::next_size(n));
+ *		fft.transform(data.data(), false);
+ */
+
+#include <complex>
+#include <vector>
+
+class FFT
+{
+	public:
+		explicit FFT(int size);
+
+		int size() const { return m_size; }
+
+		// Transform size() elements in place.
+		void transform(std::complex<float>* data, bool inverse) const;
+
+		// Transform a row-major width x height array in place, rows and
+		// columns in parallel.
+		static void transform_2d(std::complex<float>* data, int width, int height, bool inverse);
+
+		// The smallest power of two that is at least n.
+		static int next_size(int n);
+
+		// a * b. std::complex multiplication checks for infinities and NaNs,
+		// which is a library call without -ffast-math.
+		static std::complex<float> multiply(std::complex<float> a, std::complex<float> b)
+		{
+			return std::complex<float>(a.real() * b.real() - a.imag() * b.imag(),
+				a.real() * b.imag() + a.imag() * b.real());
+		}
+
+	private:
+		int m_size;
+		// exp(-2 pi i k / size) for k < size/2.
+		std::vector<std::complex<float>> m_twiddles;
+};
@@ -27,7 +27,9 @@ namespace GUI {
 	void draw();
 
 	bool init_host(Parameters& params);
-	int display_host(Image const& frame_buffer, std::function<void()> const& render_overlay);
+	// render_windows may add ImGui windows of its own.
+	int display_host(Image const& frame_buffer, std::function<void()> const& render_overlay,
+		std::function<void()> const& render_windows = []() {});
 
 	bool init_device(Parameters& params, int context_flags);
 	void display_device();
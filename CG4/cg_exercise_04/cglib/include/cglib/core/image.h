@@ -8,6 +8,8 @@
 #include <complex>
 //#include <omp.h>
 
+struct StridedImageView;
+
 class Image
 {
 public:
@@ -61,6 +63,8 @@ public:
 	 *   part of the buffer respecively
 	 */
 	static void image_to_complex(Image const& img, std::vector<std::complex<float>>* vec, bool rgba);
+	// The same for float pixels anywhere in memory, e.g. of a PfmView.
+	static void image_to_complex(StridedImageView const& view, std::vector<std::complex<float>>* vec, bool rgba);
 
 	enum WrapMode { ZERO, CLAMP, REPEAT };
 	glm::vec4 getPixel(int i, int j, WrapMode wrap_mode) const;
@@ -70,10 +74,82 @@ public:
 
 	void filter          (Image *target, int kernel_size, float* kernel, WrapMode wrap_mode = CLAMP) const;
 	void filter_separable(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode = CLAMP) const;
+	void filter_separable(Image *target, int kernel_size, float* horizontal, float* vertical, WrapMode wrap_mode) const;
 
 	void filter_gaussian(Image *target, float sigma, int kernel_size, WrapMode wrap_mode = CLAMP) const;
 	void filter_gaussian_separable(Image *target, float sigma, int kernel_size, WrapMode wrap_mode = CLAMP) const;
 
+	/*
+	 * Gaussian blur with a recursive (IIR) filter, whose cost per pixel does
+	 * not depend on sigma. The kernel is not truncated, so the result is
+	 * close to filter_gaussian with a kernel radius of about 3*sigma.
+	 */
+	void filter_gaussian_recursive(Image *target, float sigma, WrapMode wrap_mode = CLAMP) const;
+
+	/*
+	 * The largest difference in any channel between filter_gaussian_recursive
+	 * and filter_gaussian with a kernel radius of 4*sigma, relative to the
+	 * largest value of the image.
+	 */
+	float recursive_gaussian_error(float sigma, WrapMode wrap_mode = CLAMP) const;
+
+	/*
+	 * The largest difference in any channel between two filtered versions
+	 * of this image, relative to the largest value of the image. Checks the
+	 * fast filters against the result of filter.
+	 */
+	float filter_error(Image const& filtered, Image const& reference) const;
+
+	/*
+	 * Convolve with a 2d kernel like filter, but through the FFT. The image
+	 * is extended by the kernel radius with the wrap mode and padded to
+	 * powers of two, so the cost per pixel grows only with the logarithm
+	 * of the image size, not with the kernel size.
+	 */
+	void filter_fft(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode = CLAMP) const;
+
+	enum FilterAlgorithm { FILTER_DIRECT, FILTER_SEPARABLE, FILTER_FFT };
+	static const char* filter_algorithm_name(FilterAlgorithm algorithm);
+
+	/*
+	 * The fastest way to convolve a width x height image with a kernel of
+	 * the given size, which is a sum of rank separable kernels (0 if that
+	 * is not known). The cost model is calibrated with a small image when
+	 * it is first used.
+	 */
+	static FilterAlgorithm select_filter_algorithm(int width, int height, int kernel_size, int rank);
+
+	/*
+	 * Convolve with a 2d kernel like filter. Depending on what
+	 * select_filter_algorithm predicts to be fastest, this runs filter,
+	 * filter_fft or one filter_separable per term of the exact
+	 * separable_approximation of the kernel. Returns the algorithm that
+	 * was used.
+	 */
+	FilterAlgorithm filter_auto(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode = CLAMP) const;
+
+	/*
+	 * Approximate a 2d kernel as in filter by the sum of rank separable
+	 * kernels horizontal[i*kernel_size + dx] * vertical[i*kernel_size + dy],
+	 * from its singular value decomposition. The fewest terms are kept whose
+	 * error is at most tolerance times the Frobenius norm of the kernel.
+	 * Returns rank.
+	 */
+	static int separable_approximation(int kernel_size, float const* kernel, float tolerance,
+		std::vector<float>* horizontal, std::vector<float>* vertical);
+
+	/*
+	 * Convolve with any 2d kernel like filter, at the cost of a few
+	 * separable passes: one per term of separable_approximation with the
+	 * given tolerance. Returns the number of terms.
+	 */
+	int filter_low_rank(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode = CLAMP,
+		float tolerance = 1e-3f) const;
+
+	// Sum of filter_separable over the terms of a separable_approximation.
+	void filter_separable_terms(Image *target, int kernel_size, int rank,
+		float* horizontal, float* vertical, WrapMode wrap_mode = CLAMP) const;
+
 protected:
 	int m_width;
 	int m_height;
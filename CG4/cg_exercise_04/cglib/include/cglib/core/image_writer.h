@@ -0,0 +1,104 @@
+#pragma once
+
+/*
+ * Writes an image in bands of rows, so that the whole image never has to
+ * be in memory.
+ *
+ * The format follows the extension: png and ppm are 8 bit and gamma
+ * encoded, pfm keeps the floats. PNG and PPM files start with the top row
+ * of the image, PFM files with the bottom row (y = 0) like Image, so the
+ * bands have to arrive in the order given by bottom_up().
+ *
+ * Example:
+ *
+ *		ImageWriter writer;
+ *		writer.open("poster.png", width, height, 2.2f);
+ *		for (...) // bands from the top of the image down
+ *			writer.write_rows(band, 0, band.getHeight());
+ *		writer.close();
+ */
+
+#include <cglib/core/png_writer.h>
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Image;
+
+/*
+ * Gamma encoding of linear values to 8 bit by table lookup, with the same
+ * result as truncating 255*pow(max(0,v), 1/gamma) to [0,255].
+ *
+ * thresholds[b] is the smallest value that is encoded to at least b. A 12
+ * bit table gives the code at the start of each of 4096 intervals of
+ * [0,1], from where the code is corrected by comparing against the
+ * thresholds, which takes no step for almost all values.
+ */
+class GammaEncoder
+{
+	public:
+		explicit GammaEncoder(float gamma);
+
+		std::uint8_t operator()(float v) const
+		{
+			if (!(m_gamma > 0.f))
+				return reference(v);
+			if (!(v >= m_thresholds[1]))
+				return 0;
+			if (v >= m_thresholds[255])
+				return 255;
+			int b = m_start[int(v * table_size)];
+			while (v >= m_thresholds[b + 1])
+				++b;
+			while (v < m_thresholds[b])
+				--b;
+			return std::uint8_t(b);
+		}
+
+	private:
+		static int const table_size = 4096;
+
+		std::uint8_t reference(float v) const;
+
+		float        m_gamma;
+		float        m_thresholds[256];
+		std::uint8_t m_start[table_size + 1];
+};
+
+class ImageWriter
+{
+	public:
+		ImageWriter();
+		~ImageWriter();
+
+		// Write the header. Fails for formats other than png, ppm and pfm.
+		bool open(std::string const& path, int width, int height, float gamma);
+		// End the file after all rows were written.
+		bool close();
+		bool is_open() const;
+
+		// Whether the rows are written from y = 0 upwards, otherwise from
+		// the top of the image down.
+		bool bottom_up() const { return m_format == FORMAT_PFM; }
+
+		// Write the rows [y_begin, y_end) of band, which must be the next
+		// rows of the image in the order of bottom_up().
+		bool write_rows(Image const& band, int y_begin, int y_end);
+		int rows_written() const { return m_rows; }
+
+	private:
+		enum Format { FORMAT_PNG, FORMAT_PPM, FORMAT_PFM };
+
+		Format                        m_format;
+		std::string                   m_path;
+		int                           m_width;
+		int                           m_height;
+		int                           m_rows;
+		std::unique_ptr<GammaEncoder> m_encode;
+		PngWriter                     m_png;
+		std::ofstream                 m_file; // PPM and PFM
+		std::vector<std::uint8_t>     m_rgb;
+};
@@ -177,6 +177,10 @@ public:
 
 	bool loadMaterialFile(const std::string& filename);
 
+	/// Loads only the material files named in the header of a .obj file, i.e. before its first
+	/// vertex or face. This is cheap and tells the textures of a model before its geometry is parsed.
+	bool loadMaterialLibraries(const std::string& filename);
+
 	/// Returns the reference to the model, the index must be valid
 	std::shared_ptr<const OBJModel> getModel(size_t index) const;
 	std::shared_ptr<OBJModel> getModel(size_t index);
@@ -0,0 +1,161 @@
+#pragma once
+
+/*
+ * Data-parallel loops on top of the thread pool.
+ *
+ * parallel_for and parallel_reduce split a blocked range in halves until a
+ * piece holds at most grain elements (per dimension for 2D ranges), and run
+ * the pieces as tasks. Inside a kernel, the pool of the calling worker is
+ * used, otherwise ThreadPool::global(). The calling thread processes pieces
+ * as well.
+ *
+ * Example:
+ *
+ *		parallel_for(BlockedRange2D(0, width, 0, height), 32,
+ *			[&](BlockedRange2D const& r)
+ *			{
+ *				for (int y = r.y.begin; y < r.y.end; ++y)
+ *				for (int x = r.x.begin; x < r.x.end; ++x)
+ *					...
+ *			});
+ */
+
+#include <cglib/core/thread_pool.h>
+
+#include <algorithm>
+
+/*
+ * The half-open interval [begin, end).
+ */
+struct BlockedRange
+{
+	BlockedRange(int begin_, int end_) :
+		begin(begin_), end(end_)
+	{}
+
+	int size() const { return end - begin; }
+	bool empty() const { return end <= begin; }
+	bool is_divisible(int grain) const { return size() > std::max(1, grain); }
+
+	// Keep the lower half and return the upper half.
+	BlockedRange split()
+	{
+		int const mid = begin + size() / 2;
+		BlockedRange const upper(mid, end);
+		end = mid;
+		return upper;
+	}
+
+	int begin;
+	int end;
+};
+
+/*
+ * The rectangle [x.begin, x.end) x [y.begin, y.end).
+ */
+struct BlockedRange2D
+{
+	BlockedRange2D(int x_begin, int x_end, int y_begin, int y_end) :
+		x(x_begin, x_end), y(y_begin, y_end)
+	{}
+
+	bool empty() const { return x.empty() || y.empty(); }
+	bool is_divisible(int grain) const { return x.is_divisible(grain) || y.is_divisible(grain); }
+
+	// Split the longer side, keep the lower half and return the upper half.
+	BlockedRange2D split()
+	{
+		BlockedRange2D upper = *this;
+		if (x.size() >= y.size())
+		{
+			upper.x = x.split();
+		}
+		else
+		{
+			upper.y = y.split();
+		}
+		return upper;
+	}
+
+	BlockedRange x;
+	BlockedRange y;
+};
+
+inline ThreadPool& parallel_pool()
+{
+	ThreadPool* pool = ThreadPool::current();
+	return pool ? *pool : ThreadPool::global();
+}
+
+template <class Range, class Func>
+void parallel_for_recursive(ThreadPool& pool, Range range, int grain, Func const& fn)
+{
+	if (range.empty())
+	{
+		return;
+	}
+
+	TaskGroup group(pool);
+	while (range.is_divisible(grain))
+	{
+		Range const upper = range.split();
+		group.spawn([&pool, upper, grain, &fn] { parallel_for_recursive(pool, upper, grain, fn); });
+	}
+	fn(range);
+	group.sync();
+}
+
+/*
+ * Call fn(piece) for pieces of range that together cover it exactly once.
+ */
+template <class Range, class Func>
+void parallel_for(Range const& range, int grain, Func const& fn)
+{
+	if (!range.is_divisible(grain))
+	{
+		if (!range.empty())
+		{
+			fn(range);
+		}
+		return;
+	}
+	parallel_for_recursive(parallel_pool(), range, grain, fn);
+}
+
+template <class Range, class T, class Func, class Join>
+T parallel_reduce_recursive(ThreadPool& pool, Range range, int grain,
+		T const& identity, Func const& fn, Join const& join)
+{
+	if (!range.is_divisible(grain))
+	{
+		return fn(range, identity);
+	}
+
+	Range const upper = range.split();
+	T upper_result = identity;
+	TaskGroup group(pool);
+	group.spawn([&] { upper_result = parallel_reduce_recursive(pool, upper, grain, identity, fn, join); });
+	T const lower_result = parallel_reduce_recursive(pool, range, grain, identity, fn, join);
+	group.sync();
+	return join(lower_result, upper_result);
+}
+
+/*
+ * Reduce range to a single value. fn(piece, value) accumulates a piece into
+ * value and returns the result, join(a, b) combines the results of two
+ * neighboring pieces. The split only depends on the range and grain, so the
+ * result is deterministic.
+ */
+template <class Range, class T, class Func, class Join>
+T parallel_reduce(Range const& range, int grain, T const& identity, Func const& fn, Join const& join)
+{
+	if (range.empty())
+	{
+		return identity;
+	}
+	if (!range.is_divisible(grain))
+	{
+		return fn(range, identity);
+	}
+	return parallel_reduce_recursive(parallel_pool(), range, grain, identity, fn, join);
+}
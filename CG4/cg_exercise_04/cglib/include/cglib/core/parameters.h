@@ -1,8 +1,10 @@
 #pragma once
 
 #include <cglib/core/camera.h>
+#include <cglib/core/topology.h>
 
 #include <cstdint>
+#include <ostream>
 #include <string>
 
 struct CTwBar;
@@ -31,6 +33,9 @@ public:
 	// The number of threads to be used for rendering. Defaults to number of hardware threads -1.
 	int  num_threads;
 
+	// How to pin the rendering threads to processors.
+	ThreadAffinity thread_affinity = AFFINITY_NONE;
+
 	// The size of the image to be rendered.
 	int image_width  = 512;
 	int image_height = 512;
@@ -45,8 +50,38 @@ public:
 	// The size of a render tile.
 	std::uint32_t tile_size = 32;
 
+	// Pick the tile size by timing render passes with different sizes.
+	bool auto_tile_size = false;
+
+	// The order in which tiles are rendered. Cost order renders the most
+	// expensive tiles of the previous frame first, the first frame uses the spiral.
+	enum TileOrder {
+		TILE_ORDER_SPIRAL,
+		TILE_ORDER_COST,
+		TILE_ORDER_HILBERT
+	};
+	TileOrder tile_order = TILE_ORDER_COST;
+
+	// Split the last tiles of a frame into sub-tiles so that idle threads can help.
+	bool split_tiles = true;
+
+	// Report thread pool statistics: printed after noninteractive renders,
+	// shown in a window in gui mode.
+	bool stats = false;
+
 	// In gui mode, display with this many frames per second.
 	std::uint32_t fps = 60;
+
+	// Time budget for noninteractive renders in seconds. If positive, render
+	// progressively until the budget is used up. Loading the scene does not
+	// count. 0 disables the budget.
+	float time_budget = 0.0f;
+
+	// Noninteractive renders without a time budget render bands of this
+	// many rows (rounded up to whole tiles) and write each band to the
+	// output file when it is finished, so only two bands are in memory.
+	// 0 renders the whole image at once.
+	int stream_rows = 0;
 	
 	// Run in interactive mode?
 	bool interactive = true;
@@ -72,5 +107,10 @@ public:
 protected:
 	// Implement the following to handle your own parameters.
 	virtual bool derived_change_requires_restart(Parameters const& old) const { return false; }
+
+	// Implement the following to parse your own command line options.
+	// Returns the number of consumed arguments, 0 if arg is unknown and -1 on error.
+	virtual int derived_parse_option(std::string const& arg, int argc, char const** argv, int i) { return 0; }
+	virtual void derived_print_help(std::ostream& os) const {}
 };
 
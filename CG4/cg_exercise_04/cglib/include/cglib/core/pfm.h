@@ -0,0 +1,97 @@
+#pragma once
+
+/*
+ * PFM files without copies.
+ *
+ * PfmView maps a file into memory where the system supports it (and reads
+ * it otherwise), so the pixels can be used directly, e.g. by
+ * Image::image_to_complex. write_pfm writes from a StridedImageView, so
+ * any float pixels can be saved without converting them to an Image first.
+ *
+ * Example:
+ *
+ *		PfmView pfm;
+ *		if (pfm.open("assets/mystery.pfm"))
+ *			Image::image_to_complex(pfm.pixels(), &spectrum, false);
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+class Image;
+
+/*
+ * Read-only float pixels with 1 or 3 channels anywhere in memory. Channel
+ * c of pixel (x, y) starts at data + y*row_stride + x*pixel_stride +
+ * c*sizeof(float). The strides are in bytes and need not be multiples of
+ * sizeof(float).
+ */
+struct StridedImageView
+{
+	StridedImageView() :
+		data(nullptr), width(0), height(0), channels(0), pixel_stride(0), row_stride(0)
+	{}
+
+	// The RGB channels of an image.
+	static StridedImageView of(Image const& image);
+
+	float at(int x, int y, int c) const
+	{
+		float value;
+		std::memcpy(&value, data + y * row_stride + x * pixel_stride + c * std::ptrdiff_t(sizeof(float)), sizeof(float));
+		return value;
+	}
+
+	// Whether the rows lie back to back without gaps, as in a PFM file.
+	bool is_packed() const
+	{
+		return pixel_stride == std::ptrdiff_t(channels * sizeof(float))
+			&& row_stride == width * pixel_stride;
+	}
+
+	char const*    data;
+	int            width;
+	int            height;
+	int            channels;
+	std::ptrdiff_t pixel_stride;
+	std::ptrdiff_t row_stride;
+};
+
+class PfmView
+{
+public:
+	PfmView();
+	~PfmView();
+
+	// Only little endian files are supported, as by Image::load_pfm.
+	bool open(std::string const& path);
+	void close();
+	bool is_open() const { return m_pixels.data != nullptr; }
+
+	int getWidth() const { return m_pixels.width; }
+	int getHeight() const { return m_pixels.height; }
+	// Rows from bottom to top, as in Image.
+	StridedImageView const& pixels() const { return m_pixels; }
+
+	// Copy into an image with alpha 0, as Image::load_pfm does.
+	void to_image(Image* image) const;
+
+private:
+	PfmView(PfmView const&);
+	PfmView& operator=(PfmView const&);
+
+	void*              m_mapping;
+	std::size_t        m_mapping_size;
+	std::vector<char>  m_contents; // if the file is not mapped
+	StridedImageView   m_pixels;
+};
+
+// Write the pixels as PFM, "PF" for 3 channels and "Pf" for 1.
+bool write_pfm(std::string const& path, StridedImageView const& view);
+
+// The parts of write_pfm, for files that are written a few rows at a time.
+void write_pfm_header(std::ostream& os, int width, int height, int channels);
+bool write_pfm_rows(std::ostream& os, StridedImageView const& view, int y_begin, int y_end);
@@ -0,0 +1,63 @@
+#pragma once
+
+/*
+ * PNG encoder that filters and compresses bands of rows in parallel.
+ *
+ * Every band is compressed on its own by stb's deflate and becomes one
+ * block of a single zlib stream, so a band cannot refer back into the
+ * band before it. The image data is written as it is compressed, the rows
+ * can be passed in several calls.
+ *
+ * Example:
+ *
+ *		PngWriter png;
+ *		png.open("out.png", width, height, 3);
+ *		png.write_rows(top_half, height/2, 3*width);
+ *		png.write_rows(bottom_half, height - height/2, 3*width);
+ *		png.close();
+ */
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class PngWriter
+{
+	public:
+		PngWriter();
+		~PngWriter();
+
+		// Write the header. components is 1 (grey), 3 (RGB) or 4 (RGBA).
+		bool open(std::string const& path, int width, int height, int components);
+		// Append the next rows, from top to bottom. Row i starts at
+		// pixels + i*stride_bytes.
+		bool write_rows(std::uint8_t const* pixels, int rows, int stride_bytes);
+		// End the image after all rows were written.
+		bool close();
+
+		bool is_open() const { return m_file.is_open(); }
+
+	private:
+		void append_bits(std::uint8_t const* bits, std::size_t count);
+		bool write_chunks(char const* type, std::vector<std::uint8_t> const& data);
+
+		std::ofstream m_file;
+		std::string   m_path;
+		int           m_width;
+		int           m_height;
+		int           m_components;
+		int           m_rows;
+		std::vector<std::uint8_t> m_previous_row;
+
+		// The zlib stream: bytes not written yet, bits that do not fill a
+		// byte yet and the checksum of the filtered rows so far.
+		std::vector<std::uint8_t> m_stream;
+		std::uint32_t m_pending;
+		int           m_pending_bits;
+		std::uint32_t m_adler;
+};
+
+// Write a whole image with PngWriter.
+bool write_png(std::string const& path, int width, int height, int components,
+	std::uint8_t const* pixels, int stride_bytes);
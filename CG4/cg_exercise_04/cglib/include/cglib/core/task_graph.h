@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * A set of tasks with dependencies that runs on a thread pool.
+ *
+ * A task is started as soon as all tasks it depends on are finished, so
+ * independent chains of tasks run concurrently. Tasks may use the pool
+ * themselves, e.g. through parallel_for. run() blocks until all tasks are
+ * finished. If a task throws, the tasks depending on it are skipped and
+ * run() rethrows the first exception.
+ *
+ * Example:
+ *
+ *		TaskGraph graph;
+ *		TaskGraph::TaskId parse = graph.add("parse", [&] { ... });
+ *		TaskGraph::TaskId bvh   = graph.add("bvh",   [&] { ... }, { parse });
+ *		graph.run(ThreadPool::global());
+ */
+
+#include <cglib/core/thread_pool.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+class TaskGraph
+{
+	public:
+		typedef int TaskId;
+
+		// Add a task. Dependencies must be tasks that were added before.
+		TaskId add(std::string const& name, std::function<void()> task,
+			std::vector<TaskId> const& dependencies = std::vector<TaskId>());
+
+		void run(ThreadPool& pool);
+
+		// Timings of the last run in seconds.
+		double wall_seconds() const { return m_wallSeconds; }
+		// The longest chain of dependent tasks. No schedule can be faster.
+		double critical_path_seconds() const;
+		// Sum over all tasks, i.e. the time of a serial run.
+		double serial_seconds() const;
+
+		// Start and duration of every task of the last run.
+		void print_timings(std::ostream& os) const;
+
+	private:
+		struct Node
+		{
+			std::string           name;
+			std::function<void()> task;
+			std::vector<TaskId>   dependencies;
+			std::vector<TaskId>   successors;
+			std::atomic<int>      pending; // unfinished dependencies
+			double                start;   // seconds since the start of the run
+			double                seconds;
+		};
+
+		void execute(TaskGroup& group, TaskId id);
+
+		std::vector<std::unique_ptr<Node>>    m_nodes;
+		std::chrono::steady_clock::time_point m_start;
+		double                                m_wallSeconds = 0.0;
+};
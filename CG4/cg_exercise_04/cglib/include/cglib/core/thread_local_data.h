@@ -19,9 +19,12 @@ struct ThreadLocalData
 	
 	ThreadLocalData() {}
 
-	virtual void initialize(int threadId) final
+	// The sequence number distinguishes the runs of a thread, so that
+	// each run draws different random numbers.
+	virtual void initialize(int threadId, unsigned sequence = 0) final
 	{
-		rng.seed(8890 + threadId);
+		std::seed_seq seed = { 8890u + unsigned(threadId), sequence };
+		rng.seed(seed);
 	}
 
 	inline float rand()
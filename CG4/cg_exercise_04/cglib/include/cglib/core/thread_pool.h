@@ -2,37 +2,174 @@
 
 /*
  * A very simple thread pool. It runs a given number of jobs concurrently with a fixed thread budget.
+ * The worker threads are created once and sleep between runs, so starting a new run only wakes them up.
+ *
+ * Work is scheduled by work stealing: every worker owns a deque of tasks, pushes and pops at
+ * its bottom end and steals from the top of other workers' deques when it runs out of work.
+ * The jobs of a run are handed out as ranges that are split in halves, so a thief always takes
+ * half of the remaining range of its victim.
+ * Kernels can spawn nested tasks through a TaskGroup and wait for them with sync().
+ *
+ * Every run owns its kernel, thread local data and terminate flag. Starting a new run cancels
+ * the previous one without waiting for it: its queued jobs are dropped and jobs that are
+ * already executing finish in the background with the state of their own run.
+ *
+ * Workers can be pinned to processors. The pool then has one injection queue per NUMA node,
+ * the jobs of a run are divided into contiguous blocks, one per node, and idle workers look
+ * for work on their own node before they steal from other nodes.
+ *
+ * Every worker counts its busy and parked time, tasks, jobs and steals, see stats().
  */
 
 #include <cglib/core/thread_local_data.h>
+#include <cglib/core/topology.h>
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include <sstream>
+#include <iosfwd>
+
+class ThreadPool;
+class WorkStealingDeque;
+
+/*
+ * A snapshot of the counters of a thread pool since it was created or
+ * since the last reset_stats(). Times are in seconds.
+ */
+struct ThreadPoolStats
+{
+	// Job durations are counted in powers of two of microseconds. Bucket 0
+	// holds jobs below 1us, bucket i jobs in [2^(i-1), 2^i) us and the
+	// last bucket all longer ones.
+	static const int NUM_DURATION_BUCKETS = 24;
+
+	struct Worker
+	{
+		double    busy_seconds;   // executing tasks
+		double    idle_seconds;   // looking for work or parked
+		double    parked_seconds; // the part of the idle time spent sleeping
+		long long num_jobs;       // jobs of runs
+		long long num_tasks;      // everything executed: job ranges, spawned tasks, ...
+		long long num_steals;     // tasks taken from the deques of other workers
+	};
+
+	double              seconds = 0.0;
+	std::vector<Worker> workers;
+	long long           job_durations[NUM_DURATION_BUCKETS];
+	int                 num_runs = 0;
+	double              dispatch_latency_seconds = 0.0; // average from run() to the first job
+	int                 num_terminates = 0;
+	double              terminate_seconds = 0.0;        // total time spent in terminate()
+	double              max_terminate_seconds = 0.0;
+
+	long long num_jobs() const;
+
+	// Busy time of all workers over the measured time of all workers.
+	double utilization() const;
+
+	// Busy time of the busiest worker over the mean busy time. 1 is perfectly balanced.
+	double imbalance() const;
+
+	// Upper limit of a duration bucket.
+	static double bucket_limit_seconds(int bucket);
+
+	void print(std::ostream& os) const;
+};
+
+/*
+ * A set of tasks that can be waited for.
+ *
+ * spawn() may be called from any thread, including from inside a running
+ * kernel or task. sync() waits until all spawned tasks are finished. Worker
+ * threads execute other tasks while waiting, but never start jobs of a run
+ * nested, other threads block. If a task throws, sync() rethrows the first
+ * exception.
+ */
+class TaskGroup
+{
+	public:
+		explicit TaskGroup(ThreadPool& pool);
+		~TaskGroup();
+
+		void spawn(std::function<void()> task);
+		void sync();
+
+	private:
+		friend class ThreadPool;
+
+		ThreadPool&        m_pool;
+		std::atomic<int>   m_pending;
+		std::exception_ptr m_exception;
+		std::mutex         m_exceptionMutex;
+};
 
 class ThreadPool
 {
 	public:
-		ThreadPool(unsigned max_threads = -1);
+		ThreadPool(unsigned max_threads = -1, ThreadAffinity affinity = AFFINITY_NONE);
 		~ThreadPool();
 		bool done() const;
+		// Cancel the current run and wait until no job of any run is executing anymore.
 		void terminate();
+		// Cancel the current run without waiting. Executing jobs see their terminate flag set.
+		void cancel();
 		void force_kill();
 
 		inline int num_jobs() const
 		{
-			return m_numJobs.load();
+			return m_run->numJobs.load();
 		}
 
 		inline int jobs_done() const
 		{
-			return m_jobsDone.load();
+			return m_run->jobsDone.load();
+		}
+
+		inline int num_threads() const
+		{
+			return static_cast<int>(m_threads.size());
+		}
+
+		// Index of the calling worker thread of this pool, or -1 if called from another thread.
+		int current_worker() const;
+
+		// NUMA nodes the workers are pinned to. Without pinning, the pool has a single node.
+		inline int num_nodes() const
+		{
+			return static_cast<int>(m_nodeIds.size());
+		}
+
+		// Operating system id of a node of the pool.
+		inline int node_id(int node) const
+		{
+			return m_nodeIds[node];
 		}
 
+		// Jobs [node_first_job(n), node_first_job(n + 1)) of a run are queued on node n.
+		inline int node_first_job(int node, int num_jobs) const
+		{
+			return static_cast<int>(static_cast<long long>(num_jobs) * node / num_nodes());
+		}
+
+		// The pool of the calling worker thread, or nullptr if called from another thread.
+		static ThreadPool* current();
+
+		// Pool for parallel algorithms that are called outside of any pool.
+		static ThreadPool& global();
+
+		// Number of workers and pinning of the global pool, e.g. from the command line.
+		// Replaces an existing global pool with different settings, so call it
+		// before the global pool is in use.
+		static void configure_global(unsigned max_threads, ThreadAffinity affinity);
+
 		template <class TLD = void>
 		void run(
 			// Number of instances to run.
@@ -46,15 +183,17 @@ class ThreadPool
             return (num_jobs() == 0 || float(jobs_done())/num_jobs() > 0.1);
         }
 
-		void
-		wait()
-		{
-			for(auto &i: m_threads) {
-				if(i->joinable()) {
-						i->join();
-				}
-			}
-		}
+		// Block until all jobs are done or were dropped, including jobs of cancelled runs.
+		void wait();
+
+		// Average time in seconds from calling run() until the first job started.
+		double average_dispatch_latency() const;
+		int num_runs() const { return m_numRuns.load(); }
+
+		// Counters since the pool was created or since the last reset.
+		// Call these from the thread that submits the runs.
+		ThreadPoolStats stats() const;
+		void reset_stats();
 
 		void poll_exceptions()
 		{
@@ -75,23 +214,123 @@ class ThreadPool
 		bool kill_at_timeout(int timeout);
 
 	private:
+		friend class TaskGroup;
+		friend class WorkStealingDeque;
+
+		struct Task
+		{
+			std::function<void()> fn;
+			TaskGroup*            group;
+		};
+
+		struct NodeQueue
+		{
+			std::deque<Task*> tasks;
+			std::mutex        mutex;
+		};
+
+		// Written by one worker only. Times are in nanoseconds.
+		struct WorkerCounters
+		{
+			std::atomic<long long> busy;
+			std::atomic<long long> parked;
+			std::atomic<long long> busySince;   // start of the running task, 0 if none
+			std::atomic<long long> parkedSince; // 0 if not parked
+			std::atomic<long long> numJobs;
+			std::atomic<long long> numTasks;
+			std::atomic<long long> numSteals;
+			std::atomic<long long> jobDurations[ThreadPoolStats::NUM_DURATION_BUCKETS];
+			char                   padding[64]; // keep workers off each other's cache lines
+
+			WorkerCounters() { reset(); }
+			void reset();
+		};
+
+		// The state of one run. Jobs keep their run alive, so a cancelled
+		// run is released when its last executing job returns.
+		struct Run
+		{
+			std::function<void(int, ThreadLocalData*, std::atomic<bool>&)> kernel;
+			std::vector<std::unique_ptr<ThreadLocalData>> tld;
+			std::atomic<int>                              numJobs;
+			std::atomic<int>                              jobsDone;
+			std::atomic<bool>                             terminate;
+			std::chrono::steady_clock::time_point         submitTime;
+			std::atomic<bool>                             firstJobStarted;
+
+			Run() : numJobs(0), jobsDone(0), terminate(true), firstJobStarted(true) {}
+		};
+
 		void run_internal(
 			int num_jobs,
 			std::function<void(int, ThreadLocalData* tld, std::atomic<bool>&)> kernel,
-			std::function<void(int, std::unique_ptr<ThreadLocalData>& tld)> tldAlloc
+			std::function<void(int, unsigned, std::unique_ptr<ThreadLocalData>& tld)> tldAlloc
 		);
 
+		// Assign workers to processors and nodes.
+		void assign_processors(ThreadAffinity affinity);
+
+		// Create missing worker threads.
+		void spawn_workers();
+		void worker_main(int threadId);
+
+		// Run jobs [begin, end) of run, splitting off the upper half while possible.
+		void run_range(std::shared_ptr<Run> const& run, int begin, int end);
+		void run_job(Run& run, int jobId, int threadId);
+
+		void push(Task* task);
+		void inject(Task* task, int node);
+		// Queue a task that threadId took but must not execute now.
+		void requeue(Task* task, int threadId);
+		Task* find_task(int threadId);
+		Task* pop_injected(int node);
+		Task* steal_on_node(int node, int threadId);
+		bool has_work() const;
+		void execute(Task* task);
+		void wake_worker();
+
+		// Block the calling thread until group has no pending tasks.
+		void wait_blocking(TaskGroup& group);
+
 	private:
 		std::vector<std::unique_ptr<std::thread>>     m_threads;
-		std::function<void(int, ThreadLocalData*, std::atomic<bool>&)>    m_kernel;
-		std::vector<std::unique_ptr<ThreadLocalData>> m_tld;
-		std::atomic<int>                              m_numJobs;
-		std::atomic<int>                              m_currentJob;
-		std::atomic<int>                              m_jobsDone;
-		std::atomic<bool>                             m_terminate;
+		std::shared_ptr<Run>                          m_run; // the latest run, only changed by the submitting thread
+		unsigned                                      m_runSequence; // number of runs, seeds their thread local data
 		std::atomic<bool>                             m_hasException;
 		std::vector<std::string>                      m_exceptionMsg;
 		std::mutex                                    m_exceptionMutex;
+
+		// Scheduling. Tasks spawned by workers go to their own deque, tasks
+		// spawned by other threads go to the injection queue of a node.
+		std::vector<std::unique_ptr<WorkStealingDeque>> m_deques;
+		std::vector<std::unique_ptr<NodeQueue>>       m_injected;
+		std::atomic<int>                              m_numInjected;
+		std::atomic<unsigned>                         m_nextInjected;
+
+		// Placement. Without pinning, m_workerCpu is -1 and all workers are on node 0.
+		std::vector<int>                              m_workerCpu;
+		std::vector<int>                              m_workerNode;
+		std::vector<int>                              m_nodeIds;
+		std::unique_ptr<TaskGroup>                    m_runGroup; // the jobs of all runs
+
+		// Parking. Idle workers sleep on m_wake until m_wakeEpoch changes.
+		// Threads outside the pool that wait for a task group sleep on m_idle.
+		std::mutex                                    m_mutex;
+		std::condition_variable                       m_wake;
+		std::condition_variable                       m_idle;
+		unsigned                                      m_wakeEpoch;
+		std::atomic<int>                              m_numSleeping;
+		std::atomic<int>                              m_numBlockedWaiters;
+		bool                                          m_shutdown;
+
+		// Statistics. Times are in nanoseconds.
+		std::atomic<long long>                        m_latencySum;
+		std::atomic<int>                              m_numRuns;
+		std::vector<std::unique_ptr<WorkerCounters>>  m_counters;
+		std::atomic<long long>                        m_statsStart;
+		int                                           m_numTerminates;
+		long long                                     m_terminateSum;
+		long long                                     m_terminateMax;
 };
 
 template <class TLD>
@@ -103,10 +342,10 @@ inline void ThreadPool::run(
 	static_assert(std::is_base_of<ThreadLocalData, TLD>::value,
 		"The template argument to ThreadPool::run must be void or be derived from ThreadLocalData.");
 
-	run_internal(num_jobs, kernel, [](int threadId, std::unique_ptr<ThreadLocalData>& tld) 
+	run_internal(num_jobs, kernel, [](int threadId, unsigned sequence, std::unique_ptr<ThreadLocalData>& tld) 
 		{
 			tld.reset(new TLD());
-			tld->initialize(threadId);
+			tld->initialize(threadId, sequence);
 		}
 	);
 }
@@ -117,7 +356,7 @@ inline void ThreadPool::run<void>(
 	std::function<void(int, ThreadLocalData* tld, std::atomic<bool>&)> kernel
 )
 {
-	run_internal(num_jobs, kernel, [](int, std::unique_ptr<ThreadLocalData>& tld) 
+	run_internal(num_jobs, kernel, [](int, unsigned, std::unique_ptr<ThreadLocalData>& tld) 
 		{
 			tld.reset();
 		}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+/*
+ * How worker threads are pinned to processors.
+ * Compact fills the processors of one NUMA node before using the next,
+ * scatter distributes consecutive threads round-robin over the nodes.
+ */
+enum ThreadAffinity
+{
+	AFFINITY_NONE,
+	AFFINITY_COMPACT,
+	AFFINITY_SCATTER
+};
+
+/*
+ * The NUMA layout of the machine. On Linux, it is read from sysfs.
+ * Elsewhere, all processors form a single node.
+ */
+struct CpuTopology
+{
+	std::vector<int>              node_ids;  // operating system id of each node
+	std::vector<std::vector<int>> node_cpus; // processors of each node
+
+	int num_nodes() const { return static_cast<int>(node_cpus.size()); }
+
+	static CpuTopology const& get();
+};
+
+// Pin the calling thread to a processor. Returns false if that is not supported.
+bool pin_current_thread(int cpu);
@@ -1,28 +1,231 @@
 #pragma once
 
 #include <cglib/core/gui.h>
+#include <cglib/core/heatmap.h>
 #include <cglib/core/thread_local_data.h>
 #include <cglib/core/thread_pool.h>
 #include <cglib/core/timer.h>
 #include <cglib/core/stereo.h>
 
+#include <cglib/rt/bvh.h>
 #include <cglib/rt/raytracing_context.h>
+#include <cglib/rt/ray.h>
+#include <cglib/rt/renderer.h>
 #include <cglib/rt/scene.h>
 #include <cglib/rt/render_data.h>
 
 #include <cglib/core/assert.h>
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <iostream>
-#include <mutex>
-
-static std::mutex mutex;
+#include <memory>
+#include <type_traits>
 
 struct RenderData;
 
+/*
+ * The buffers written by a render. color holds the final pixel colors,
+ * sample_count the number of samples that were taken for each pixel.
+ * Progressive renders sum up the samples of all passes in accum, color
+ * is then accum divided by sample_count. They also keep the running mean
+ * and variance of the luminance of every pixel for adaptive sampling.
+ *
+ * Tiles are disjoint, so workers write their pixels directly into the
+ * buffers. Every launch starts a new frame with a new generation. A
+ * finished tile is stamped with the generation of its frame, and the
+ * display thread only copies tiles stamped with the current generation
+ * into display. It drops a copy if a new frame started during it, so
+ * display never shows a tile that was being written.
+ *
+ * A restart does not wait for the tiles of the previous frame. A worker
+ * locks its tile while writing, so a tile of an older frame that is still
+ * running finishes its pixel and leaves before the new one starts, and
+ * its commit is dropped.
+ *
+ * A frame buffer may hold only a band of the image: the rows
+ * [first_row, first_row + num_rows). Launches render the tiles of the band.
+ */
+struct FrameBuffer
+{
+	// Without progressive, only color and sample_count are allocated. Such a
+	// frame buffer can only be rendered with sample_pass < 0 and not be displayed.
+	FrameBuffer(int width, int height, bool progressive = true);
+
+	// Use tiles of tile_size pixels, num_tiles_x * num_tiles_y in total.
+	// Must not be called while any tile is being rendered.
+	void set_tiling(int tile_size, int num_tiles_x, int num_tiles_y);
+	bool has_tiling(int tile_size, int num_tiles_x, int num_tiles_y) const;
+
+	// Start a new frame and return its generation.
+	unsigned begin_frame();
+	unsigned current_generation() const { return generation.load(); }
+
+	// Exclusive access to a tile while a worker writes it.
+	struct TileLock
+	{
+		TileLock(FrameBuffer& fb, int tile_x, int tile_y);
+		~TileLock();
+		std::atomic<bool>& busy;
+	};
+
+	// Publish a finished tile of frame gen that took seconds to render. Dropped
+	// if gen is not the current generation anymore. Returns true if the tile
+	// was published.
+	bool commit_tile(int tile_x, int tile_y, unsigned gen, long long num_tile_rays, float seconds);
+
+	// Render time of a tile in the last frame that finished it, 0 if none did.
+	float tile_cost(int tile_x, int tile_y) const;
+
+	// Copy tiles of the current frame that were finished since the last
+	// call into display. Returns true if any tile was copied.
+	bool present_completed_tiles();
+
+	// Average time in seconds from the start of a frame until its first tile was published.
+	double average_first_tile_latency() const;
+	int num_measured_frames() const { return num_first_tiles.load(); }
+
+	// Save the sample counts as a heatmap, normalized to max_count.
+	void save_sample_count(std::string const& path, int max_count) const;
+	void sample_count_image(Image* img, int max_count) const;
+
+	// Average number of samples per pixel.
+	double average_sample_count() const;
+	// Fraction of the rendered pixels that hold at least one sample.
+	double covered_fraction() const;
+
+	// Write a pixel rendered with num_samples samples in progressive pass
+	// sample_pass. Passes after the first accumulate.
+	inline void store(int x, int y, glm::vec4 const& c, int num_samples, int sample_pass)
+	{
+		int const i = (y - first_row) * color.getWidth() + x;
+		if (sample_pass < 0)
+		{
+			color.getPixels()[i] = c;
+			sample_count[i] = num_samples;
+			return;
+		}
+
+		// Weight the pass by the samples it took.
+		glm::vec4 sum   = float(std::max(1, num_samples)) * c;
+		int       count = std::max(1, num_samples);
+		if (sample_pass > 0)
+		{
+			sum   += accum.getPixels()[i];
+			count += sample_count[i];
+		}
+		accum.getPixels()[i] = sum;
+		sample_count[i] = count;
+		color.getPixels()[i] = sum / float(count);
+
+		// Welford's running mean and variance, one value per pass. Converged
+		// pixels are not stored anymore, so every stored pixel has all passes.
+		float const lum = luminance(glm::vec3(c));
+		glm::vec2& m = luminance_moments[i];
+		if (sample_pass == 0)
+		{
+			m = glm::vec2(lum, 0.f);
+			return;
+		}
+		float const delta = lum - m.x;
+		m.x += delta / float(sample_pass + 1);
+		m.y += delta * (lum - m.x);
+	}
+
+	// Replace the color of a pixel by a heatmap of its sample count, normalized to max_count.
+	// Its accumulated samples are kept.
+	inline void show_sample_count(int x, int y, int max_count)
+	{
+		int const i = (y - first_row) * color.getWidth() + x;
+		color.getPixels()[i] = glm::vec4(heatmap(float(sample_count[i]) / float(std::max(1, max_count))), 1.f);
+	}
+
+	// Whether a pixel has all samples of params or meets the adaptive stop
+	// criterion after the progressive passes so far. Each pass took
+	// samples_per_pass samples, e.g. one per eye in stereo.
+	inline bool pixel_converged(int x, int y, RaytracingParameters const& params, int samples_per_pass) const
+	{
+		int const i = (y - first_row) * color.getWidth() + x;
+		int const passes = sample_count[i] / samples_per_pass;
+		glm::vec2 const& m = luminance_moments[i];
+		return passes >= params.get_progressive_passes()
+			|| params.adaptive_converged(passes, m.x, m.y);
+	}
+
+	Image            color;
+	Image            accum;
+	std::vector<int> sample_count;
+	std::vector<glm::vec2> luminance_moments; // mean and sum of squared deviations of progressive passes
+	int              num_passes = 0;
+	std::atomic<long long> num_rays; // rays cast for all committed tiles since the last restart
+	std::atomic<long long> num_dropped_rays; // rays cast for tiles that were cancelled since the last restart
+	Image            display; // the finished tiles of color, owned by the display thread
+	int              first_row = 0; // of the image in row 0 of the buffers
+	int              num_rows;      // rendered rows, at most the height of the buffers
+
+private:
+	int tile_index(int tile_x, int tile_y) const;
+
+	int tile_size   = 0;
+	int num_tiles_x = 0;
+	int num_tiles_y = 0;
+	std::unique_ptr<std::atomic<unsigned>[]> tile_generation; // generation of the last commit
+	std::unique_ptr<std::atomic<bool>[]>     tile_busy;
+	std::unique_ptr<std::atomic<float>[]>    tile_seconds;
+	std::vector<unsigned>                    tile_presented;  // generation of the last copy into display
+	std::vector<glm::vec4>                   present_scratch; // a tile on its way into display
+
+	std::atomic<unsigned>  generation;
+	std::atomic<long long> frame_start;     // steady_clock nanoseconds
+	std::atomic<bool>      first_tile_done;
+	std::atomic<long long> first_tile_latency_sum;
+	std::atomic<int>       num_first_tiles;
+};
+
+/*
+ * The pixels [baseX, endX) x [baseY, endY) of a tile, rendered in progressive pass sample_pass.
+ */
+struct Tile
+{
+	int baseX, baseY;
+	int endX, endY;
+	int sample_pass;
+};
+
+/*
+ * Tries tile sizes on complete passes and keeps the fastest one.
+ */
+class TileSizeTuner
+{
+	public:
+		TileSizeTuner();
+
+		// Still trying tile sizes?
+		bool tuning() const { return current < static_cast<int>(candidates.size()); }
+
+		// The tile size for the next pass.
+		int tile_size() const { return tuning() ? candidates[current] : best; }
+
+		// Report the render time of a complete pass with tile_size().
+		void report(double seconds);
+
+	private:
+		std::vector<int>    candidates;
+		std::vector<double> pass_seconds;
+		int current = 0;
+		int best    = 32;
+};
+
 /*
  * Use this class to render on the host (so not primarily with OpenGL), in an image order fashion.
  * Will use a thread pool to launch multiple threads in parallel.
+ *
+ * The tile loop is a template on the pixel function, the render mode and stereo, so
+ * the per-pixel path has no indirect calls. One instantiation is selected per launch.
+ *
+ * Tiles are ordered by their render time in the previous frame, most expensive first,
+ * so that no expensive tile starts late. Once fewer tiles than threads are left, each
+ * remaining tile is split into sub-tiles that idle threads can steal.
  */
 class HostRender
 {
@@ -31,21 +234,259 @@ class HostRender
 		 * The parameters to the pixel function are:
 		 * int x, int y         (pixel coordinates)
 		 * centext const&       (The current context (scene+parameters)).
+		 *
+		 * run() accepts any functor or lambda with this signature. Plain
+		 * functions would be called through a pointer, wrap them in a lambda.
 		 */
 		typedef std::function<glm::vec3(int, int, RaytracingContext const&, RenderData &)> PixelFunc;
 
+		template <class PixelFn>
 		static int run(RaytracingContext& context, 
-				       PixelFunc const& render_pixel, 
+				       PixelFn const& render_pixel, 
 					   int kill_timeout_seconds = 0,
 					   std::function<void()> const& render_overlay = []() {} );
 
 	private:
-		typedef std::function<glm::vec3(int, int, RaytracingContext const&, ThreadLocalData*)> PixelFuncRaw;
+		/*
+		 * Render a tile into the frame buffer and count the cast rays in num_rays.
+		 * Returns false if terminated before all pixels were written.
+		 */
+		typedef std::function<bool(FrameBuffer* fb, RaytracingContext const& context, Tile const& tile,
+			ThreadLocalData* tld, std::atomic<bool>& terminate, long long* num_rays)> TileFunc;
+
+		// Returns the tile function for the render mode and stereo setting in params.
+		typedef std::function<TileFunc(RaytracingParameters const& params)> TileFuncSelector;
+
+		template <class PixelFn>
+		static TileFunc select_tile_func(PixelFn const& render_pixel, RaytracingParameters const& params);
+		template <RaytracingParameters::RenderMode Mode, class PixelFn>
+		static TileFunc select_stereo(PixelFn const& render_pixel, bool stereo);
+		template <RaytracingParameters::RenderMode Mode, bool Stereo, class PixelFn>
+		static bool render_tile(PixelFn const& render_pixel, FrameBuffer* fb, RaytracingContext const& context, Tile const& tile,
+			ThreadLocalData* tld, std::atomic<bool>& terminate, long long* num_rays);
+		template <RaytracingParameters::RenderMode Mode, bool Stereo, class PixelFn>
+		static glm::vec3 shade_pixel(PixelFn const& render_pixel, int x, int y, RaytracingContext const& context, RenderData& data);
+		// The sample count at the top of the heatmap of the sample count view.
+		static int max_sample_count(RaytracingParameters const& params)
+		{
+			return std::max(1, params.adaptive_sampling ? params.max_spp : params.spp);
+		}
+
+		static int run_tiles(RaytracingContext& context, TileFuncSelector const& select_tile_func,
+			int kill_timeout_seconds, std::function<void()> const& render_overlay);
 		static void generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx);
-		static int run_interactive(RaytracingContext& context, PixelFuncRaw const& render_pixel, 
+		static void generate_hilbert_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx);
+		// The tile order of the next launch.
+		static void order_tiles(FrameBuffer const* fb, ThreadPool const& thread_pool, Parameters const& params,
+			int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx);
+		static void distribute_tiles(ThreadPool const& thread_pool, std::vector<glm::ivec2>* tile_idx);
+		/*
+		 * Render a tile as sub-tiles of at least min_size pixels that idle workers can steal.
+		 * worker_tld holds the thread local data of every worker for the sub-tiles.
+		 */
+		static bool render_split(ThreadPool& thread_pool, TileFunc const& render_tile, FrameBuffer* fb, RaytracingContext const& context,
+			Tile const& tile, int min_size, std::vector<ThreadLocalData>& worker_tld, std::atomic<bool>& terminate,
+			long long* num_rays, double* seconds);
+		static int run_interactive(RaytracingContext& context, TileFuncSelector const& select_tile_func, 
 			std::function<void()> const& render_overlay = []() {} );
 		static int run_noninteractive(RaytracingContext& context, 
-			PixelFuncRaw const& render_pixel,
+			TileFuncSelector const& select_tile_func,
 			int kill_timeout_seconds);
-		static void launch(Image* fb, ThreadPool& thread_pool, RaytracingContext const* context, std::vector<glm::ivec2>* tile_idx, PixelFuncRaw render_pixel);
+		// Render bands of rows and write each one to the output as soon as it is finished.
+		static int run_streaming(RaytracingContext& context, TileFuncSelector const& select_tile_func,
+			int kill_timeout_seconds);
+		static void render_until_deadline(FrameBuffer* fb, ThreadPool& thread_pool, RaytracingContext* context, TileFuncSelector const& select_tile_func,
+			std::chrono::steady_clock::time_point deadline);
+		static int progressive_target_passes(RaytracingContext const& context);
+		// ImGui window with the statistics of the render pool.
+		static void display_thread_pool_stats(ThreadPool& thread_pool);
+		/*
+		 * Launch rendering of all tiles. sample_pass < 0 renders all samples of each pixel at once.
+		 * Otherwise, one sample per pixel is rendered and accumulated. sample_pass 0 resets the accumulation.
+		 */
+		static void launch(FrameBuffer* fb, ThreadPool& thread_pool, RaytracingContext const* context, TileFuncSelector const& select_tile_func,
+			int sample_pass = -1);
 };
+
+template <class PixelFn>
+inline int HostRender::run(RaytracingContext& context, 
+		PixelFn const& render_pixel, 
+		int kill_timeout_seconds,
+		std::function<void()> const& render_overlay)
+{
+	typedef typename std::decay<PixelFn>::type Fn;
+	static_assert(!std::is_pointer<Fn>::value,
+		"HostRender::run needs a functor or lambda, a function would be called through a pointer for every pixel.");
+	Fn const fn = render_pixel;
+	return run_tiles(context, [fn](RaytracingParameters const& params) { return select_tile_func(fn, params); },
+		kill_timeout_seconds, render_overlay);
+}
+
+template <class PixelFn>
+inline HostRender::TileFunc HostRender::select_tile_func(PixelFn const& render_pixel, RaytracingParameters const& params)
+{
+	switch (params.render_mode)
+	{
+		case RaytracingParameters::RECURSIVE:            return select_stereo<RaytracingParameters::RECURSIVE>(render_pixel, params.stereo);
+		case RaytracingParameters::DESATURATE:           return select_stereo<RaytracingParameters::DESATURATE>(render_pixel, params.stereo);
+		case RaytracingParameters::NUM_RAYS:             return select_stereo<RaytracingParameters::NUM_RAYS>(render_pixel, false);
+		case RaytracingParameters::NORMAL:               return select_stereo<RaytracingParameters::NORMAL>(render_pixel, false);
+		case RaytracingParameters::TIME:                 return select_stereo<RaytracingParameters::TIME>(render_pixel, false);
+		case RaytracingParameters::DUDV:                 return select_stereo<RaytracingParameters::DUDV>(render_pixel, false);
+		case RaytracingParameters::BVH_TIME:             return select_stereo<RaytracingParameters::BVH_TIME>(render_pixel, false);
+		case RaytracingParameters::AABB_INTERSECT_COUNT: return select_stereo<RaytracingParameters::AABB_INTERSECT_COUNT>(render_pixel, false);
+		case RaytracingParameters::SAMPLE_COUNT:         return select_stereo<RaytracingParameters::SAMPLE_COUNT>(render_pixel, false);
+		default: /* should never happen */
+			return select_stereo<RaytracingParameters::RENDER_MODE_COUNT>(render_pixel, false);
+	}
+}
+
+template <RaytracingParameters::RenderMode Mode, class PixelFn>
+inline HostRender::TileFunc HostRender::select_stereo(PixelFn const& render_pixel, bool stereo)
+{
+	using namespace std::placeholders;
+	if (stereo)
+		return std::bind(&render_tile<Mode, true, PixelFn>, render_pixel, _1, _2, _3, _4, _5, _6);
+	else
+		return std::bind(&render_tile<Mode, false, PixelFn>, render_pixel, _1, _2, _3, _4, _5, _6);
+}
+
+template <RaytracingParameters::RenderMode Mode, bool Stereo, class PixelFn>
+inline bool HostRender::render_tile(PixelFn const& render_pixel, FrameBuffer* fb, RaytracingContext const& context, Tile const& tile,
+	ThreadLocalData* tld, std::atomic<bool>& terminate, long long* num_rays)
+{
+	// Adaptive progressive renders stop shading a pixel once it converged.
+	bool const skip_converged = (Mode == RaytracingParameters::RECURSIVE || Mode == RaytracingParameters::DESATURATE
+			|| Mode == RaytracingParameters::SAMPLE_COUNT)
+		&& context.params.adaptive_sampling && tile.sample_pass > 0;
+	// Progressive passes take one sample each, so the sample count view shows
+	// the accumulated count of the pixel instead of the count of the pass.
+	bool const show_sample_count = Mode == RaytracingParameters::SAMPLE_COUNT && tile.sample_pass >= 0;
+
+	for (int y = tile.baseY; y < tile.endY; y++) 
+	{
+		for (int x = tile.baseX; x < tile.endX; x++) 
+		{
+			if (terminate.load())
+				return false;
+			if (skip_converged && fb->pixel_converged(x, y, context.params, Stereo ? 2 : 1))
+				continue;
+
+			RenderData data(context, tld);
+			data.sample_pass = tile.sample_pass;
+			if (show_sample_count)
+			{
+				glm::vec4 const color(render_pixel(x, y, context, data), 1.f);
+				*num_rays += data.num_traced_rays;
+				fb->store(x, y, color, data.num_samples, tile.sample_pass);
+				fb->show_sample_count(x, y, max_sample_count(context.params));
+				continue;
+			}
+			glm::vec4 const color(shade_pixel<Mode, Stereo>(render_pixel, x, y, context, data), 1.f);
+			*num_rays += data.num_traced_rays;
+			fb->store(x, y, color, data.num_samples, tile.sample_pass);
+		}
+	}
+	return true;
+}
+
+template <RaytracingParameters::RenderMode Mode, bool Stereo, class PixelFn>
+inline glm::vec3 HostRender::shade_pixel(PixelFn const& render_pixel, int x, int y, RaytracingContext const& context, RenderData& data)
+{
+	// Mode and Stereo are constants, the compiler drops all other cases.
+	switch(Mode) {
+
+		case RaytracingParameters::RECURSIVE:
+			if (Stereo)
+			{
+				// The pixel holds the samples of both eyes.
+				data.camera_mode = Camera::StereoLeft;
+				auto const left = render_pixel(x, y, context, data);
+				int const left_samples = data.num_samples;
+				data.camera_mode = Camera::StereoRight;
+				auto const right = render_pixel(x, y, context, data);
+				data.num_samples += left_samples;
+				return combine_stereo(left, right);
+			}
+			else
+			{
+				return render_pixel(x, y, context, data);
+			}
+
+		case RaytracingParameters::DESATURATE:
+			if (Stereo)
+			{
+				data.camera_mode = Camera::StereoLeft;
+				auto const left = render_pixel(x, y, context, data);
+				int const left_samples = data.num_samples;
+				data.camera_mode = Camera::StereoRight;
+				auto const right = render_pixel(x, y, context, data);
+				data.num_samples += left_samples;
+				return combine_stereo(desaturate(left), desaturate(right));
+			}
+			else
+			{
+				return desaturate(render_pixel(x, y, context, data));
+			}
+
+		case RaytracingParameters::NUM_RAYS:
+			render_pixel(x, y, context, data);
+			return heatmap(float(data.num_cast_rays - 1) / 64.0f);
+		case RaytracingParameters::NORMAL:
+			render_pixel(x, y, context, data);
+			if (context.params.normal_mapping)
+				return glm::normalize(data.isect.shading_normal) * 0.5f + glm::vec3(0.5f);
+			else
+			{
+				if (data.isect.isValid())
+					return glm::normalize(data.isect.normal) * 0.5f + glm::vec3(0.5f);
+				else
+					return glm::vec3(0.0f);
+			}
+		case RaytracingParameters::BVH_TIME:
+		case RaytracingParameters::TIME: {
+			Timer timer;
+			timer.start();
+			if(Mode == RaytracingParameters::TIME) {
+			    auto const color = render_pixel(x, y, context, data);
+			    (void) color;
+			}
+			else {
+				Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
+				for(auto& o: context.get_active_scene()->objects) {
+					BVH *bvh = dynamic_cast<BVH *>(o.get());
+					if(bvh) {
+						bvh->intersect(ray, nullptr);
+					}
+				}
+			}
+			timer.stop();
+			return heatmap(static_cast<float>(timer.getElapsedTimeInMilliSec()) * context.params.scale_render_time);
+		}
+		case RaytracingParameters::DUDV: {
+			auto const color = render_pixel(x, y, context, data);
+			(void) color;
+			if(!data.isect.isValid())
+				return glm::vec3(0.0);
+			return heatmap(std::log(1.0f + 5.0f * glm::length(data.isect.dudv)));
+		}
+		case RaytracingParameters::AABB_INTERSECT_COUNT: {
+			Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
+			glm::vec3 accum(0.0f);
+			for(auto& o: context.get_active_scene()->objects) {
+				auto *bvh = dynamic_cast<BVH *>(o.get());
+				if(bvh) {
+					accum += bvh->intersect_count(ray, 0, 0) * 0.02f;
+				}
+			}
+			return accum;
+		}
+		case RaytracingParameters::SAMPLE_COUNT: {
+			auto const color = render_pixel(x, y, context, data);
+			(void) color;
+			return heatmap(float(data.num_samples) / float(max_sample_count(context.params)));
+		}
+		default: /* should never happen */
+		return glm::vec3(1, 0, 1);
+	}
+}
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <cglib/rt/aabb.h>
+
 #include <glm/glm.hpp>
 
 #include <algorithm>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 // This is the default light implementation
 // which represents a point light and emitts
@@ -28,3 +32,51 @@ protected:
     glm::vec3 power;
 };
 
+
+/*
+ * Light hierarchy.
+ *
+ * A binary tree over the point lights of a scene. Every node bounds the
+ * positions of the lights below it and stores their total power. This gives
+ * a cheap estimate of how much a subtree contributes at a shading point, which
+ * is used to pick lights with probability proportional to their expected
+ * contribution.
+ */
+class LightTree
+{
+public:
+	/*
+	 * A light tree node. Leaves hold exactly one light (light_idx >= 0),
+	 * inner nodes have two children and light_idx == -1.
+	 */
+	struct Node {
+		AABB aabb;
+		float power   = 0.f; // luminance of the summed power of all lights below
+		int left      = -1;
+		int right     = -1;
+		int light_idx = -1;
+	};
+
+	/*
+	 * Rebuild the tree for the given lights.
+	 */
+	void build(std::vector<std::unique_ptr<Light>> const& lights);
+
+	/*
+	 * Randomly select a light for the shading point P using the random number
+	 * u in [0, 1). Returns the index of the light and stores the probability
+	 * of choosing it in pdf. Returns -1 if the tree is empty.
+	 */
+	int sample(glm::vec3 const& P, float u, float* pdf) const;
+
+	int num_lights() const { return static_cast<int>(light_positions.size()); }
+
+	std::vector<Node> nodes;
+
+private:
+	int build_recursive(std::vector<int>& light_indices, int first, int count);
+	float importance(Node const& node, glm::vec3 const& P) const;
+
+	std::vector<glm::vec3> light_positions;
+	std::vector<float> light_powers;
+};
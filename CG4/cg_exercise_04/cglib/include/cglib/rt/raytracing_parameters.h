@@ -25,6 +25,19 @@ class RaytracingParameters : public Parameters
 		TextureFilterMode get_tex_filter_mode() const;
 		TextureWrapMode get_tex_wrap_mode() const;
 
+		// Output file for the per-pixel sample counts of adaptive renders, a pfm
+		// for pfm outputs and a png otherwise.
+		std::string get_sample_count_file_name() const;
+
+		// Number of progressive passes that take every sample of a pixel once:
+		// spp, or max_spp with adaptive sampling, rounded down to a square grid
+		// of strata.
+		int get_progressive_passes() const;
+
+		// The adaptive stop criterion for a pixel with n samples whose luminance
+		// has the running mean and sum of squared deviations m2.
+		bool adaptive_converged(int n, float mean, float m2) const;
+
 		enum RenderMode {
 			RECURSIVE,
 			DESATURATE,
@@ -34,6 +47,7 @@ class RaytracingParameters : public Parameters
 			DUDV,
 			BVH_TIME,
 			AABB_INTERSECT_COUNT,
+			SAMPLE_COUNT,
 			RENDER_MODE_COUNT
 		};
 
@@ -42,6 +56,7 @@ class RaytracingParameters : public Parameters
 			"du dv",
 			"BVH Traversal Time",
 			"AABB Intersection Count",
+			"Sample Count",
 		};
 
 		enum Exercise {
@@ -74,11 +89,13 @@ class RaytracingParameters : public Parameters
 			GAUSS_INPUT,
 			GAUSS_NAIVE,
 			GAUSS_SEPARATED,
+			GAUSS_RECURSIVE,
+			GAUSS_AUTO,
 			GAUSS_MODE_COUNT
 		};
 
 		const char* gauss_mode_names[GAUSS_MODE_COUNT] = {
-			"input", "naive", "separated"
+			"input", "naive", "separated", "recursive", "auto"
 		};
 
 		int gauss_mode = GAUSS_INPUT;
@@ -97,21 +114,42 @@ class RaytracingParameters : public Parameters
 		bool transmission       = true;
 		bool fresnel            = true;
 		bool dispersion         = false;
+		float dispersion_tolerance = 0.1f; // angle in degrees below which refracted color channels share one ray
 		float scale_render_time = 10.0f;
 		float ray_epsilon       = 7.f*1e-3f;
 		float fovy              = 45.0f;
 
 		bool stratified = true;
 
+		// Progressive rendering (interactive mode): render one sample per
+		// pixel per pass and accumulate until the sample budget is reached.
+		bool progressive = true;
+
+		// Adaptive sampling: every pixel takes at least min_spp samples, more
+		// samples (up to max_spp) are only taken while the relative standard
+		// error of the pixel mean is above adaptive_threshold.
+		bool adaptive_sampling   = false;
+		int min_spp              = 4;
+		int max_spp              = 64;
+		float adaptive_threshold = 0.02f;
+
+		// Light sampling: instead of shading with every light, pick
+		// light_samples lights per shading point from the scene's light tree.
+		bool light_sampling = false;
+		int light_samples   = 4;
+
 		bool normal_mapping = false;
 		bool transform_objects = true;
 		int spp = 1; // number of samples per pixel
 
 		int num_triangles = 5;
+		int num_lights = 2; // Sponza scene
 
 		int tex_filter_mode = TextureFilterMode::TRILINEAR;
 		int tex_wrap_mode = TextureWrapMode::REPEAT;
 
 
-	private:
+	protected:
+		int derived_parse_option(std::string const& arg, int argc, char const** argv, int i) override;
+		void derived_print_help(std::ostream& os) const override;
 };
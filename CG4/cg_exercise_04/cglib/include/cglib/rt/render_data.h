@@ -22,6 +22,10 @@ struct RenderData
 	ThreadLocalData* tld;
 	Intersection isect;
 	int num_cast_rays = 0;
+	int num_traced_rays = 0; // all rays shot for the pixel, including num_cast_rays
+	int num_samples = 0; // number of samples taken for the pixel
+	int sample_pass = -1; // progressive rendering: take only sample number sample_pass, -1 takes all samples
+	int active_channels = 7; // dispersion: bit mask of the color channels carried by the current ray
 	float x = 0.0f;	// x-Coordinate of (Sub-)Pixel
 	float y = 0.0f;	// y-Coordinate of (Sub-)Pixel
 	Camera::Mode camera_mode = Camera::Mono;
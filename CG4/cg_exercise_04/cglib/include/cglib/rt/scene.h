@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cglib/rt/light.h>
 #include <cglib/rt/texture.h>
 
 #include <vector>
@@ -29,6 +30,7 @@ class Scene
 public:
 	std::shared_ptr<Camera> camera;
 	std::vector<std::unique_ptr<Light>> lights;
+	LightTree light_tree; // built from lights before rendering when light sampling is enabled
 	std::vector<std::unique_ptr<Object>> objects;
 	TextureContainer textures;
 	ImageTexture* env_map = nullptr;
@@ -120,6 +122,9 @@ public:
 	void init_scene(RaytracingParameters const& params);
     void refresh_scene(RaytracingParameters const& params);
 	void create_texture_quad(std::shared_ptr<ImageTexture> const& texture);
+
+	// The algorithm filter_auto chose in the last refresh in GAUSS_AUTO mode.
+	Image::FilterAlgorithm auto_algorithm = Image::FILTER_DIRECT;
 };
 
 class MonkeyScene : public Scene
@@ -143,6 +148,8 @@ public:
     void refresh_scene(RaytracingParameters const& params);
 	void init_camera(RaytracingParameters& params);
 private:
+	void create_lights(int num_lights);
+
 	bool scene_loaded = false;
 };
 
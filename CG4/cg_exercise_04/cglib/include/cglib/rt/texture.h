@@ -2,6 +2,8 @@
 
 #include <math.h>
 
+#include <cglib/core/compact_image.h>
+
 #include <glm/glm.hpp>
 
 #include <memory>
@@ -9,8 +11,6 @@
 #include <unordered_map>
 #include <string>
 
-class Image;
-
 enum TextureFilterMode {
 	NEAREST, 
 	BILINEAR, 
@@ -84,10 +84,29 @@ public:
 
 	void create_mipmap();
 
+	/*
+	 * Store the mip levels in a compact format, which is converted back
+	 * on every texel fetch. Without a format, the smallest one that keeps
+	 * level 0 exact is used, e.g. 8 bit for textures that were loaded from
+	 * 8 bit files. The float levels are released, so get_mip_levels() is
+	 * empty afterwards and the texture cannot be changed any more.
+	 */
+	PixelFormat compress();
+	void compress(PixelFormat format);
+	bool is_compressed() const { return !compact_levels.empty(); }
+	PixelFormat get_storage_format() const;
+
+	int get_num_levels() const;
+	int get_width(int level) const;
+	int get_height(int level) const;
+	std::size_t memory_bytes() const;
+
 	TextureFilterMode filter_mode;
 	TextureWrapMode wrap_mode;
 private:
 	std::vector<std::shared_ptr<Image>> mip_levels; // the different mip map textures
+	std::vector<std::shared_ptr<CompactImage>> compact_levels; // the mip levels after compress()
+	float gamma; // of the file the texture was loaded from
 };
 
 typedef std::unordered_map<std::string, std::shared_ptr<ImageTexture>> TextureContainer;
@@ -11,6 +11,7 @@
 class Material;
 class Intersection;
 class ImageTexture;
+class OBJFile;
 
 class TriangleSoup
 {
@@ -29,8 +30,35 @@ public:
 				 std::vector<int>&&       material_ids,
 				 std::vector<Material>&&  materials);
 
+	// Load an .obj file. The texture maps of its materials are taken from
+	// textures, maps that are not in there yet are loaded and added.
 	TriangleSoup(const std::string &obj_path, TextureContainer *textures);
 
+	// Geometry of a parsed .obj file, with constant material colors.
+	// Texture maps are bound afterwards with bind_textures().
+	TriangleSoup(OBJFile const& obj);
+
+	// Use the texture maps of the materials of obj, which this soup was
+	// built from. Maps that are not in textures yet are loaded and added.
+	// Only touches the materials, so it may run while a BVH is built.
+	void bind_textures(OBJFile const& obj, TextureContainer *textures);
+
+	// A texture map that is referenced by the materials of an .obj file.
+	struct TextureMap
+	{
+		std::string path;
+		bool        diffuse; // diffuse maps get a mip map
+	};
+
+	// The texture maps of the materials of obj, each path once.
+	static std::vector<TextureMap> texture_maps(OBJFile const& obj);
+
+	// Load a texture map the same way bind_textures() does.
+	static std::shared_ptr<ImageTexture> load_texture_map(TextureMap const& map);
+
     void fill_intersection(Intersection* isect, int triangle_id, float min_dist, glm::vec3 const& bary) const;
+
+private:
+	void load_geometry(OBJFile const& obj);
 };
 
@@ -0,0 +1,163 @@
+#include <cglib/core/compact_image.h>
+
+#include <cglib/core/assert.h>
+#include <cglib/core/parallel.h>
+
+#include <algorithm>
+#include <cmath>
+
+const char* pixel_format_names[PIXEL_FORMAT_COUNT] = {
+	"RGBA8", "RGB16F", "RGBA16F", "R32F", "RGBA32F"
+};
+
+namespace {
+
+template <PixelFormat F>
+void encode_image(Image const& image, GammaCurve const& curve, typename PixelTraits<F>::Storage* out)
+{
+	glm::vec4 const* in = image.getPixels();
+	parallel_for(BlockedRange(0, image.getWidth() * image.getHeight()), 1 << 14, [&](BlockedRange const& r)
+	{
+		for (int i = r.begin; i < r.end; ++i)
+			out[i] = PixelTraits<F>::encode(in[i], curve);
+	});
+}
+
+template <PixelFormat F>
+void decode_image(typename PixelTraits<F>::Storage const* in, GammaCurve const& curve, Image* image)
+{
+	glm::vec4* out = image->getPixels();
+	parallel_for(BlockedRange(0, image->getWidth() * image->getHeight()), 1 << 14, [&](BlockedRange const& r)
+	{
+		for (int i = r.begin; i < r.end; ++i)
+			out[i] = PixelTraits<F>::decode(in[i], curve);
+	});
+}
+
+// Whether every pixel survives the conversion to F and back unchanged.
+template <PixelFormat F>
+bool is_exact(Image const& image, GammaCurve const& curve)
+{
+	glm::vec4 const* in = image.getPixels();
+	return parallel_reduce(BlockedRange(0, image.getWidth() * image.getHeight()), 1 << 14, true,
+		[&](BlockedRange const& r, bool exact)
+		{
+			for (int i = r.begin; i < r.end && exact; ++i)
+				exact = PixelTraits<F>::decode(PixelTraits<F>::encode(in[i], curve), curve) == in[i];
+			return exact;
+		},
+		[](bool a, bool b) { return a && b; });
+}
+
+} // namespace
+
+// -----------------------------------------------------------------------------
+
+GammaCurve::GammaCurve(float gamma_) :
+	gamma(gamma_)
+{
+	// As in Image::load, so that loaded 8 bit images are stored exactly.
+	for (int i = 0; i < 256; ++i)
+		to_linear[i] = std::pow(i / 255.0f, gamma);
+}
+
+std::uint8_t GammaCurve::encode(float linear) const
+{
+	float const encoded = std::pow(std::max(0.f, linear), 1.f / gamma);
+	return std::uint8_t(std::min(255.f, encoded * 255.f + 0.5f));
+}
+
+// -----------------------------------------------------------------------------
+
+CompactImage::CompactImage() :
+	m_width(0),
+	m_height(0),
+	m_format(PIXEL_RGBA32F)
+{
+}
+
+CompactImage::CompactImage(int width, int height, PixelFormat format, float gamma) :
+	m_width(width),
+	m_height(height),
+	m_format(format),
+	m_curve(gamma),
+	m_data(std::size_t(width) * height * bytes_per_pixel(format), 0)
+{
+	cg_assert(format >= 0 && format < PIXEL_FORMAT_COUNT);
+}
+
+CompactImage::CompactImage(Image const& image, PixelFormat format, float gamma) :
+	CompactImage(image.getWidth(), image.getHeight(), format, gamma)
+{
+	switch (m_format)
+	{
+		case PIXEL_RGBA8:   encode_image<PIXEL_RGBA8>(image, m_curve, pixels<PIXEL_RGBA8>()); break;
+		case PIXEL_RGB16F:  encode_image<PIXEL_RGB16F>(image, m_curve, pixels<PIXEL_RGB16F>()); break;
+		case PIXEL_RGBA16F: encode_image<PIXEL_RGBA16F>(image, m_curve, pixels<PIXEL_RGBA16F>()); break;
+		case PIXEL_R32F:    encode_image<PIXEL_R32F>(image, m_curve, pixels<PIXEL_R32F>()); break;
+		default:
+			std::copy(image.getPixels(), image.getPixels() + image.getWidth() * image.getHeight(),
+				pixels<PIXEL_RGBA32F>());
+			break;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+PixelFormat CompactImage::smallest_exact_format(Image const& image, float gamma)
+{
+	GammaCurve const curve(gamma);
+	if (is_exact<PIXEL_RGBA8>(image, curve))   return PIXEL_RGBA8;
+	if (is_exact<PIXEL_R32F>(image, curve))    return PIXEL_R32F;
+	if (is_exact<PIXEL_RGB16F>(image, curve))  return PIXEL_RGB16F;
+	if (is_exact<PIXEL_RGBA16F>(image, curve)) return PIXEL_RGBA16F;
+	return PIXEL_RGBA32F;
+}
+
+std::size_t CompactImage::bytes_per_pixel(PixelFormat format)
+{
+	switch (format)
+	{
+		case PIXEL_RGBA8:   return sizeof(PixelTraits<PIXEL_RGBA8>::Storage);
+		case PIXEL_RGB16F:  return sizeof(PixelTraits<PIXEL_RGB16F>::Storage);
+		case PIXEL_RGBA16F: return sizeof(PixelTraits<PIXEL_RGBA16F>::Storage);
+		case PIXEL_R32F:    return sizeof(PixelTraits<PIXEL_R32F>::Storage);
+		default:            return sizeof(PixelTraits<PIXEL_RGBA32F>::Storage);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void CompactImage::setPixel(int i, int j, glm::vec4 const& pixel)
+{
+	cg_assert(i >= 0 && i < m_width);
+	cg_assert(j >= 0 && j < m_height);
+	int const idx = j * m_width + i;
+	switch (m_format)
+	{
+		case PIXEL_RGBA8:   pixels<PIXEL_RGBA8>()[idx] = PixelTraits<PIXEL_RGBA8>::encode(pixel, m_curve); break;
+		case PIXEL_RGB16F:  pixels<PIXEL_RGB16F>()[idx] = PixelTraits<PIXEL_RGB16F>::encode(pixel, m_curve); break;
+		case PIXEL_RGBA16F: pixels<PIXEL_RGBA16F>()[idx] = PixelTraits<PIXEL_RGBA16F>::encode(pixel, m_curve); break;
+		case PIXEL_R32F:    pixels<PIXEL_R32F>()[idx] = PixelTraits<PIXEL_R32F>::encode(pixel, m_curve); break;
+		default:            pixels<PIXEL_RGBA32F>()[idx] = pixel; break;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void CompactImage::to_image(Image* image) const
+{
+	cg_assert(image);
+	image->setSize(m_width, m_height);
+	switch (m_format)
+	{
+		case PIXEL_RGBA8:   decode_image<PIXEL_RGBA8>(pixels<PIXEL_RGBA8>(), m_curve, image); break;
+		case PIXEL_RGB16F:  decode_image<PIXEL_RGB16F>(pixels<PIXEL_RGB16F>(), m_curve, image); break;
+		case PIXEL_RGBA16F: decode_image<PIXEL_RGBA16F>(pixels<PIXEL_RGBA16F>(), m_curve, image); break;
+		case PIXEL_R32F:    decode_image<PIXEL_R32F>(pixels<PIXEL_R32F>(), m_curve, image); break;
+		default:
+			std::copy(pixels<PIXEL_RGBA32F>(), pixels<PIXEL_RGBA32F>() + m_width * m_height,
+				image->getPixels());
+			break;
+	}
+}
@@ -0,0 +1,109 @@
+#include <cglib/core/fft.h>
+
+#include <cglib/core/assert.h>
+#include <cglib/core/parallel.h>
+
+#include <algorithm>
+#include <cmath>
+
+// -----------------------------------------------------------------------------
+
+FFT::FFT(int size) :
+	m_size(size),
+	m_twiddles(size / 2)
+{
+	cg_assert(size > 0 && (size & (size - 1)) == 0);
+	for (int k = 0; k < size / 2; ++k)
+	{
+		double const angle = -2.0 * M_PI * k / size;
+		m_twiddles[k] = std::complex<float>(float(std::cos(angle)), float(std::sin(angle)));
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void FFT::transform(std::complex<float>* data, bool inverse) const
+{
+	int const n = m_size;
+
+	// Reorder to bit reversed indices.
+	for (int i = 1, j = 0; i < n; ++i)
+	{
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			std::swap(data[i], data[j]);
+	}
+
+	for (int length = 2; length <= n; length <<= 1)
+	{
+		int const half = length / 2;
+		int const step = n / length;
+		for (int i = 0; i < n; i += length)
+		{
+			for (int k = 0; k < half; ++k)
+			{
+				std::complex<float> const w = inverse
+					? std::conj(m_twiddles[k * step]) : m_twiddles[k * step];
+				std::complex<float> const u = data[i + k];
+				std::complex<float> const v = multiply(data[i + k + half], w);
+				data[i + k] = u + v;
+				data[i + k + half] = u - v;
+			}
+		}
+	}
+
+	if (inverse)
+	{
+		float const scale = 1.f / n;
+		for (int i = 0; i < n; ++i)
+			data[i] *= scale;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void FFT::transform_2d(std::complex<float>* data, int width, int height, bool inverse)
+{
+	FFT const rows(width);
+	FFT const columns(height);
+
+	parallel_for(BlockedRange(0, height), 8, [&](BlockedRange const& r)
+	{
+		for (int y = r.begin; y < r.end; ++y)
+			rows.transform(data + y * width, inverse);
+	});
+
+	// Columns are copied out in strips, so that every row is read and
+	// written a cache line at a time.
+	int const strip = 8;
+	parallel_for(BlockedRange(0, (width + strip - 1) / strip), 1, [&](BlockedRange const& r)
+	{
+		std::vector<std::complex<float>> column(std::size_t(strip) * height);
+		for (int s = r.begin; s < r.end; ++s)
+		{
+			int const x0 = s * strip;
+			int const count = std::min(strip, width - x0);
+			for (int y = 0; y < height; ++y)
+				for (int c = 0; c < count; ++c)
+					column[c * height + y] = data[x0 + c + y * width];
+			for (int c = 0; c < count; ++c)
+				columns.transform(column.data() + c * height, inverse);
+			for (int y = 0; y < height; ++y)
+				for (int c = 0; c < count; ++c)
+					data[x0 + c + y * width] = column[c * height + y];
+		}
+	});
+}
+
+// -----------------------------------------------------------------------------
+
+int FFT::next_size(int n)
+{
+	int size = 1;
+	while (size < n)
+		size <<= 1;
+	return size;
+}
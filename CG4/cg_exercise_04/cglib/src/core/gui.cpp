@@ -484,7 +484,8 @@ init_host(Parameters& params)
 }
 
 int GUI::
-display_host(Image const& frame_buffer, std::function<void()> const& render_overlay)
+display_host(Image const& frame_buffer, std::function<void()> const& render_overlay,
+		std::function<void()> const& render_windows)
 {
 	if (write_screenshot)
 	{
@@ -532,6 +533,8 @@ display_host(Image const& frame_buffer, std::function<void()> const& render_over
 
 	ImGui::End();
 
+	render_windows();
+
 	GUI::draw();
 
 	glfwSwapBuffers(window);
@@ -2,14 +2,20 @@
 #include <cglib/core/stb_image.h>
 #include <cglib/core/stb_image_write.h>
 #include <cglib/core/assert.h>
+#include <cglib/core/parallel.h>
+#include <cglib/core/fft.h>
+#include <cglib/core/image_writer.h>
+#include <cglib/core/pfm.h>
 
 #include <cstdlib>
 #include <cstdint>
 #include <cmath>
+#include <complex>
 #include <cstring>
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <chrono>
 
 Image::Image() : m_width(0), m_height(0)
 { }
@@ -67,10 +73,10 @@ float* Image::raw_data()
 
 void Image::clear(glm::vec4 const& color)
 {
-    for (int i = 0; i < m_width * m_height; i++)
+    parallel_for(BlockedRange(0, int(m_pixels.size())), 1 << 14, [&](BlockedRange const& r)
     {
-        m_pixels[i] = color;
-    }
+        std::fill(m_pixels.begin() + r.begin, m_pixels.begin() + r.end, color);
+    });
 }
 
 void Image::save(std::string const& path, float gamma) const
@@ -78,25 +84,19 @@ void Image::save(std::string const& path, float gamma) const
     size_t lastindex = path.find_last_of("."); 
     const std::string extension = path.substr(lastindex+1, path.length());
 
-    std::vector<std::uint8_t> bgr(m_pixels.size() * 3);
-	
-    for (int y = 0; y < m_height; ++y)
-    for (int x = 0; x < m_width;  ++x)
+    if (extension == "tga") 
+        cg_assert(false && "dont!");
+    else if (extension == "pfm")
+        save_pfm(path);
+    else if (extension == "png" || extension == "ppm")
     {
-        std::size_t const idx_dst = 3*((m_height-y-1) * m_width + x);
-        std::size_t const idx_src = (y * m_width + x);
-
-        for (int c = 0; c < 3; ++c)
+        ImageWriter writer;
+        if (writer.open(path, m_width, m_height, gamma))
         {
-            float const gamma_corrected = std::pow(std::max(0.f, m_pixels[idx_src][c]), 1.f / gamma);
-            float const mapped          = std::max<float>(0.0f, std::min<float>(255.0f, 255.f * gamma_corrected));
-            bgr[idx_dst+c]              = uint8_t(mapped);
+            writer.write_rows(*this, 0, m_height);
+            writer.close();
         }
     }
-    if (extension == "tga") 
-        cg_assert(false && "dont!");
-    else if (extension == "png")
-        stbi_write_png(path.c_str(), m_width, m_height, 3, bgr.data(), 3*m_width);
     else 
         cg_assert(false && "not_implemented");
 }
@@ -104,132 +104,98 @@ void Image::save(std::string const& path, float gamma) const
 void Image::load(std::string const& path, float gamma)
 {
 	int num_components;
-	stbi_ldr_to_hdr_gamma(gamma);
-    float *data = stbi_loadf(path.c_str(), &m_width, &m_height, &num_components, 4);
+	if (stbi_is_hdr(path.c_str())) {
+		float *data = stbi_loadf(path.c_str(), &m_width, &m_height, &num_components, 4);
+		if(!data) {
+			std::cerr << "error: could not load image \"" << path << "\"" << std::endl;
+			m_width = m_height = 1;
+			m_pixels.resize(1);
+			return;
+		}
+		m_pixels.resize(m_width * m_height);
+		/* flip image in Y */
+		for(int y = 0; y < m_height; y++) {
+			memcpy(&m_pixels[(m_height - y - 1) * m_width],
+					data + y * m_width * 4,
+					4 * m_width * sizeof(float));
+		}
+		stbi_image_free(data);
+		return;
+	}
+
+	/*
+	 * 8 bit images are converted here rather than by stbi_loadf, because
+	 * the gamma of stbi_loadf is a global setting and images may be loaded
+	 * concurrently. The conversion is the same as in stb_image.
+	 */
+	stbi_uc *data = stbi_load(path.c_str(), &m_width, &m_height, &num_components, 4);
 	if(!data) {
 		std::cerr << "error: could not load image \"" << path << "\"" << std::endl;
-    m_width = m_height = 1;
-    m_pixels.resize(1);
+		m_width = m_height = 1;
+		m_pixels.resize(1);
 		return;
 	}
+	float linear[256];
+	for(int i = 0; i < 256; i++) {
+		linear[i] = std::pow(i/255.0f, gamma);
+	}
 	m_pixels.resize(m_width * m_height);
 	/* flip image in Y */
-	for(int y = 0; y < m_height; y++) {
-		memcpy(&m_pixels[(m_height - y - 1) * m_width],
-				data + y * m_width * 4,
-				4 * m_width * sizeof(float));
-	}
+	parallel_for(BlockedRange(0, m_height), 16, [&](BlockedRange const& rows) {
+		for(int y = rows.begin; y < rows.end; y++) {
+			stbi_uc const* src = data + y * m_width * 4;
+			glm::vec4* dst = &m_pixels[(m_height - y - 1) * m_width];
+			for(int x = 0; x < m_width; x++) {
+				dst[x] = glm::vec4(
+					linear[src[4*x+0]],
+					linear[src[4*x+1]],
+					linear[src[4*x+2]],
+					src[4*x+3]/255.0f);
+			}
+		}
+	});
 	stbi_image_free(data);
 }
 
 void Image::save_pfm(std::string const& path) const
 {
-	std::ofstream of(path.c_str(), std::ios::out | std::ios::binary);
-
-	if (!of) {
-		std::cerr << "Cannot open " << path << " for writing." << std::endl;
-		return;
-	}
-
-	// write header.
-	of << "PF\n" << m_width << " " << m_height << "\n-1.0\n" << std::flush;
-
-	std::vector<float> data_pfm(m_width * m_height * 3);
-	for (int j = 0; j < m_width * m_height; ++j) {
-		for (int i = 0; i < 3; ++i) {
-			data_pfm[3*j+i] = getPixels()[j][i];
-		}
-	}
-	of.write(reinterpret_cast<char const*>(&data_pfm[0]), 
-		static_cast<std::streamsize>(m_width * m_height * 3 * sizeof(float)));
-
-	if (!of) {
-		std::cerr << "An error occured while writing " << path << std::endl;
-	}
-
-	of.close();
-}
-	
-static void readCommentsAndEmptyLines(std::ifstream& file)
-{
-	std::string line;
-	while (true) {
-		std::streampos pos = file.tellg();
-		getline(file, line);
-		if (!(line.length() > 0 && line.at(0) == '#')) {
-			file.seekg(pos);
-			break;
-		}
-	}
+	write_pfm(path, StridedImageView::of(*this));
 }
 
 void Image::load_pfm(std::string const& path)
 {
-	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
-
-	if (!file || !file.is_open()) {
-		std::cerr << "Cannot open " << path << " for reading." << std::endl;
-		return;
-	}
-
-	std::string line;
-
-	// read file type
-	getline(file, line);
-	readCommentsAndEmptyLines(file);
-
-	// read width, height
-	getline(file, line);
-	std::sscanf(line.c_str(), "%i %i", &m_width, &m_height);
-	getline(file, line); // read endian crap
-	float endian;
-	std::sscanf(line.c_str(), "%f", &endian);
-	if (endian > 0) {
-		std::cerr << "only little endian supported" << std::endl;
-		m_width = 0;
-		m_height = 0;
-		return;
-	}
-
-	std::vector<float> data_pfm(m_width * m_height * 3 * sizeof(float));
-	file.read(reinterpret_cast<char*>(&data_pfm[0]), 
-		static_cast<std::streamsize>(sizeof(float) * 3 * m_width * m_height));
-	if (!file) {
-		std::cerr << "An error occured while reading " << path << "." << std::endl;
-		return;
-	}
-	m_pixels.resize(m_width*m_height);
-
-	for (int y = 0; y < m_height; ++y) 
-	for (int x = 0; x < m_width; ++x) 
-	{
-		int offset = x + y * m_width;
-		m_pixels[offset] = glm::vec4(
-			data_pfm[3 * offset + 0],
-			data_pfm[3 * offset + 1],
-			data_pfm[3 * offset + 2],
-			0.f);
-	}
-	file.close();
+	PfmView pfm;
+	if (pfm.open(path))
+		pfm.to_image(this);
 }
 
+/*
+ * The maximum has to be known before any pixel can be mapped, so the image
+ * is read twice: once by a parallel reduction and once by the mapping.
+ */
 void Image::tonemap_01(float exposure, float gamma)
 {
-	glm::vec4 maxval {0.f, 0.f, 0.f, 0.f};
-	for (int y = 0; y < m_height; ++y)
-	{
-		for (int x = 0; x < m_width; ++x)
+	int const count = int(m_pixels.size());
+	glm::vec4 const maxval = parallel_reduce(BlockedRange(0, count), 1 << 14, glm::vec4(0.f),
+		[&](BlockedRange const& r, glm::vec4 value)
 		{
-			maxval = max(getPixel(x, y), maxval);
-		}
-	}
-	for (int y = 0; y < m_height; ++y)
+			for (int i = r.begin; i < r.end; ++i)
+			{
+				value = max(m_pixels[i], value);
+			}
+			return value;
+		},
+		[](glm::vec4 const& a, glm::vec4 const& b) { return max(a, b); });
+
+	float const scale = std::pow(2.f, exposure);
+	glm::vec4 const inv_gamma(1.f/gamma);
+	parallel_for(BlockedRange(0, count), 1 << 14, [&](BlockedRange const& r)
 	{
-		for (int x = 0; x < m_width; ++x)
+		for (int i = r.begin; i < r.end; ++i)
 		{
-			setPixel(x, y, pow(std::pow(2.f, exposure) * getPixel(x, y) / maxval, glm::vec4{1.f/gamma}));
+			m_pixels[i] = pow(scale * m_pixels[i] / maxval, inv_gamma);
 		}
-	}
+	});
 }
 
 /*
@@ -246,16 +212,19 @@ void Image::complex_to_image(std::vector<std::complex<float>> const& vec, Image*
 {
 	cg_assert(img);
 	cg_assert(int(vec.size()) == img->getWidth()*img->getHeight());
-	for (int j = 0; j < int(vec.size()); ++j)
+	parallel_for(BlockedRange(0, int(vec.size())), 1 << 14, [&](BlockedRange const& range)
 	{
-		const float r = vec[j].real();
-		const float i = vec[j].imag();
-		const float v = std::sqrt(r*r+i*i);
-		if (rgba)
-			img->getPixels()[j] = glm::vec4(v, v, v, 1.0f);
-		else
-			img->getPixels()[j] = glm::vec4(r, i, 0.0f, 1.0f);
-	}
+		for (int j = range.begin; j < range.end; ++j)
+		{
+			const float r = vec[j].real();
+			const float i = vec[j].imag();
+			const float v = std::sqrt(r*r+i*i);
+			if (rgba)
+				img->getPixels()[j] = glm::vec4(v, v, v, 1.0f);
+			else
+				img->getPixels()[j] = glm::vec4(r, i, 0.0f, 1.0f);
+		}
+	});
 }
 		
 /*
@@ -270,17 +239,28 @@ void Image::complex_to_image(std::vector<std::complex<float>> const& vec, Image*
  *   part of the buffer respecively
  */
 void Image::image_to_complex(Image const& img, std::vector<std::complex<float>>* vec, bool rgba)
+{
+	image_to_complex(StridedImageView::of(img), vec, rgba);
+}
+
+void Image::image_to_complex(StridedImageView const& view, std::vector<std::complex<float>>* vec, bool rgba)
 {
 	cg_assert(vec);
-	cg_assert(int(vec->size()) == img.getWidth()*img.getHeight());
-	for (int i = 0; i < int(vec->size()); ++i)
+	cg_assert(int(vec->size()) == view.width*view.height);
+	int const g = (view.channels == 3) ? 1 : 0;
+	int const b = (view.channels == 3) ? 2 : 0;
+	parallel_for(BlockedRange(0, view.height), 16, [&](BlockedRange const& rows)
 	{
-		glm::vec4 const& d = img.getPixels()[i];
-		if (rgba)
-			(*vec)[i] = std::complex<float>((d[0]+d[1]+d[2])/3.f, 0);
-		else
-			(*vec)[i] = std::complex<float>(d[0], d[1]);
-	}
+		for (int y = rows.begin; y < rows.end; ++y)
+		for (int x = 0; x < view.width; ++x)
+		{
+			std::size_t const i = std::size_t(y) * view.width + x;
+			if (rgba)
+				(*vec)[i] = std::complex<float>((view.at(x, y, 0)+view.at(x, y, g)+view.at(x, y, b))/3.f, 0);
+			else
+				(*vec)[i] = std::complex<float>(view.at(x, y, 0), view.at(x, y, g));
+		}
+	});
 }
 
 glm::vec4 Image::getPixel(int i, int j, WrapMode wrap_mode) const
@@ -324,3 +304,532 @@ void Image::filter_gaussian_separable(Image *target, float sigma, int kernel_siz
 	filter_separable(target, kernel_size, kernel.data(), wrap_mode);
 }
 
+namespace {
+
+/*
+ * Coefficients of Deriche's fourth order recursive Gaussian, see
+ * Getreuer, "A Survey of Gaussian Convolution Algorithms", 2013.
+ *
+ * The Gaussian is approximated by the sum of a causal filter
+ *   y+[n] = sum_k causal[k]*x[n-k]     - sum_k a[k]*y+[n-k]   k = 0..3 / 1..4
+ * and an anticausal filter
+ *   y-[n] = sum_k anticausal[k]*x[n+k] - sum_k a[k]*y-[n+k]   k = 1..4,
+ * at a cost per sample that does not depend on sigma.
+ */
+struct RecursiveGaussian
+{
+	explicit RecursiveGaussian(float sigma)
+	{
+		typedef std::complex<double> complex;
+		complex const alpha[4] = {
+			complex(0.84, 1.8675), complex(0.84, -1.8675),
+			complex(-0.34015, -0.1299), complex(-0.34015, 0.1299) };
+		complex const lambda[4] = {
+			complex(1.783, 0.6318), complex(1.783, -0.6318),
+			complex(1.723, 1.997), complex(1.723, -1.997) };
+
+		complex beta[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			double const decay = std::exp(-lambda[k].real() / sigma);
+			beta[k] = complex(-decay * std::cos(lambda[k].imag() / sigma),
+				decay * std::sin(lambda[k].imag() / sigma));
+		}
+
+		// Expand sum_k alpha_k / (1 + beta_k z^-1) into one rational function.
+		complex b[4] = { alpha[0] };
+		complex poles[5] = { complex(1.0), beta[0] };
+		for (int k = 1; k < 4; ++k)
+		{
+			b[k] = beta[k] * b[k - 1];
+			for (int j = k - 1; j > 0; --j)
+				b[j] += beta[k] * b[j - 1];
+			for (int j = 0; j <= k; ++j)
+				b[j] += alpha[k] * poles[j];
+			poles[k + 1] = beta[k] * poles[k];
+			for (int j = k; j > 0; --j)
+				poles[j] += beta[k] * poles[j - 1];
+		}
+
+		double causal_d[4], anticausal_d[5], a_d[5];
+		for (int k = 0; k < 4; ++k)
+		{
+			causal_d[k] = b[k].real() / (std::sqrt(2.0 * M_PI) * sigma);
+			a_d[k + 1] = poles[k + 1].real();
+		}
+		anticausal_d[0] = 0.0;
+		for (int k = 1; k < 4; ++k)
+			anticausal_d[k] = causal_d[k] - a_d[k] * causal_d[0];
+		anticausal_d[4] = -a_d[4] * causal_d[0];
+
+		// Scale to a gain of exactly one, so flat regions stay flat.
+		double sum_a = 1.0, sum_causal = 0.0, sum_anticausal = 0.0;
+		for (int k = 1; k <= 4; ++k)
+			sum_a += a_d[k];
+		for (int k = 0; k < 4; ++k)
+			sum_causal += causal_d[k];
+		for (int k = 1; k <= 4; ++k)
+			sum_anticausal += anticausal_d[k];
+		double const scale = sum_a / (sum_causal + sum_anticausal);
+
+		for (int k = 0; k < 4; ++k)
+			causal[k] = causal_d[k] * scale;
+		for (int k = 0; k <= 4; ++k)
+		{
+			anticausal[k] = anticausal_d[k] * scale;
+			a[k] = a_d[k];
+		}
+		causal_gain     = sum_causal * scale / sum_a;
+		anticausal_gain = sum_anticausal * scale / sum_a;
+
+		// The response decays below 1e-4 of its peak within 5 sigma, so the
+		// border is resolved with the wrap mode that far out.
+		padding = int(std::ceil(5.f * sigma)) + 4;
+	}
+
+	// In double precision, since the poles approach one for large sigma.
+	double causal[4];
+	double anticausal[5];
+	double a[5];
+	// Response of each filter to a constant input of one.
+	double causal_gain;
+	double anticausal_gain;
+	int padding;
+};
+
+/*
+ * Filter count interleaved lines of the given length, sample n of line c
+ * is lines[n*count + c]. The result is written to lines, the causal part
+ * goes through scratch, which has the size of lines. Both filters start in
+ * the steady state of the first and last sample.
+ */
+void recursive_gaussian_lines(glm::vec4* lines, glm::vec4* scratch, int length, int count,
+	RecursiveGaussian const& g)
+{
+	for (int c = 0; c < count; ++c)
+	{
+		glm::dvec4 const first(lines[c]);
+		glm::dvec4 x1 = first, x2 = first, x3 = first;
+		glm::dvec4 y1 = g.causal_gain * first, y2 = y1, y3 = y1, y4 = y1;
+		for (int n = 0; n < length; ++n)
+		{
+			glm::dvec4 const x0(lines[n * count + c]);
+			glm::dvec4 const y0 =
+				g.causal[0] * x0 + g.causal[1] * x1 + g.causal[2] * x2 + g.causal[3] * x3
+				- g.a[1] * y1 - g.a[2] * y2 - g.a[3] * y3 - g.a[4] * y4;
+			scratch[n * count + c] = glm::vec4(y0);
+			x3 = x2; x2 = x1; x1 = x0;
+			y4 = y3; y3 = y2; y2 = y1; y1 = y0;
+		}
+	}
+	for (int c = 0; c < count; ++c)
+	{
+		glm::dvec4 const last(lines[(length - 1) * count + c]);
+		glm::dvec4 x1 = last, x2 = last, x3 = last, x4 = last;
+		glm::dvec4 y1 = g.anticausal_gain * last, y2 = y1, y3 = y1, y4 = y1;
+		for (int n = length - 1; n >= 0; --n)
+		{
+			glm::dvec4 const y0 =
+				g.anticausal[1] * x1 + g.anticausal[2] * x2 + g.anticausal[3] * x3 + g.anticausal[4] * x4
+				- g.a[1] * y1 - g.a[2] * y2 - g.a[3] * y3 - g.a[4] * y4;
+			glm::dvec4 const x0(lines[n * count + c]);
+			lines[n * count + c] = glm::vec4(glm::dvec4(scratch[n * count + c]) + y0);
+			x4 = x3; x3 = x2; x2 = x1; x1 = x0;
+			y4 = y3; y3 = y2; y2 = y1; y1 = y0;
+		}
+	}
+}
+
+} // namespace
+
+/*
+ * Approximates filter_gaussian with an untruncated kernel. Both directions
+ * run as a recursive filter on lines that are extended past the border with
+ * the wrap mode. Rows are filtered one by one, columns in strips that are
+ * interleaved so the vertical pass reads whole cache lines. target may be
+ * this image.
+ */
+void Image::filter_gaussian_recursive(Image *target, float sigma, WrapMode wrap_mode) const
+{
+	cg_assert(target);
+	cg_assert(target->getWidth() == m_width && target->getHeight() == m_height);
+
+	// Too narrow for the recursion to be accurate, but then the kernel is
+	// tiny anyway.
+	if (sigma < 0.5f)
+	{
+		int const kernel_size = 2 * int(std::ceil(3.f * sigma)) + 1;
+		if (target == this)
+		{
+			Image const source = *this;
+			source.filter_gaussian_separable(target, sigma, kernel_size, wrap_mode);
+		}
+		else
+		{
+			filter_gaussian_separable(target, sigma, kernel_size, wrap_mode);
+		}
+		return;
+	}
+
+	RecursiveGaussian const gauss(sigma);
+	int const padding = gauss.padding;
+	int const width = m_width;
+	int const height = m_height;
+
+	parallel_for(BlockedRange(0, height), 8, [&](BlockedRange const& r)
+	{
+		std::vector<glm::vec4> line(width + 2 * padding);
+		std::vector<glm::vec4> scratch(line.size());
+		for (int j = r.begin; j < r.end; ++j)
+		{
+			for (int t = 0; t < int(line.size()); ++t)
+				line[t] = getPixel(t - padding, j, wrap_mode);
+			recursive_gaussian_lines(line.data(), scratch.data(), int(line.size()), 1, gauss);
+			std::copy(line.begin() + padding, line.begin() + padding + width,
+				target->m_pixels.begin() + j * width);
+		}
+	});
+
+	parallel_for(BlockedRange(0, width), 16, [&](BlockedRange const& r)
+	{
+		int const strip = r.size();
+		std::vector<glm::vec4> lines((height + 2 * padding) * strip);
+		std::vector<glm::vec4> scratch(lines.size());
+		for (int t = 0; t < height + 2 * padding; ++t)
+			for (int c = 0; c < strip; ++c)
+				lines[t * strip + c] = target->getPixel(r.begin + c, t - padding, wrap_mode);
+		recursive_gaussian_lines(lines.data(), scratch.data(), height + 2 * padding, strip, gauss);
+		for (int j = 0; j < height; ++j)
+			std::copy(lines.begin() + (j + padding) * strip, lines.begin() + (j + padding + 1) * strip,
+				target->m_pixels.begin() + j * width + r.begin);
+	});
+}
+
+float Image::recursive_gaussian_error(float sigma, WrapMode wrap_mode) const
+{
+	int const kernel_size = 2 * int(std::ceil(4.f * sigma)) + 1;
+	Image direct(m_width, m_height);
+	Image recursive(m_width, m_height);
+	filter_gaussian(&direct, sigma, kernel_size, wrap_mode);
+	filter_gaussian_recursive(&recursive, sigma, wrap_mode);
+	return filter_error(recursive, direct);
+}
+
+float Image::filter_error(Image const& filtered, Image const& reference) const
+{
+	cg_assert(filtered.m_width == m_width && filtered.m_height == m_height);
+	cg_assert(reference.m_width == m_width && reference.m_height == m_height);
+
+	float error = 0.f;
+	float range = 0.f;
+	for (int i = 0; i < int(m_pixels.size()); ++i)
+	{
+		glm::vec4 const d = glm::abs(filtered.m_pixels[i] - reference.m_pixels[i]);
+		glm::vec4 const v = glm::abs(m_pixels[i]);
+		error = std::max(error, std::max(std::max(d.x, d.y), std::max(d.z, d.w)));
+		range = std::max(range, std::max(std::max(v.x, v.y), std::max(v.z, v.w)));
+	}
+	return range > 0.f ? error / range : error;
+}
+
+void Image::filter_fft(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode) const
+{
+	cg_assert(kernel_size % 2 == 1 && kernel_size > 0);
+	cg_assert(target);
+	cg_assert(target->getWidth() == m_width && target->getHeight() == m_height);
+	int const radius = kernel_size / 2;
+	// The output pixels only read the image extended by the radius, so the
+	// circular convolution does not wrap around into them.
+	int const width  = FFT::next_size(m_width + 2 * radius);
+	int const height = FFT::next_size(m_height + 2 * radius);
+
+	// filter reads tap (dx, dy) from kernel[(dx+r)*kernel_size + (dy+r)] at
+	// pixel (x+dx, y+dy), so the convolution kernel is mirrored.
+	std::vector<std::complex<float>> kernel_spectrum(std::size_t(width) * height);
+	for (int a = 0; a < kernel_size; ++a)
+	{
+		for (int b = 0; b < kernel_size; ++b)
+		{
+			int const x = (radius - a + width) % width;
+			int const y = (radius - b + height) % height;
+			kernel_spectrum[x + y * width] = kernel[a * kernel_size + b];
+		}
+	}
+	FFT::transform_2d(kernel_spectrum.data(), width, height, false);
+
+	// The kernel is real, so two channels are filtered at once as the real
+	// and imaginary part.
+	std::vector<std::complex<float>> spectrum(std::size_t(width) * height);
+	for (int channel = 0; channel < 4; channel += 2)
+	{
+		parallel_for(BlockedRange(0, height), 16, [&](BlockedRange const& r)
+		{
+			for (int y = r.begin; y < r.end; ++y)
+			{
+				std::complex<float>* row = spectrum.data() + std::size_t(y) * width;
+				if (y >= m_height + 2 * radius)
+				{
+					std::fill(row, row + width, std::complex<float>(0.f));
+					continue;
+				}
+				for (int x = 0; x < m_width + 2 * radius; ++x)
+				{
+					glm::vec4 const p = getPixel(x - radius, y - radius, wrap_mode);
+					row[x] = std::complex<float>(p[channel], p[channel + 1]);
+				}
+				std::fill(row + m_width + 2 * radius, row + width, std::complex<float>(0.f));
+			}
+		});
+
+		FFT::transform_2d(spectrum.data(), width, height, false);
+		parallel_for(BlockedRange(0, width * height), 4096, [&](BlockedRange const& r)
+		{
+			for (int i = r.begin; i < r.end; ++i)
+			{
+				spectrum[i] = FFT::multiply(spectrum[i], kernel_spectrum[i]);
+			}
+		});
+		FFT::transform_2d(spectrum.data(), width, height, true);
+
+		parallel_for(BlockedRange(0, m_height), 16, [&](BlockedRange const& r)
+		{
+			for (int j = r.begin; j < r.end; ++j)
+			{
+				for (int i = 0; i < m_width; ++i)
+				{
+					std::complex<float> const v = spectrum[(i + radius) + std::size_t(j + radius) * width];
+					glm::vec4& p = target->m_pixels[i + j * m_width];
+					p[channel]     = v.real();
+					p[channel + 1] = v.imag();
+				}
+			}
+		});
+	}
+}
+
+namespace {
+
+// Seconds per unit of work of the filter algorithms, see
+// Image::select_filter_algorithm.
+struct FilterCosts
+{
+	double direct;    // per tap
+	double separable; // per tap of both passes
+	double fft;       // per n log2(n) of the padded image
+};
+
+double fft_work(int width, int height, int kernel_size)
+{
+	int const radius = kernel_size / 2;
+	double const n = double(FFT::next_size(width + 2 * radius)) * FFT::next_size(height + 2 * radius);
+	return n * std::log2(n);
+}
+
+template <typename F>
+double best_seconds(F const& f)
+{
+	double best = 0.0;
+	for (int i = 0; i < 3; ++i)
+	{
+		auto const start = std::chrono::steady_clock::now();
+		f();
+		double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = (i == 0) ? seconds : std::min(best, seconds);
+	}
+	return best;
+}
+
+FilterCosts calibrate_filter_costs()
+{
+	int const size = 128;
+	int const kernel_size = 9;
+	Image image(size, size);
+	Image target(size, size);
+	for (int i = 0; i < size * size; ++i)
+		image.getPixels()[i] = glm::vec4(float(i % 13), float(i % 7), float(i % 5), 1.f);
+	std::vector<float> kernel(kernel_size * kernel_size, 1.f / (kernel_size * kernel_size));
+	std::vector<float> line(kernel_size, 1.f / kernel_size);
+
+	double const pixels = double(size) * size;
+	FilterCosts costs;
+	costs.direct = best_seconds([&] { image.filter(&target, kernel_size, kernel.data()); })
+		/ (pixels * kernel_size * kernel_size);
+	costs.separable = best_seconds([&] { image.filter_separable(&target, kernel_size, line.data()); })
+		/ (pixels * 2 * kernel_size);
+	costs.fft = best_seconds([&] { image.filter_fft(&target, kernel_size, kernel.data()); })
+		/ fft_work(size, size, kernel_size);
+	return costs;
+}
+
+} // namespace
+
+int Image::separable_approximation(int kernel_size, float const* kernel, float tolerance,
+	std::vector<float>* horizontal, std::vector<float>* vertical)
+{
+	cg_assert(horizontal && vertical);
+	int const n = kernel_size;
+
+	// One-sided Jacobi SVD: rotate the columns a[.][b] of the kernel until
+	// they are orthogonal, i.e. K v = a. Then K = sum_j a[.][j] v[.][j]^T.
+	std::vector<double> a(n * n), v(n * n, 0.0);
+	for (int i = 0; i < n * n; ++i)
+		a[i] = kernel[i];
+	for (int i = 0; i < n; ++i)
+		v[i * n + i] = 1.0;
+
+	for (int sweep = 0; sweep < 30; ++sweep)
+	{
+		bool rotated = false;
+		for (int p = 0; p < n - 1; ++p)
+		{
+			for (int q = p + 1; q < n; ++q)
+			{
+				double alpha = 0.0, beta = 0.0, gamma = 0.0;
+				for (int i = 0; i < n; ++i)
+				{
+					alpha += a[i * n + p] * a[i * n + p];
+					beta  += a[i * n + q] * a[i * n + q];
+					gamma += a[i * n + p] * a[i * n + q];
+				}
+				if (std::abs(gamma) <= 1e-15 * std::sqrt(alpha * beta))
+					continue;
+				rotated = true;
+				double const zeta = (beta - alpha) / (2.0 * gamma);
+				double const t = (zeta >= 0.0 ? 1.0 : -1.0) / (std::abs(zeta) + std::sqrt(1.0 + zeta * zeta));
+				double const c = 1.0 / std::sqrt(1.0 + t * t);
+				double const s = c * t;
+				for (int i = 0; i < n; ++i)
+				{
+					double const ap = a[i * n + p], aq = a[i * n + q];
+					a[i * n + p] = c * ap - s * aq;
+					a[i * n + q] = s * ap + c * aq;
+					double const vp = v[i * n + p], vq = v[i * n + q];
+					v[i * n + p] = c * vp - s * vq;
+					v[i * n + q] = s * vp + c * vq;
+				}
+			}
+		}
+		if (!rotated)
+			break;
+	}
+
+	// The singular values are the column norms, keep the largest terms
+	// until the rest is below the tolerance.
+	std::vector<double> squared(n, 0.0);
+	double total = 0.0;
+	for (int j = 0; j < n; ++j)
+	{
+		for (int i = 0; i < n; ++i)
+			squared[j] += a[i * n + j] * a[i * n + j];
+		total += squared[j];
+	}
+	std::vector<int> order(n);
+	for (int j = 0; j < n; ++j)
+		order[j] = j;
+	std::sort(order.begin(), order.end(), [&](int x, int y) { return squared[x] > squared[y]; });
+
+	double remaining = total;
+	double const limit = double(tolerance) * tolerance * total;
+	int rank = 0;
+	horizontal->clear();
+	vertical->clear();
+	while (rank < n && remaining > limit)
+	{
+		int const j = order[rank++];
+		remaining -= squared[j];
+		for (int i = 0; i < n; ++i)
+		{
+			horizontal->push_back(float(a[i * n + j]));
+			vertical->push_back(float(v[i * n + j]));
+		}
+	}
+	return rank;
+}
+
+int Image::filter_low_rank(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode, float tolerance) const
+{
+	std::vector<float> horizontal, vertical;
+	int const rank = separable_approximation(kernel_size, kernel, tolerance, &horizontal, &vertical);
+	filter_separable_terms(target, kernel_size, rank, horizontal.data(), vertical.data(), wrap_mode);
+	return rank;
+}
+
+void Image::filter_separable_terms(Image *target, int kernel_size, int rank,
+	float* horizontal, float* vertical, WrapMode wrap_mode) const
+{
+	cg_assert(target);
+	cg_assert(target->getWidth() == m_width && target->getHeight() == m_height);
+	if (target == this && rank > 1)
+	{
+		Image const source = *this;
+		source.filter_separable_terms(target, kernel_size, rank, horizontal, vertical, wrap_mode);
+		return;
+	}
+	if (rank == 0)
+	{
+		target->clear(glm::vec4(0.f));
+		return;
+	}
+
+	filter_separable(target, kernel_size, horizontal, vertical, wrap_mode);
+	Image term(m_width, m_height);
+	for (int i = 1; i < rank; ++i)
+	{
+		filter_separable(&term, kernel_size, horizontal + i * kernel_size, vertical + i * kernel_size, wrap_mode);
+		parallel_for(BlockedRange(0, int(m_pixels.size())), 4096, [&](BlockedRange const& r)
+		{
+			for (int k = r.begin; k < r.end; ++k)
+				target->m_pixels[k] += term.m_pixels[k];
+		});
+	}
+}
+
+const char* Image::filter_algorithm_name(FilterAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+		case FILTER_DIRECT:    return "direct";
+		case FILTER_SEPARABLE: return "separable";
+		case FILTER_FFT:       return "fft";
+	}
+	return "unknown";
+}
+
+Image::FilterAlgorithm Image::select_filter_algorithm(int width, int height, int kernel_size, int rank)
+{
+	static FilterCosts const costs = calibrate_filter_costs();
+
+	double const pixels = double(width) * height;
+	double const direct_cost = costs.direct * pixels * kernel_size * kernel_size;
+	double const fft_cost = costs.fft * fft_work(width, height, kernel_size);
+	FilterAlgorithm algorithm = direct_cost <= fft_cost ? FILTER_DIRECT : FILTER_FFT;
+	if (rank > 0)
+	{
+		double const separable_cost = rank * costs.separable * pixels * 2 * kernel_size;
+		if (separable_cost <= std::min(direct_cost, fft_cost))
+			algorithm = FILTER_SEPARABLE;
+	}
+	return algorithm;
+}
+
+Image::FilterAlgorithm Image::filter_auto(Image *target, int kernel_size, float* kernel, WrapMode wrap_mode) const
+{
+	// Terms below float precision do not change the result.
+	std::vector<float> horizontal, vertical;
+	int const rank = separable_approximation(kernel_size, kernel, 1e-6f, &horizontal, &vertical);
+	FilterAlgorithm const algorithm = select_filter_algorithm(m_width, m_height, kernel_size, rank);
+	switch (algorithm)
+	{
+		case FILTER_DIRECT:
+			filter(target, kernel_size, kernel, wrap_mode);
+			break;
+		case FILTER_SEPARABLE:
+			filter_separable_terms(target, kernel_size, rank, horizontal.data(), vertical.data(), wrap_mode);
+			break;
+		case FILTER_FFT:
+			filter_fft(target, kernel_size, kernel, wrap_mode);
+			break;
+	}
+	return algorithm;
+}
+
@@ -0,0 +1,164 @@
+#include <cglib/core/image_writer.h>
+
+#include <cglib/core/assert.h>
+#include <cglib/core/image.h>
+#include <cglib/core/parallel.h>
+#include <cglib/core/pfm.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+// -----------------------------------------------------------------------------
+
+GammaEncoder::GammaEncoder(float gamma) :
+	m_gamma(gamma)
+{
+	if (!(gamma > 0.f))
+		return;
+	m_thresholds[0] = -std::numeric_limits<float>::infinity();
+	for (int b = 1; b < 256; ++b)
+	{
+		float t = float(std::pow(b / 255.0, double(gamma)));
+		while (t > 0.f && reference(std::nextafter(t, 0.f)) >= b)
+			t = std::nextafter(t, 0.f);
+		while (reference(t) < b)
+			t = std::nextafter(t, 2.f);
+		m_thresholds[b] = t;
+	}
+	for (int i = 0; i <= table_size; ++i)
+		m_start[i] = reference(float(i) / table_size);
+}
+
+std::uint8_t GammaEncoder::reference(float v) const
+{
+	float const gamma_corrected = std::pow(std::max(0.f, v), 1.f / m_gamma);
+	float const mapped          = std::max<float>(0.0f, std::min<float>(255.0f, 255.f * gamma_corrected));
+	return std::uint8_t(mapped);
+}
+
+// -----------------------------------------------------------------------------
+
+ImageWriter::ImageWriter() :
+	m_format(FORMAT_PNG),
+	m_width(0),
+	m_height(0),
+	m_rows(0)
+{
+}
+
+ImageWriter::~ImageWriter()
+{
+	if (is_open())
+		close();
+}
+
+bool ImageWriter::is_open() const
+{
+	return m_png.is_open() || m_file.is_open();
+}
+
+// -----------------------------------------------------------------------------
+
+bool ImageWriter::open(std::string const& path, int width, int height, float gamma)
+{
+	cg_assert(!is_open());
+	std::string const extension = path.substr(path.find_last_of(".") + 1);
+	if (extension == "png")
+		m_format = FORMAT_PNG;
+	else if (extension == "ppm")
+		m_format = FORMAT_PPM;
+	else if (extension == "pfm")
+		m_format = FORMAT_PFM;
+	else
+	{
+		std::cerr << "Cannot write " << path << ": only png, ppm and pfm files are supported." << std::endl;
+		return false;
+	}
+
+	m_path = path;
+	m_width = width;
+	m_height = height;
+	m_rows = 0;
+	m_encode.reset(new GammaEncoder(gamma));
+
+	if (m_format == FORMAT_PNG)
+		return m_png.open(path, width, height, 3);
+
+	m_file.open(path.c_str(), std::ios::out | std::ios::binary);
+	if (!m_file)
+	{
+		std::cerr << "Cannot open " << path << " for writing." << std::endl;
+		return false;
+	}
+	if (m_format == FORMAT_PPM)
+		m_file << "P6\n" << width << " " << height << "\n255\n";
+	else
+		write_pfm_header(m_file, width, height, 3);
+	return bool(m_file);
+}
+
+// -----------------------------------------------------------------------------
+
+bool ImageWriter::write_rows(Image const& band, int y_begin, int y_end)
+{
+	cg_assert(is_open());
+	cg_assert(band.getWidth() == m_width);
+	cg_assert(y_begin >= 0 && y_end <= band.getHeight());
+	cg_assert(m_rows + (y_end - y_begin) <= m_height);
+	int const rows = y_end - y_begin;
+	if (rows <= 0)
+		return true;
+	m_rows += rows;
+
+	if (m_format == FORMAT_PFM)
+		return write_pfm_rows(m_file, StridedImageView::of(band), y_begin, y_end);
+
+	// From the top down.
+	m_rgb.resize(std::size_t(rows) * m_width * 3);
+	GammaEncoder const& encode = *m_encode;
+	glm::vec4 const* pixels = band.getPixels();
+	parallel_for(BlockedRange(0, rows), 16, [&](BlockedRange const& r)
+	{
+		for (int i = r.begin; i < r.end; ++i)
+		{
+			glm::vec4 const* src = pixels + std::size_t(y_end - 1 - i) * m_width;
+			std::uint8_t* dst = &m_rgb[std::size_t(i) * m_width * 3];
+			for (int x = 0; x < m_width; ++x)
+				for (int c = 0; c < 3; ++c)
+					dst[3*x+c] = encode(src[x][c]);
+		}
+	});
+
+	if (m_format == FORMAT_PNG)
+		return m_png.write_rows(m_rgb.data(), rows, 3 * m_width);
+
+	m_file.write(reinterpret_cast<char const*>(m_rgb.data()), std::streamsize(m_rgb.size()));
+	if (!m_file)
+	{
+		std::cerr << "An error occured while writing " << m_path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+bool ImageWriter::close()
+{
+	cg_assert(is_open());
+	if (m_format == FORMAT_PNG)
+		return m_png.close();
+
+	if (m_rows != m_height)
+		std::cerr << "warning: " << m_path << " has only " << m_rows << " of " << m_height << " rows" << std::endl;
+
+	m_file.close();
+	if (!m_file)
+	{
+		std::cerr << "An error occured while writing " << m_path << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -526,6 +526,52 @@ bool OBJFile::loadFile(const std::string& filename, bool abortOnMissingMaterial)
 	return true;
 }
 
+bool OBJFile::loadMaterialLibraries(const std::string& filename) {
+	std::ifstream f(filename, std::ios::binary);
+
+	if (!f.is_open()) {
+		std::cerr << "could not open file '" << filename << "'" << std::endl;
+		return false;
+	}
+
+	bool success = true;
+	std::string line;
+
+	while (getline(f, line))
+	{
+		auto* cursor = line.data();
+		auto* endCursor = cursor + line.size();
+
+		// remove '\r' on line end
+		if (cursor < endCursor && endCursor[-1] == '\r') {
+			--endCursor;
+		}
+
+		cursor = skipws(cursor, endCursor);
+
+		if (cursor == endCursor || *cursor == '#')
+			continue;
+
+		// the geometry starts
+		if (*cursor == 'v' || *cursor == 'f')
+			break;
+
+		auto endofword = nextws(cursor, endCursor);
+		if (std::string(cursor, endofword) != "mtllib")
+			continue;
+		cursor = skipws(endofword, endCursor);
+
+		std::string matFile = getFilePath(filename) + std::string(cursor, endCursor);
+		if (!loadMaterialFile(matFile)) {
+			if (verbose)
+				printf("Failed to load material file '%s'\n", matFile.c_str());
+			success = false;
+		}
+	}
+
+	return success;
+}
+
 bool OBJFile::loadMaterialFile(const std::string& filename) {
 	if (verbose)
 		printf("Loading material file '%s'\n", filename.c_str());
@@ -1,4 +1,5 @@
 #include <cglib/core/parameters.h>
+#include <cglib/core/thread_pool.h>
 
 #include <iostream>
 #include <sstream>
@@ -40,13 +41,34 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 				<< "--width  N           The output image width.\n"
 				<< "--height N           The output image height.\n"
 				<< "--num-threads N      The number of threads to be used for rendering. Minimum 1.\n"
-				<< "--tile-size N        The size of one work unit, in pixels.\n"
+				<< "--thread-affinity P  Pin rendering threads: none, compact or scatter over NUMA nodes.\n"
+				<< "--tile-size N        The size of one work unit, in pixels, or auto.\n"
+				<< "--tile-order ORDER   Tile order: spiral, cost or hilbert.\n"
+				<< "--no-tile-split      Do not split the last tiles of a frame.\n"
+				<< "--stats              Report thread pool utilization and timings.\n"
 				<< "--fps N              The display rate.\n"
+				<< "--time-budget SEC    Render progressively for SEC seconds after the scene is loaded\n"
+				<< "                     (noninteractive mode).\n"
+				<< "--stream-rows N      Render and write the image in bands of N rows (noninteractive mode,\n"
+				<< "                     not with --time-budget).\n";
+			derived_print_help(std::cout);
+			std::cout
 				<< "--help, -h           Display this information.\n"
 				<< std::flush;
 			return false;
 		}
 
+		int const consumed = derived_parse_option(arg, argc, argv, i);
+		if (consumed < 0)
+		{
+			return false;
+		}
+		else if (consumed > 0)
+		{
+			i += consumed - 1;
+			continue;
+		}
+
 		// Options without arguments.
 		if (arg == "--noninteractive")
 		{
@@ -68,6 +90,14 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 		{
 			gauss = true;
 		}
+		else if (arg == "--no-tile-split")
+		{
+			split_tiles = false;
+		}
+		else if (arg == "--stats")
+		{
+			stats = true;
+		}
 
 		else
 		{
@@ -106,10 +136,42 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 				std::cout << "num_threads: " << num_threads << std::endl;
 			}
 
+			else if (arg == "--thread-affinity")
+			{
+				std::string policy;
+				is >> policy;
+				if (policy == "none")
+					thread_affinity = AFFINITY_NONE;
+				else if (policy == "compact")
+					thread_affinity = AFFINITY_COMPACT;
+				else if (policy == "scatter")
+					thread_affinity = AFFINITY_SCATTER;
+				else
+					success = false;
+			}
+
 			else if (arg == "--tile-size")
 			{
-				success = bool(is >> tile_size);
-				tile_size = std::max<std::uint32_t>(1, tile_size);
+				auto_tile_size = (is.str() == "auto");
+				if (!auto_tile_size)
+				{
+					success = bool(is >> tile_size);
+					tile_size = std::max<std::uint32_t>(1, tile_size);
+				}
+			}
+
+			else if (arg == "--tile-order")
+			{
+				std::string order;
+				is >> order;
+				if (order == "spiral")
+					tile_order = TILE_ORDER_SPIRAL;
+				else if (order == "cost")
+					tile_order = TILE_ORDER_COST;
+				else if (order == "hilbert")
+					tile_order = TILE_ORDER_HILBERT;
+				else
+					success = false;
 			}
 
 			else if (arg == "--fps")
@@ -122,6 +184,15 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 			{
 				success = bool(is >> eye_separation);
 			}
+
+			else if (arg == "--time-budget")
+			{
+				success = bool(is >> time_budget) && time_budget > 0.0f;
+			}
+			else if (arg == "--stream-rows")
+			{
+				success = bool(is >> stream_rows) && stream_rows > 0;
+			}
 			
 			if (!success)
 			{
@@ -131,6 +202,17 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 		}
 	}
 
+	// Streaming writes every band once, progressive passes revisit all of them.
+	if (stream_rows > 0 && time_budget > 0.0f)
+	{
+		std::cerr << "--stream-rows cannot be combined with --time-budget" << std::endl;
+		return false;
+	}
+
+	// HostRender renders on the global pool, so rendering and the parallel
+	// algorithms it calls, e.g. for writing images, share the same threads.
+	ThreadPool::configure_global(unsigned(std::max(1, num_threads)), thread_affinity);
+
 	return true;
 }
 
@@ -0,0 +1,232 @@
+#include <cglib/core/pfm.h>
+
+#include <cglib/core/assert.h>
+#include <cglib/core/image.h>
+#include <cglib/core/parallel.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CG_PFM_MMAP
+#endif
+
+namespace {
+
+/*
+ * The next line of the header, starting at position. Returns false at the
+ * end of the file.
+ */
+bool next_line(char const* data, std::size_t size, std::size_t* position, std::string* line)
+{
+	if (*position >= size)
+		return false;
+	std::size_t end = *position;
+	while (end < size && data[end] != '\n')
+		++end;
+	line->assign(data + *position, end - *position);
+	*position = std::min(size, end + 1);
+	return true;
+}
+
+/*
+ * The offset of the pixels after the header, which has the same lines as
+ * read by Image::load_pfm: the type, comments, the size and the scale.
+ */
+bool parse_header(char const* data, std::size_t size, std::string const& path, StridedImageView* view)
+{
+	std::size_t position = 0;
+	std::string type, line;
+	if (!next_line(data, size, &position, &type))
+		return false;
+	do {
+		if (!next_line(data, size, &position, &line))
+			return false;
+	} while (line.length() > 0 && line.at(0) == '#');
+
+	int width = 0, height = 0;
+	if (std::sscanf(line.c_str(), "%i %i", &width, &height) != 2 || width <= 0 || height <= 0) {
+		std::cerr << "Invalid size in " << path << "." << std::endl;
+		return false;
+	}
+	if (!next_line(data, size, &position, &line))
+		return false;
+	float endian = 0.f;
+	std::sscanf(line.c_str(), "%f", &endian);
+	if (endian > 0) {
+		std::cerr << "only little endian supported" << std::endl;
+		return false;
+	}
+
+	int const channels = (type.compare(0, 2, "Pf") == 0) ? 1 : 3;
+	std::size_t const bytes = std::size_t(width) * height * channels * sizeof(float);
+	if (size - position < bytes) {
+		std::cerr << "An error occured while reading " << path << "." << std::endl;
+		return false;
+	}
+	view->data = data + position;
+	view->width = width;
+	view->height = height;
+	view->channels = channels;
+	view->pixel_stride = channels * sizeof(float);
+	view->row_stride = width * view->pixel_stride;
+	return true;
+}
+
+} // namespace
+
+// -----------------------------------------------------------------------------
+
+StridedImageView StridedImageView::of(Image const& image)
+{
+	StridedImageView view;
+	view.data = reinterpret_cast<char const*>(image.getPixels());
+	view.width = image.getWidth();
+	view.height = image.getHeight();
+	view.channels = 3;
+	view.pixel_stride = sizeof(glm::vec4);
+	view.row_stride = image.getWidth() * view.pixel_stride;
+	return view;
+}
+
+// -----------------------------------------------------------------------------
+
+PfmView::PfmView() :
+	m_mapping(nullptr),
+	m_mapping_size(0)
+{
+}
+
+PfmView::~PfmView()
+{
+	close();
+}
+
+// -----------------------------------------------------------------------------
+
+bool PfmView::open(std::string const& path)
+{
+	close();
+	char const* data = nullptr;
+	std::size_t size = 0;
+
+#ifdef CG_PFM_MMAP
+	int const fd = ::open(path.c_str(), O_RDONLY);
+	struct stat status;
+	if (fd >= 0 && fstat(fd, &status) == 0 && status.st_size > 0) {
+		void* mapping = mmap(nullptr, std::size_t(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED) {
+			m_mapping = mapping;
+			m_mapping_size = std::size_t(status.st_size);
+			data = static_cast<char const*>(mapping);
+			size = m_mapping_size;
+		}
+	}
+	if (fd >= 0)
+		::close(fd);
+#endif
+
+	if (!data) {
+		std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+		if (!file) {
+			std::cerr << "Cannot open " << path << " for reading." << std::endl;
+			return false;
+		}
+		m_contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		data = m_contents.data();
+		size = m_contents.size();
+	}
+
+	if (!parse_header(data, size, path, &m_pixels)) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void PfmView::close()
+{
+#ifdef CG_PFM_MMAP
+	if (m_mapping)
+		munmap(m_mapping, m_mapping_size);
+#endif
+	m_mapping = nullptr;
+	m_mapping_size = 0;
+	std::vector<char>().swap(m_contents);
+	m_pixels = StridedImageView();
+}
+
+// -----------------------------------------------------------------------------
+
+void PfmView::to_image(Image* image) const
+{
+	cg_assert(image);
+	cg_assert(is_open());
+	StridedImageView const& view = m_pixels;
+	image->setSize(view.width, view.height);
+	glm::vec4* pixels = image->getPixels();
+	parallel_for(BlockedRange(0, view.height), 16, [&](BlockedRange const& rows)
+	{
+		for (int y = rows.begin; y < rows.end; ++y)
+		for (int x = 0; x < view.width; ++x)
+		{
+			glm::vec4& p = pixels[y * view.width + x];
+			if (view.channels == 3)
+				p = glm::vec4(view.at(x, y, 0), view.at(x, y, 1), view.at(x, y, 2), 0.f);
+			else
+				p = glm::vec4(view.at(x, y, 0), view.at(x, y, 0), view.at(x, y, 0), 0.f);
+		}
+	});
+}
+
+// -----------------------------------------------------------------------------
+
+bool write_pfm(std::string const& path, StridedImageView const& view)
+{
+	cg_assert(view.channels == 1 || view.channels == 3);
+	std::ofstream of(path.c_str(), std::ios::out | std::ios::binary);
+
+	if (!of) {
+		std::cerr << "Cannot open " << path << " for writing." << std::endl;
+		return false;
+	}
+
+	write_pfm_header(of, view.width, view.height, view.channels);
+	if (!write_pfm_rows(of, view, 0, view.height)) {
+		std::cerr << "An error occured while writing " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void write_pfm_header(std::ostream& os, int width, int height, int channels)
+{
+	os << (channels == 3 ? "PF\n" : "Pf\n") << width << " " << height << "\n-1.0\n";
+}
+
+bool write_pfm_rows(std::ostream& os, StridedImageView const& view, int y_begin, int y_end)
+{
+	if (view.is_packed()) {
+		os.write(view.data + y_begin * view.row_stride,
+			static_cast<std::streamsize>((y_end - y_begin) * view.row_stride));
+		return bool(os);
+	}
+
+	// Gather one row at a time.
+	std::vector<float> row(std::size_t(view.width) * view.channels);
+	for (int y = y_begin; y < y_end && os; ++y) {
+		for (int x = 0; x < view.width; ++x)
+			for (int c = 0; c < view.channels; ++c)
+				row[x * view.channels + c] = view.at(x, y, c);
+		os.write(reinterpret_cast<char const*>(row.data()),
+			static_cast<std::streamsize>(row.size() * sizeof(float)));
+	}
+	return bool(os);
+}
@@ -0,0 +1,447 @@
+#include <cglib/core/png_writer.h>
+
+#include <cglib/core/assert.h>
+#include <cglib/core/parallel.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+// Implemented in stb.cpp. Compresses into a zlib stream with a single
+// block of fixed Huffman codes, the result is freed with free().
+unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+namespace {
+
+std::uint32_t const adler_base = 65521;
+
+/*
+ * The checksum of two concatenated pieces of data from the checksums of
+ * both pieces, as adler32_combine in zlib.
+ */
+std::uint32_t adler32_combine(std::uint32_t adler1, std::uint32_t adler2, std::size_t length2)
+{
+	std::uint32_t const remainder = std::uint32_t(length2 % adler_base);
+	std::uint32_t sum1 = adler1 & 0xffff;
+	std::uint32_t sum2 = std::uint32_t((std::uint64_t(remainder) * sum1) % adler_base);
+	sum1 += (adler2 & 0xffff) + adler_base - 1;
+	sum2 += (adler1 >> 16) + (adler2 >> 16) + adler_base - remainder;
+	if (sum1 >= adler_base) sum1 -= adler_base;
+	if (sum1 >= adler_base) sum1 -= adler_base;
+	if (sum2 >= (adler_base << 1)) sum2 -= (adler_base << 1);
+	if (sum2 >= adler_base) sum2 -= adler_base;
+	return sum1 | (sum2 << 16);
+}
+
+struct Crc32Table
+{
+	Crc32Table()
+	{
+		for (std::uint32_t n = 0; n < 256; ++n)
+		{
+			std::uint32_t c = n;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	}
+	std::uint32_t table[256];
+};
+
+std::uint32_t crc32_update(std::uint32_t crc, std::uint8_t const* data, std::size_t length)
+{
+	static Crc32Table const crc_table;
+	for (std::size_t i = 0; i < length; ++i)
+		crc = crc_table.table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/*
+ * Reads a deflate stream, least significant bit first.
+ */
+class BitReader
+{
+	public:
+		explicit BitReader(std::uint8_t const* data) : m_data(data), m_position(0) {}
+
+		int bit()
+		{
+			int const b = (m_data[m_position >> 3] >> (m_position & 7)) & 1;
+			++m_position;
+			return b;
+		}
+
+		int bits(int count)
+		{
+			int value = 0;
+			for (int i = 0; i < count; ++i)
+				value |= bit() << i;
+			return value;
+		}
+
+		// Huffman codes are stored starting with their most significant bit.
+		int code(int count)
+		{
+			int value = 0;
+			for (int i = 0; i < count; ++i)
+				value = (value << 1) | bit();
+			return value;
+		}
+
+		std::size_t position() const { return m_position; }
+
+	private:
+		std::uint8_t const* m_data;
+		std::size_t         m_position;
+};
+
+/*
+ * The number of bits of a deflate block with fixed Huffman codes up to and
+ * including its end-of-block code, which is what stbi_zlib_compress
+ * writes after the zlib header.
+ */
+std::size_t fixed_huffman_block_bits(std::uint8_t const* block)
+{
+	static int const length_extra[29] = {
+		0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+	BitReader reader(block);
+	reader.bits(3); // BFINAL, BTYPE
+	for (;;)
+	{
+		// 7 bit codes are 256..279, 8 bit codes 0..143 and 280..287,
+		// 9 bit codes 144..255.
+		int symbol;
+		int code = reader.code(7);
+		if (code <= 23)
+		{
+			symbol = 256 + code;
+		}
+		else
+		{
+			code = (code << 1) | reader.bit();
+			if (code >= 48 && code <= 191)
+				symbol = code - 48;
+			else if (code >= 192 && code <= 199)
+				symbol = 280 + code - 192;
+			else
+				symbol = 144 + ((code << 1) | reader.bit()) - 400;
+		}
+
+		if (symbol == 256)
+			return reader.position();
+		if (symbol > 256)
+		{
+			reader.bits(length_extra[symbol - 257]);
+			int const distance = reader.code(5);
+			if (distance >= 4)
+				reader.bits(distance / 2 - 1);
+		}
+	}
+}
+
+inline std::uint8_t paeth(int a, int b, int c)
+{
+	int const p = a + b - c;
+	int const pa = std::abs(p - a);
+	int const pb = std::abs(p - b);
+	int const pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc) return std::uint8_t(a);
+	if (pb <= pc) return std::uint8_t(b);
+	return std::uint8_t(c);
+}
+
+/*
+ * Filter one row into out, which starts with the filter type. The type
+ * with the smallest sum of absolute differences is chosen, like stb does.
+ * above is a row of zeros for the first row.
+ */
+void filter_row(std::uint8_t const* row, std::uint8_t const* above, int bytes, int bpp,
+	std::uint8_t* out, std::vector<std::uint8_t>& scratch)
+{
+	int best_type = 0;
+	long best_sum = -1;
+	scratch.resize(bytes);
+	for (int type = 0; type < 5; ++type)
+	{
+		long sum = 0;
+		for (int i = 0; i < bytes; ++i)
+		{
+			int const left = (i >= bpp) ? row[i - bpp] : 0;
+			int const up = above[i];
+			int const up_left = (i >= bpp) ? above[i - bpp] : 0;
+			int predicted = 0;
+			switch (type)
+			{
+				case 1: predicted = left; break;
+				case 2: predicted = up; break;
+				case 3: predicted = (left + up) >> 1; break;
+				case 4: predicted = paeth(left, up, up_left); break;
+			}
+			std::uint8_t const value = std::uint8_t(row[i] - predicted);
+			scratch[i] = value;
+			sum += std::abs(int(std::int8_t(value)));
+		}
+		if (best_sum < 0 || sum < best_sum)
+		{
+			best_sum = sum;
+			best_type = type;
+			std::copy(scratch.begin(), scratch.end(), out + 1);
+		}
+	}
+	out[0] = std::uint8_t(best_type);
+}
+
+void put32(std::vector<std::uint8_t>& out, std::uint32_t v)
+{
+	out.push_back(std::uint8_t(v >> 24));
+	out.push_back(std::uint8_t(v >> 16));
+	out.push_back(std::uint8_t(v >> 8));
+	out.push_back(std::uint8_t(v));
+}
+
+} // namespace
+
+// -----------------------------------------------------------------------------
+
+PngWriter::PngWriter() :
+	m_width(0),
+	m_height(0),
+	m_components(0),
+	m_rows(0),
+	m_pending(0),
+	m_pending_bits(0),
+	m_adler(1)
+{
+}
+
+PngWriter::~PngWriter()
+{
+	if (m_file.is_open())
+		close();
+}
+
+// -----------------------------------------------------------------------------
+
+bool PngWriter::open(std::string const& path, int width, int height, int components)
+{
+	cg_assert(!m_file.is_open());
+	cg_assert(components == 1 || components == 3 || components == 4);
+	m_file.open(path.c_str(), std::ios::out | std::ios::binary);
+	if (!m_file)
+	{
+		std::cerr << "Cannot open " << path << " for writing." << std::endl;
+		return false;
+	}
+	m_path = path;
+	m_width = width;
+	m_height = height;
+	m_components = components;
+	m_rows = 0;
+	m_previous_row.assign(std::size_t(width) * components, 0);
+	m_stream.clear();
+	m_pending = 0;
+	m_pending_bits = 0;
+	m_adler = 1;
+
+	static std::uint8_t const signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	m_file.write(reinterpret_cast<char const*>(signature), 8);
+
+	static std::uint8_t const color_type[5] = { 0, 0, 0, 2, 6 };
+	std::vector<std::uint8_t> header;
+	put32(header, std::uint32_t(width));
+	put32(header, std::uint32_t(height));
+	header.push_back(8);
+	header.push_back(color_type[components]);
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	write_chunks("IHDR", header);
+
+	// zlib header, 32K window.
+	m_stream.push_back(0x78);
+	m_stream.push_back(0x5e);
+	return bool(m_file);
+}
+
+// -----------------------------------------------------------------------------
+
+bool PngWriter::write_rows(std::uint8_t const* pixels, int rows, int stride_bytes)
+{
+	cg_assert(m_file.is_open());
+	cg_assert(m_rows + rows <= m_height);
+	if (rows <= 0)
+		return true;
+
+	int const row_bytes = m_width * m_components;
+	// Bands of about 256 KB, large enough that compressing them separately
+	// costs little compression.
+	int const band_rows = std::max(1, (1 << 18) / (row_bytes + 1));
+	int const num_bands = (rows + band_rows - 1) / band_rows;
+
+	struct Band
+	{
+		unsigned char* zlib = nullptr;
+		int            zlib_bytes = 0;
+		std::size_t    filtered_bytes = 0;
+	};
+	std::vector<Band> bands(num_bands);
+
+	parallel_for(BlockedRange(0, num_bands), 1, [&](BlockedRange const& r)
+	{
+		std::vector<std::uint8_t> filtered;
+		std::vector<std::uint8_t> scratch;
+		for (int b = r.begin; b < r.end; ++b)
+		{
+			int const first = b * band_rows;
+			int const count = std::min(band_rows, rows - first);
+			filtered.resize(std::size_t(count) * (row_bytes + 1));
+			for (int y = first; y < first + count; ++y)
+			{
+				std::uint8_t const* row = pixels + std::size_t(y) * stride_bytes;
+				std::uint8_t const* above = (y == 0)
+					? m_previous_row.data() : pixels + std::size_t(y - 1) * stride_bytes;
+				filter_row(row, above, row_bytes, m_components,
+					&filtered[std::size_t(y - first) * (row_bytes + 1)], scratch);
+			}
+			bands[b].filtered_bytes = filtered.size();
+			bands[b].zlib = stbi_zlib_compress(filtered.data(), int(filtered.size()), &bands[b].zlib_bytes, 8);
+		}
+	});
+
+	// Chain the blocks into the stream. The last block of the stream is
+	// added by close(), so no band ends the stream.
+	bool ok = true;
+	for (int b = 0; b < num_bands; ++b)
+	{
+		Band const& band = bands[b];
+		if (!band.zlib)
+		{
+			ok = false;
+			continue;
+		}
+		std::uint8_t* block = band.zlib + 2;
+		block[0] &= 0xfe; // BFINAL
+		append_bits(block, fixed_huffman_block_bits(block));
+		std::uint8_t const* a = band.zlib + band.zlib_bytes - 4;
+		std::uint32_t const adler = (std::uint32_t(a[0]) << 24) | (std::uint32_t(a[1]) << 16)
+			| (std::uint32_t(a[2]) << 8) | std::uint32_t(a[3]);
+		m_adler = adler32_combine(m_adler, adler, band.filtered_bytes);
+		std::free(band.zlib);
+	}
+
+	std::uint8_t const* last = pixels + std::size_t(rows - 1) * stride_bytes;
+	std::copy(last, last + row_bytes, m_previous_row.begin());
+	m_rows += rows;
+
+	ok = write_chunks("IDAT", m_stream) && ok;
+	m_stream.clear();
+	return ok;
+}
+
+// -----------------------------------------------------------------------------
+
+bool PngWriter::close()
+{
+	cg_assert(m_file.is_open());
+	if (m_rows != m_height)
+		std::cerr << "warning: " << m_path << " has only " << m_rows << " of " << m_height << " rows" << std::endl;
+
+	// An empty final block with fixed codes: BFINAL, BTYPE = 1 and the
+	// 7 zero bits of the end-of-block code.
+	std::uint8_t const final_block[2] = { 0x03, 0x00 };
+	append_bits(final_block, 10);
+	if (m_pending_bits > 0)
+	{
+		m_stream.push_back(std::uint8_t(m_pending));
+		m_pending = 0;
+		m_pending_bits = 0;
+	}
+	put32(m_stream, m_adler);
+	bool ok = write_chunks("IDAT", m_stream);
+	m_stream.clear();
+	ok = write_chunks("IEND", m_stream) && ok;
+	m_file.close();
+	if (!ok || !m_file)
+	{
+		std::cerr << "An error occured while writing " << m_path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+void PngWriter::append_bits(std::uint8_t const* bits, std::size_t count)
+{
+	std::size_t const bytes = count / 8;
+	m_stream.reserve(m_stream.size() + bytes + 1);
+	for (std::size_t i = 0; i < bytes; ++i)
+	{
+		m_pending |= std::uint32_t(bits[i]) << m_pending_bits;
+		m_stream.push_back(std::uint8_t(m_pending));
+		m_pending >>= 8;
+	}
+	int const rest = int(count % 8);
+	if (rest > 0)
+	{
+		m_pending |= (std::uint32_t(bits[bytes]) & ((1u << rest) - 1)) << m_pending_bits;
+		m_pending_bits += rest;
+		if (m_pending_bits >= 8)
+		{
+			m_stream.push_back(std::uint8_t(m_pending));
+			m_pending >>= 8;
+			m_pending_bits -= 8;
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+bool PngWriter::write_chunks(char const* type, std::vector<std::uint8_t> const& data)
+{
+	// Large data is split into chunks of 1 MB, whose checksums are
+	// computed in parallel. Only IDAT may be split like this.
+	std::size_t const chunk_bytes = 1 << 20;
+	std::size_t const num_chunks = std::max<std::size_t>(1, (data.size() + chunk_bytes - 1) / chunk_bytes);
+	cg_assert(num_chunks == 1 || std::string(type) == "IDAT");
+
+	std::vector<std::uint32_t> crcs(num_chunks);
+	parallel_for(BlockedRange(0, int(num_chunks)), 1, [&](BlockedRange const& r)
+	{
+		for (int c = r.begin; c < r.end; ++c)
+		{
+			std::size_t const begin = c * chunk_bytes;
+			std::size_t const end = std::min(data.size(), begin + chunk_bytes);
+			std::uint32_t crc = crc32_update(0xffffffffu, reinterpret_cast<std::uint8_t const*>(type), 4);
+			crc = crc32_update(crc, data.data() + begin, end - begin);
+			crcs[c] = ~crc;
+		}
+	});
+
+	for (std::size_t c = 0; c < num_chunks; ++c)
+	{
+		std::size_t const begin = c * chunk_bytes;
+		std::size_t const end = std::min(data.size(), begin + chunk_bytes);
+		std::vector<std::uint8_t> header;
+		put32(header, std::uint32_t(end - begin));
+		m_file.write(reinterpret_cast<char const*>(header.data()), 4);
+		m_file.write(type, 4);
+		m_file.write(reinterpret_cast<char const*>(data.data() + begin), std::streamsize(end - begin));
+		header.clear();
+		put32(header, crcs[c]);
+		m_file.write(reinterpret_cast<char const*>(header.data()), 4);
+	}
+	return bool(m_file);
+}
+
+// -----------------------------------------------------------------------------
+
+bool write_png(std::string const& path, int width, int height, int components,
+	std::uint8_t const* pixels, int stride_bytes)
+{
+	PngWriter png;
+	if (!png.open(path, width, height, components))
+		return false;
+	bool const ok = png.write_rows(pixels, height, stride_bytes);
+	return png.close() && ok;
+}
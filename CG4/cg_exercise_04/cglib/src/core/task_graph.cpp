@@ -0,0 +1,129 @@
+#include <cglib/core/task_graph.h>
+
+#include <cglib/core/assert.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+// -----------------------------------------------------------------------------
+
+TaskGraph::TaskId TaskGraph::add(std::string const& name, std::function<void()> task,
+	std::vector<TaskId> const& dependencies)
+{
+	TaskId const id = static_cast<TaskId>(m_nodes.size());
+	m_nodes.emplace_back(new Node());
+	Node& node = *m_nodes.back();
+	node.name = name;
+	node.task = std::move(task);
+	node.dependencies = dependencies;
+	node.start = 0.0;
+	node.seconds = 0.0;
+	for (TaskId dependency : dependencies)
+	{
+		cg_assert(dependency >= 0 && dependency < id);
+		m_nodes[dependency]->successors.push_back(id);
+	}
+	return id;
+}
+
+// -----------------------------------------------------------------------------
+
+void TaskGraph::run(ThreadPool& pool)
+{
+	for (auto& node : m_nodes)
+	{
+		node->pending.store(static_cast<int>(node->dependencies.size()));
+		node->start = 0.0;
+		node->seconds = 0.0;
+	}
+
+	m_start = std::chrono::steady_clock::now();
+	TaskGroup group(pool);
+	for (TaskId id = 0; id < static_cast<TaskId>(m_nodes.size()); ++id)
+	{
+		if (m_nodes[id]->dependencies.empty())
+		{
+			group.spawn([this, &group, id] { execute(group, id); });
+		}
+	}
+	try
+	{
+		group.sync();
+	} catch (...)
+	{
+		m_wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+		throw;
+	}
+	m_wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+// -----------------------------------------------------------------------------
+
+void TaskGraph::execute(TaskGroup& group, TaskId id)
+{
+	Node& node = *m_nodes[id];
+	auto const start = std::chrono::steady_clock::now();
+	node.task();
+	auto const end = std::chrono::steady_clock::now();
+	node.start = std::chrono::duration<double>(start - m_start).count();
+	node.seconds = std::chrono::duration<double>(end - start).count();
+
+	// The last dependency to finish starts the successor.
+	for (TaskId successor : node.successors)
+	{
+		if (--m_nodes[successor]->pending == 0)
+		{
+			group.spawn([this, &group, successor] { execute(group, successor); });
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+double TaskGraph::critical_path_seconds() const
+{
+	// Tasks only depend on earlier tasks, so the ids are a topological order.
+	std::vector<double> finish(m_nodes.size(), 0.0);
+	double longest = 0.0;
+	for (std::size_t id = 0; id < m_nodes.size(); ++id)
+	{
+		double ready = 0.0;
+		for (TaskId dependency : m_nodes[id]->dependencies)
+		{
+			ready = std::max(ready, finish[dependency]);
+		}
+		finish[id] = ready + m_nodes[id]->seconds;
+		longest = std::max(longest, finish[id]);
+	}
+	return longest;
+}
+
+// -----------------------------------------------------------------------------
+
+double TaskGraph::serial_seconds() const
+{
+	double sum = 0.0;
+	for (auto const& node : m_nodes)
+	{
+		sum += node->seconds;
+	}
+	return sum;
+}
+
+// -----------------------------------------------------------------------------
+
+void TaskGraph::print_timings(std::ostream& os) const
+{
+	std::ios::fmtflags const flags = os.flags();
+	os << std::fixed << std::setprecision(3);
+	for (auto const& node : m_nodes)
+	{
+		os << "  " << std::left << std::setw(40) << node->name << std::right
+		   << " start " << std::setw(7) << node->start << " s"
+		   << "  took " << std::setw(7) << node->seconds << " s" << std::endl;
+	}
+	os << "  wall " << m_wallSeconds << " s, longest chain " << critical_path_seconds()
+	   << " s, serial " << serial_seconds() << " s" << std::endl;
+	os.flags(flags);
+}
@@ -2,24 +2,238 @@
 #include <cglib/core/timer.h>
 
 #include <cglib/core/assert.h>
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 
-ThreadPool::ThreadPool(unsigned max_threads) :
-	m_numJobs(0), m_hasException(false)
+// The pool and worker index of the calling thread, if it is a worker.
+static thread_local ThreadPool* tl_pool   = nullptr;
+static thread_local int         tl_worker = -1;
+// Number of tasks the calling thread is executing, nested in each other.
+static thread_local int         tl_depth  = 0;
+
+static long long now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -----------------------------------------------------------------------------
+
+/*
+ * Chase-Lev work-stealing deque with a fixed capacity, following
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al. 2013).
+ *
+ * Only the owning worker calls push() and pop(), any thread may call steal().
+ */
+class WorkStealingDeque
+{
+	public:
+		typedef ThreadPool::Task Task;
+
+		explicit WorkStealingDeque(int log_capacity = 12) :
+			m_top(0), m_bottom(0),
+			m_mask((std::int64_t(1) << log_capacity) - 1),
+			m_buffer(std::size_t(1) << log_capacity)
+		{
+		}
+
+		// Returns false if the deque is full.
+		bool push(Task* task)
+		{
+			std::int64_t const b = m_bottom.load(std::memory_order_relaxed);
+			std::int64_t const t = m_top.load(std::memory_order_acquire);
+			if (b - t > m_mask)
+			{
+				return false;
+			}
+			m_buffer[b & m_mask].store(task, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		Task* pop()
+		{
+			std::int64_t const b = m_bottom.load(std::memory_order_relaxed) - 1;
+			m_bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::int64_t t = m_top.load(std::memory_order_relaxed);
+
+			Task* task = nullptr;
+			if (t <= b)
+			{
+				task = m_buffer[b & m_mask].load(std::memory_order_relaxed);
+				if (t == b)
+				{
+					// Last task, race against thieves.
+					if (!m_top.compare_exchange_strong(t, t + 1,
+							std::memory_order_seq_cst, std::memory_order_relaxed))
+					{
+						task = nullptr;
+					}
+					m_bottom.store(b + 1, std::memory_order_relaxed);
+				}
+			}
+			else
+			{
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return task;
+		}
+
+		Task* steal()
+		{
+			std::int64_t t = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::int64_t const b = m_bottom.load(std::memory_order_acquire);
+			if (t >= b)
+			{
+				return nullptr;
+			}
+
+			Task* task = m_buffer[t & m_mask].load(std::memory_order_relaxed);
+			if (!m_top.compare_exchange_strong(t, t + 1,
+					std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				// Lost the race against the owner or another thief.
+				return nullptr;
+			}
+			return task;
+		}
+
+		bool empty() const
+		{
+			return m_bottom.load() <= m_top.load();
+		}
+
+	private:
+		std::atomic<std::int64_t>        m_top;
+		std::atomic<std::int64_t>        m_bottom;
+		std::int64_t const               m_mask;
+		std::vector<std::atomic<Task*>>  m_buffer;
+};
+
+// -----------------------------------------------------------------------------
+
+TaskGroup::TaskGroup(ThreadPool& pool) :
+	m_pool(pool), m_pending(0)
+{
+}
+
+// -----------------------------------------------------------------------------
+
+TaskGroup::~TaskGroup()
+{
+	if (m_pending.load() > 0)
+	{
+		try
+		{
+			sync();
+		} catch (...)
+		{
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void TaskGroup::spawn(std::function<void()> task)
+{
+	m_pending++;
+	m_pool.push(new ThreadPool::Task{ std::move(task), this });
+}
+
+// -----------------------------------------------------------------------------
+
+void TaskGroup::sync()
+{
+	int const worker = m_pool.current_worker();
+	if (worker >= 0)
+	{
+		// Help with whatever work is available instead of idling. Jobs of
+		// runs are not started nested: the caller may hold resources of its
+		// own job, e.g. a tile of the frame that the next run renders again.
+		// They are queued again in their order once the group is done.
+		std::vector<ThreadPool::Task*> jobs;
+		while (m_pending.load() > 0)
+		{
+			ThreadPool::Task* task = m_pool.find_task(worker);
+			if (task && task->group != this && task->group == m_pool.m_runGroup.get())
+			{
+				jobs.push_back(task);
+			}
+			else if (task)
+			{
+				m_pool.execute(task);
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+		for (auto it = jobs.rbegin(); it != jobs.rend(); ++it)
+		{
+			m_pool.requeue(*it, worker);
+		}
+	}
+	else
+	{
+		m_pool.wait_blocking(*this);
+	}
+
+	std::exception_ptr exception;
+	{
+		std::lock_guard<std::mutex> guard(m_exceptionMutex);
+		std::swap(exception, m_exception);
+	}
+	if (exception)
+	{
+		std::rethrow_exception(exception);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(unsigned max_threads, ThreadAffinity affinity) :
+	m_run(std::make_shared<Run>()), m_runSequence(0), m_hasException(false),
+	m_numInjected(0), m_nextInjected(0),
+	m_wakeEpoch(0), m_numSleeping(0), m_numBlockedWaiters(0), m_shutdown(false),
+	m_latencySum(0), m_numRuns(0), m_statsStart(now_ns()),
+	m_numTerminates(0), m_terminateSum(0), m_terminateMax(0)
 {
 	using std::cout;
 	using std::endl;
 
 	if (max_threads == unsigned(-1))
 	{
-		max_threads = std::thread::hardware_concurrency();
+		max_threads = std::max(1u, std::thread::hardware_concurrency());
 	}
 
-	cout << "[ThreadPool] " << "Using " << max_threads << " worker threads" << endl;
 	m_threads.resize(max_threads);
-	m_tld.resize(max_threads);
-	m_terminate.store(true);
+	assign_processors(affinity);
+	cout << "[ThreadPool] " << "Using " << max_threads << " worker threads";
+	if (affinity != AFFINITY_NONE)
+	{
+		cout << ", pinned " << (affinity == AFFINITY_COMPACT ? "compact" : "scatter")
+			<< " to " << num_nodes() << " NUMA node(s)";
+	}
+	cout << endl;
+
+	for (unsigned i = 0; i < max_threads; ++i)
+	{
+		m_deques.emplace_back(new WorkStealingDeque());
+		m_counters.emplace_back(new WorkerCounters());
+	}
+	for (int node = 0; node < num_nodes(); ++node)
+	{
+		m_injected.emplace_back(new NodeQueue());
+	}
+	m_runGroup.reset(new TaskGroup(*this));
+	spawn_workers();
 }
 
 // -----------------------------------------------------------------------------
@@ -27,107 +241,672 @@ ThreadPool::ThreadPool(unsigned max_threads) :
 ThreadPool::~ThreadPool()
 {
 	terminate();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_wake.notify_all();
+	for (auto& t : m_threads)
+	{
+		if (t && t->joinable())
+		{
+			t->join();
+		}
+	}
+	for (auto& queue : m_injected)
+	{
+		for (Task* task : queue->tasks)
+		{
+			delete task;
+		}
+	}
 }
 
 // -----------------------------------------------------------------------------
 
-void ThreadPool::run_internal(
-	int num_jobs, 
-	std::function<void(int, ThreadLocalData* tld, std::atomic<bool>&)> kernel,
-	std::function<void(int, std::unique_ptr<ThreadLocalData>& tld)> tldAlloc
-)
+int ThreadPool::current_worker() const
 {
-	cg_assert(num_jobs >= 0);
-	terminate();
+	return (tl_pool == this) ? tl_worker : -1;
+}
 
-	// Set up data for jobs.
-	m_currentJob.store(0);
-	m_kernel = kernel;
-	m_numJobs.store(num_jobs);
-	m_jobsDone.store(0);
-	m_terminate.store(false);
-	m_hasException.store(false);
-	m_exceptionMsg.clear();
+// -----------------------------------------------------------------------------
 
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+ThreadPool* ThreadPool::current()
+{
+	return tl_pool;
+}
+
+// -----------------------------------------------------------------------------
+
+// Settings and instance of the global pool. It is created on first use.
+struct GlobalPool
+{
+	std::mutex                  mutex;
+	std::unique_ptr<ThreadPool> pool;
+	unsigned                    max_threads = unsigned(-1);
+	ThreadAffinity              affinity    = AFFINITY_NONE;
+
+	static GlobalPool& get()
+	{
+		static GlobalPool global;
+		return global;
+	}
+};
+
+ThreadPool& ThreadPool::global()
+{
+	GlobalPool& global = GlobalPool::get();
+	std::lock_guard<std::mutex> guard(global.mutex);
+	if (!global.pool)
+	{
+		global.pool.reset(new ThreadPool(global.max_threads, global.affinity));
+	}
+	return *global.pool;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::configure_global(unsigned max_threads, ThreadAffinity affinity)
+{
+	GlobalPool& global = GlobalPool::get();
+	std::lock_guard<std::mutex> guard(global.mutex);
+	if (global.max_threads != max_threads || global.affinity != affinity)
+	{
+		global.pool.reset();
+	}
+	global.max_threads = max_threads;
+	global.affinity    = affinity;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::assign_processors(ThreadAffinity affinity)
+{
+	int const num_workers = static_cast<int>(m_threads.size());
+	m_workerCpu.assign(num_workers, -1);
+	m_workerNode.assign(num_workers, 0);
+	m_nodeIds.assign(1, 0);
+	if (affinity == AFFINITY_NONE)
 	{
-		tldAlloc(i, m_tld[i]);
+		return;
 	}
 
-	auto thread_func = [&](int threadId) 
+	CpuTopology const& topology = CpuTopology::get();
+	int num_cpus = 0;
+	for (auto const& cpus : topology.node_cpus)
 	{
-		while (true)
+		num_cpus += static_cast<int>(cpus.size());
+	}
+
+	// Pool nodes are numbered in the order in which they receive workers.
+	std::vector<int> pool_node(topology.num_nodes(), -1);
+	m_nodeIds.clear();
+	for (int i = 0; i < num_workers; ++i)
+	{
+		int node = 0;
+		int slot = 0;
+		if (affinity == AFFINITY_COMPACT)
 		{
-			int const jobId = m_currentJob++;
-			if (jobId >= m_numJobs.load())
+			// Fill one node after the other.
+			slot = i % num_cpus;
+			while (slot >= static_cast<int>(topology.node_cpus[node].size()))
 			{
-				return;
+				slot -= static_cast<int>(topology.node_cpus[node].size());
+				++node;
 			}
+		}
+		else
+		{
+			node = i % topology.num_nodes();
+			slot = (i / topology.num_nodes()) % static_cast<int>(topology.node_cpus[node].size());
+		}
 
-			try 
-			{
-				m_kernel(jobId, m_tld[threadId].get(), m_terminate);
-			} catch (std::exception const& e)
-			{
-				std::lock_guard<std::mutex> guard(m_exceptionMutex);
-				m_hasException.store(true);
-				std::ostringstream os;
-				os << "Thread " << std::this_thread::get_id() << ": " << e.what();
-				m_exceptionMsg.push_back(os.str());
-				m_numJobs.store(0);
-				m_terminate.store(true);
-			} catch(...)
+		if (pool_node[node] < 0)
+		{
+			pool_node[node] = static_cast<int>(m_nodeIds.size());
+			m_nodeIds.push_back(topology.node_ids[node]);
+		}
+		m_workerCpu[i]  = topology.node_cpus[node][slot];
+		m_workerNode[i] = pool_node[node];
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::spawn_workers()
+{
+	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+	{
+		if (!m_threads[i])
+		{
+			m_threads[i].reset(new std::thread(&ThreadPool::worker_main, this, i));
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::worker_main(int threadId)
+{
+	tl_pool   = this;
+	tl_worker = threadId;
+	if (m_workerCpu[threadId] >= 0 && !pin_current_thread(m_workerCpu[threadId]))
+	{
+		std::cerr << "[ThreadPool] Cannot pin worker " << threadId << " to processor " << m_workerCpu[threadId] << std::endl;
+	}
+
+	while (true)
+	{
+		Task* task = find_task(threadId);
+		if (task)
+		{
+			execute(task);
+			continue;
+		}
+
+		// Park. Announce that we are about to sleep before checking for
+		// work a last time, so that a concurrent push either sees us
+		// sleeping or we see its task.
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_shutdown)
+		{
+			return;
+		}
+		unsigned const epoch = m_wakeEpoch;
+		m_numSleeping++;
+		if (!has_work())
+		{
+			WorkerCounters& counters = *m_counters[threadId];
+			counters.parkedSince.store(now_ns(), std::memory_order_relaxed);
+			m_wake.wait(lock, [&] { return m_shutdown || m_wakeEpoch != epoch; });
+			long long const since = std::max(counters.parkedSince.exchange(0, std::memory_order_relaxed),
+				m_statsStart.load(std::memory_order_relaxed));
+			counters.parked.fetch_add(now_ns() - since, std::memory_order_relaxed);
+		}
+		m_numSleeping--;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::push(Task* task)
+{
+	int const worker = current_worker();
+	if (worker >= 0)
+	{
+		if (!m_deques[worker]->push(task))
+		{
+			// Deque is full, there is enough parallelism already.
+			execute(task);
+			return;
+		}
+	}
+	else
+	{
+		inject(task, static_cast<int>(m_nextInjected++ % unsigned(num_nodes())));
+		return;
+	}
+	wake_worker();
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::inject(Task* task, int node)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_injected[node]->mutex);
+		m_injected[node]->tasks.push_back(task);
+		m_numInjected++;
+	}
+	wake_worker();
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::requeue(Task* task, int threadId)
+{
+	// Never execute here, the task was taken out of the queues so that it
+	// does not run nested.
+	if (!m_deques[threadId]->push(task))
+	{
+		inject(task, m_workerNode[threadId]);
+		return;
+	}
+	wake_worker();
+}
+
+// -----------------------------------------------------------------------------
+
+ThreadPool::Task* ThreadPool::find_task(int threadId)
+{
+	if (threadId >= 0)
+	{
+		if (Task* task = m_deques[threadId]->pop())
+		{
+			return task;
+		}
+	}
+
+	// Look for work on the own node first, then on the others.
+	int const node = (threadId >= 0) ? m_workerNode[threadId] : 0;
+	for (int i = 0; i < num_nodes(); ++i)
+	{
+		int const victim_node = (node + i) % num_nodes();
+		if (Task* task = pop_injected(victim_node))
+		{
+			return task;
+		}
+		if (Task* task = steal_on_node(victim_node, threadId))
+		{
+			if (threadId >= 0)
 			{
-				std::lock_guard<std::mutex> guard(m_exceptionMutex);
-				m_hasException.store(true);
-				std::ostringstream os;
-				os << "Thread " << std::this_thread::get_id() << ": " << "unknown exception caught";
-				m_exceptionMsg.push_back(os.str());
-				m_numJobs.store(0);
-				m_terminate.store(true);
+				m_counters[threadId]->numSteals.fetch_add(1, std::memory_order_relaxed);
 			}
-			m_jobsDone++;
-			std::this_thread::yield();
+			return task;
 		}
+	}
+	return nullptr;
+}
 
-		m_tld[threadId].reset();
-	};
+// -----------------------------------------------------------------------------
 
-	// Launch threads.
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+ThreadPool::Task* ThreadPool::pop_injected(int node)
+{
+	if (m_numInjected.load() == 0)
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> guard(m_injected[node]->mutex);
+	std::deque<Task*>& tasks = m_injected[node]->tasks;
+	if (tasks.empty())
 	{
-		m_threads[i].reset(new std::thread(thread_func, i));
+		return nullptr;
 	}
+	Task* task = tasks.front();
+	tasks.pop_front();
+	m_numInjected--;
+	return task;
 }
 
 // -----------------------------------------------------------------------------
 
-void ThreadPool::terminate() 
+ThreadPool::Task* ThreadPool::steal_on_node(int node, int threadId)
+{
+	// Start at a different victim every time.
+	static thread_local unsigned victim_offset = 0;
+	int const num_workers = static_cast<int>(m_deques.size());
+	int const start = static_cast<int>(victim_offset++ % unsigned(num_workers));
+	for (int i = 0; i < num_workers; ++i)
+	{
+		int const victim = (start + i) % num_workers;
+		if (victim == threadId || m_workerNode[victim] != node)
+		{
+			continue;
+		}
+		if (Task* task = m_deques[victim]->steal())
+		{
+			return task;
+		}
+	}
+	return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+
+bool ThreadPool::has_work() const
+{
+	if (m_numInjected.load() > 0)
+	{
+		return true;
+	}
+	for (auto const& deque : m_deques)
+	{
+		if (!deque->empty())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::execute(Task* task)
+{
+	// Tasks run nested in a sync() count towards the busy time of the
+	// outermost task only.
+	int const worker = current_worker();
+	WorkerCounters* counters = (worker >= 0) ? m_counters[worker].get() : nullptr;
+	bool const outermost = (tl_depth++ == 0);
+	if (counters && outermost)
+	{
+		counters->busySince.store(now_ns(), std::memory_order_relaxed);
+	}
+
+	TaskGroup* group = task->group;
+	try
+	{
+		task->fn();
+	} catch (...)
+	{
+		std::lock_guard<std::mutex> guard(group->m_exceptionMutex);
+		if (!group->m_exception)
+		{
+			group->m_exception = std::current_exception();
+		}
+	}
+	delete task;
+
+	tl_depth--;
+	if (counters)
+	{
+		counters->numTasks.fetch_add(1, std::memory_order_relaxed);
+		if (outermost)
+		{
+			long long const since = std::max(counters->busySince.exchange(0, std::memory_order_relaxed),
+				m_statsStart.load(std::memory_order_relaxed));
+			counters->busy.fetch_add(now_ns() - since, std::memory_order_relaxed);
+		}
+	}
+
+	// The group may be gone as soon as m_pending drops to zero.
+	if (--group->m_pending == 0 && m_numBlockedWaiters.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_idle.notify_all();
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::wake_worker()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_numSleeping.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_wakeEpoch;
+		m_wake.notify_one();
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::wait_blocking(TaskGroup& group)
+{
+	m_numBlockedWaiters++;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idle.wait(lock, [&] { return group.m_pending.load() == 0; });
+	}
+	m_numBlockedWaiters--;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::run_internal(
+	int num_jobs, 
+	std::function<void(int, ThreadLocalData* tld, std::atomic<bool>&)> kernel,
+	std::function<void(int, unsigned, std::unique_ptr<ThreadLocalData>& tld)> tldAlloc
+)
 {
-	m_numJobs.store(0);
-	m_terminate.store(true);
+	cg_assert(num_jobs >= 0);
+	cg_assert(current_worker() < 0 && bool("Cannot start a run from inside a kernel."));
+
+	// Do not wait for the previous run. Jobs of it that are still executing
+	// only touch their own run.
+	cancel();
+
+	std::shared_ptr<Run> run = std::make_shared<Run>();
+	run->kernel = kernel;
+	run->tld.resize(m_threads.size());
+	unsigned const sequence = ++m_runSequence;
 	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
 	{
-		auto& t = m_threads[i];
-		if (t && t->joinable())
+		tldAlloc(i, sequence, run->tld[i]);
+	}
+	run->numJobs.store(num_jobs);
+	run->terminate.store(false);
+
+	{
+		std::lock_guard<std::mutex> guard(m_exceptionMutex);
+		m_hasException.store(false);
+		m_exceptionMsg.clear();
+	}
+
+	// Threads only disappear after force_kill.
+	spawn_workers();
+
+	run->submitTime = std::chrono::steady_clock::now();
+	run->firstJobStarted.store(false);
+	m_run = run;
+	// Queue one block of jobs on each node, the workers of the node split it further.
+	for (int node = 0; node < num_nodes(); ++node)
+	{
+		int const begin = node_first_job(node, num_jobs);
+		int const end   = node_first_job(node + 1, num_jobs);
+		if (begin < end)
 		{
-			t->join();
+			m_runGroup->m_pending++;
+			inject(new Task{ [this, run, begin, end] { run_range(run, begin, end); }, m_runGroup.get() }, node);
 		}
-		t.reset();
-		m_tld[i].reset();
 	}
 }
 
 // -----------------------------------------------------------------------------
 
+void ThreadPool::run_range(std::shared_ptr<Run> const& run, int begin, int end)
+{
+	// Keep the lower half and leave the upper half for thieves. The owner
+	// still processes the jobs in order.
+	while (end - begin > 1 && !run->terminate.load())
+	{
+		int const mid = begin + (end - begin) / 2;
+		m_runGroup->spawn([this, run, mid, end] { run_range(run, mid, end); });
+		end = mid;
+	}
+	run_job(*run, begin, current_worker());
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::run_job(Run& run, int jobId, int threadId)
+{
+	cg_assert(threadId >= 0);
+	if (run.terminate.load() || jobId >= run.numJobs.load())
+	{
+		return;
+	}
+	if (!run.firstJobStarted.exchange(true))
+	{
+		m_latencySum += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - run.submitTime).count();
+		m_numRuns++;
+	}
+
+	long long const start = now_ns();
+	try 
+	{
+		run.kernel(jobId, run.tld[threadId].get(), run.terminate);
+	} catch (std::exception const& e)
+	{
+		std::lock_guard<std::mutex> guard(m_exceptionMutex);
+		m_hasException.store(true);
+		std::ostringstream os;
+		os << "Thread " << std::this_thread::get_id() << ": " << e.what();
+		m_exceptionMsg.push_back(os.str());
+		run.numJobs.store(0);
+		run.terminate.store(true);
+	} catch(...)
+	{
+		std::lock_guard<std::mutex> guard(m_exceptionMutex);
+		m_hasException.store(true);
+		std::ostringstream os;
+		os << "Thread " << std::this_thread::get_id() << ": " << "unknown exception caught";
+		m_exceptionMsg.push_back(os.str());
+		run.numJobs.store(0);
+		run.terminate.store(true);
+	}
+	run.jobsDone++;
+
+	WorkerCounters& counters = *m_counters[threadId];
+	counters.numJobs.fetch_add(1, std::memory_order_relaxed);
+	long long microseconds = (now_ns() - start) / 1000;
+	int bucket = 0;
+	while (microseconds > 0 && bucket < ThreadPoolStats::NUM_DURATION_BUCKETS - 1)
+	{
+		microseconds >>= 1;
+		++bucket;
+	}
+	counters.jobDurations[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+// -----------------------------------------------------------------------------
+
+bool ThreadPool::done() const
+{
+	return jobs_done() >= num_jobs();
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::wait()
+{
+	m_runGroup->sync();
+}
+
+// -----------------------------------------------------------------------------
+
+double ThreadPool::average_dispatch_latency() const
+{
+	int const runs = m_numRuns.load();
+	return (runs > 0) ? 1e-9 * double(m_latencySum.load()) / double(runs) : 0.0;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::WorkerCounters::reset()
+{
+	busy.store(0);
+	parked.store(0);
+	busySince.store(0);
+	parkedSince.store(0);
+	numJobs.store(0);
+	numTasks.store(0);
+	numSteals.store(0);
+	for (auto& count : jobDurations)
+	{
+		count.store(0);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+ThreadPoolStats ThreadPool::stats() const
+{
+	long long const now = now_ns();
+	long long const start = m_statsStart.load();
+
+	ThreadPoolStats stats;
+	stats.seconds = 1e-9 * double(now - start);
+	std::fill(stats.job_durations, stats.job_durations + ThreadPoolStats::NUM_DURATION_BUCKETS, 0);
+	for (auto const& counters : m_counters)
+	{
+		// Include the task or park that is in progress.
+		long long busy = counters->busy.load();
+		long long const busy_since = counters->busySince.load();
+		if (busy_since > 0)
+		{
+			busy += now - std::max(busy_since, start);
+		}
+		long long parked = counters->parked.load();
+		long long const parked_since = counters->parkedSince.load();
+		if (parked_since > 0)
+		{
+			parked += now - std::max(parked_since, start);
+		}
+
+		ThreadPoolStats::Worker worker;
+		worker.busy_seconds   = 1e-9 * double(busy);
+		worker.idle_seconds   = std::max(0.0, stats.seconds - worker.busy_seconds);
+		worker.parked_seconds = std::min(worker.idle_seconds, 1e-9 * double(parked));
+		worker.num_jobs       = counters->numJobs.load();
+		worker.num_tasks      = counters->numTasks.load();
+		worker.num_steals     = counters->numSteals.load();
+		stats.workers.push_back(worker);
+
+		for (int i = 0; i < ThreadPoolStats::NUM_DURATION_BUCKETS; ++i)
+		{
+			stats.job_durations[i] += counters->jobDurations[i].load();
+		}
+	}
+	stats.num_runs = m_numRuns.load();
+	stats.dispatch_latency_seconds = average_dispatch_latency();
+	stats.num_terminates = m_numTerminates;
+	stats.terminate_seconds = 1e-9 * double(m_terminateSum);
+	stats.max_terminate_seconds = 1e-9 * double(m_terminateMax);
+	return stats;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::reset_stats()
+{
+	// Tasks and parks in progress are counted from the new start on.
+	m_statsStart.store(now_ns());
+	for (auto& counters : m_counters)
+	{
+		counters->busy.store(0);
+		counters->parked.store(0);
+		counters->numJobs.store(0);
+		counters->numTasks.store(0);
+		counters->numSteals.store(0);
+		for (auto& count : counters->jobDurations)
+		{
+			count.store(0);
+		}
+	}
+	m_latencySum.store(0);
+	m_numRuns.store(0);
+	m_numTerminates = 0;
+	m_terminateSum = 0;
+	m_terminateMax = 0;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::terminate() 
+{
+	cg_assert(current_worker() < 0 && bool("Cannot terminate the pool from inside a kernel."));
+	long long const start = now_ns();
+	cancel();
+	m_runGroup->sync();
+	m_run->tld.clear();
+
+	long long const duration = now_ns() - start;
+	m_numTerminates++;
+	m_terminateSum += duration;
+	m_terminateMax = std::max(m_terminateMax, duration);
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::cancel()
+{
+	m_run->numJobs.store(0);
+	m_run->terminate.store(true);
+}
+
+// -----------------------------------------------------------------------------
+
 #if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 199506L) \
  || (defined(_XOPEN_SOURCE))
 #include <signal.h>
 void ThreadPool::force_kill()
 {
 	// Give some chance to threads to terminate gracefully.
-	m_numJobs.store(0);
-	m_terminate.store(true);
+	cancel();
 
 	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
 	{
@@ -136,9 +915,21 @@ void ThreadPool::force_kill()
 		{
 			int const result = pthread_kill(t->native_handle(), SIGTERM);
 			cg_assert((result == 0) && bool("Cannot kill thread."));
+			t->detach();
 		}
 		t.reset();
-		m_tld[i].reset();
+	}
+
+	// Tasks of killed threads never finish. Start over with fresh
+	// scheduling state and leak the old one, killed threads may still
+	// reference it.
+	m_runGroup.release();
+	m_runGroup.reset(new TaskGroup(*this));
+	m_run = std::make_shared<Run>();
+	for (auto& deque : m_deques)
+	{
+		deque.release();
+		deque.reset(new WorkStealingDeque());
 	}
 }
 #else
@@ -175,3 +966,106 @@ bool ThreadPool::kill_at_timeout(int timeout)
 
 	return false;
 }
+
+// -----------------------------------------------------------------------------
+
+long long ThreadPoolStats::num_jobs() const
+{
+	long long sum = 0;
+	for (auto const& worker : workers)
+	{
+		sum += worker.num_jobs;
+	}
+	return sum;
+}
+
+// -----------------------------------------------------------------------------
+
+double ThreadPoolStats::utilization() const
+{
+	double busy = 0.0;
+	for (auto const& worker : workers)
+	{
+		busy += worker.busy_seconds;
+	}
+	double const total = seconds * double(workers.size());
+	return (total > 0.0) ? busy / total : 0.0;
+}
+
+// -----------------------------------------------------------------------------
+
+double ThreadPoolStats::imbalance() const
+{
+	double busy = 0.0;
+	double max_busy = 0.0;
+	for (auto const& worker : workers)
+	{
+		busy += worker.busy_seconds;
+		max_busy = std::max(max_busy, worker.busy_seconds);
+	}
+	return (busy > 0.0) ? max_busy * double(workers.size()) / busy : 1.0;
+}
+
+// -----------------------------------------------------------------------------
+
+double ThreadPoolStats::bucket_limit_seconds(int bucket)
+{
+	if (bucket >= NUM_DURATION_BUCKETS - 1)
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+	return 1e-6 * double(1ll << bucket);
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPoolStats::print(std::ostream& os) const
+{
+	std::ios::fmtflags const flags = os.flags();
+	std::streamsize const precision = os.precision();
+	os << std::fixed << std::setprecision(1);
+
+	os << "[ThreadPool] " << workers.size() << " workers over " << seconds << " s: utilization "
+	   << 100.0 * utilization() << " %, imbalance " << std::setprecision(2) << imbalance() << "\n";
+	os << "  worker   busy %   idle %  parked %       jobs      tasks     steals\n";
+	for (std::size_t i = 0; i < workers.size(); ++i)
+	{
+		Worker const& worker = workers[i];
+		double const scale = (seconds > 0.0) ? 100.0 / seconds : 0.0;
+		os << std::setprecision(1)
+		   << "  " << std::setw(6) << i
+		   << " " << std::setw(8) << scale * worker.busy_seconds
+		   << " " << std::setw(8) << scale * worker.idle_seconds
+		   << " " << std::setw(9) << scale * worker.parked_seconds
+		   << " " << std::setw(10) << worker.num_jobs
+		   << " " << std::setw(10) << worker.num_tasks
+		   << " " << std::setw(10) << worker.num_steals << "\n";
+	}
+
+	os << "  job durations:";
+	for (int i = 0; i < NUM_DURATION_BUCKETS; ++i)
+	{
+		if (job_durations[i] == 0)
+		{
+			continue;
+		}
+		if (i == NUM_DURATION_BUCKETS - 1)
+		{
+			os << " >=" << std::setprecision(0) << 1e6 * bucket_limit_seconds(i - 1) << "us: " << job_durations[i];
+		}
+		else
+		{
+			os << " <" << std::setprecision(0) << 1e6 * bucket_limit_seconds(i) << "us: " << job_durations[i];
+		}
+	}
+	os << "\n";
+
+	os << std::setprecision(1)
+	   << "  runs: " << num_runs << ", dispatch latency " << 1e6 * dispatch_latency_seconds << " us\n"
+	   << std::setprecision(3)
+	   << "  terminate: " << num_terminates << " calls, " << 1e3 * terminate_seconds << " ms total, "
+	   << 1e3 * max_terminate_seconds << " ms max" << std::endl;
+
+	os.flags(flags);
+	os.precision(precision);
+}
@@ -0,0 +1,100 @@
+#include <cglib/core/topology.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// -----------------------------------------------------------------------------
+
+#ifdef __linux__
+// Parse a sysfs cpu list like "0-7,16-23".
+static std::vector<int> parse_cpu_list(std::string const& list)
+{
+	std::vector<int> cpus;
+	std::istringstream is(list);
+	std::string range;
+	while (std::getline(is, range, ','))
+	{
+		int first = 0, last = 0;
+		char dash = 0;
+		std::istringstream rs(range);
+		if (!(rs >> first))
+			continue;
+		last = (rs >> dash >> last) ? last : first;
+		for (int cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+static CpuTopology detect_topology()
+{
+	CpuTopology topology;
+	std::ifstream online("/sys/devices/system/node/online");
+	std::string nodes;
+	if (online && std::getline(online, nodes))
+	{
+		for (int node : parse_cpu_list(nodes))
+		{
+			std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			std::string list;
+			if (!file || !std::getline(file, list))
+				continue;
+			std::vector<int> cpus = parse_cpu_list(list);
+			if (cpus.empty())
+				continue; // memory-only node
+			topology.node_ids.push_back(node);
+			topology.node_cpus.push_back(cpus);
+		}
+	}
+	return topology;
+}
+#else
+static CpuTopology detect_topology()
+{
+	return CpuTopology();
+}
+#endif
+
+// -----------------------------------------------------------------------------
+
+CpuTopology const& CpuTopology::get()
+{
+	static CpuTopology const topology = []
+	{
+		CpuTopology t = detect_topology();
+		if (t.node_cpus.empty())
+		{
+			t.node_ids.assign(1, 0);
+			t.node_cpus.resize(1);
+			for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+				t.node_cpus[0].push_back(static_cast<int>(cpu));
+		}
+		return t;
+	}();
+	return topology;
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef __linux__
+bool pin_current_thread(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+#else
+bool pin_current_thread(int)
+{
+	return false;
+}
+#endif
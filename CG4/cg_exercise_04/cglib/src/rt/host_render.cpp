@@ -5,116 +5,215 @@
 #include <cglib/rt/renderer.h>
 #include <cglib/imgui/imgui.h>
 #include <cglib/rt/bvh.h>
+#include <cglib/core/image_writer.h>
 
-int HostRender::run(RaytracingContext& context, 
-		PixelFunc const& render_pixel, 
+#include <algorithm>
+
+int HostRender::run_tiles(RaytracingContext& context, 
+		TileFuncSelector const& select_tile_func, 
 		int kill_timeout_seconds,
 		std::function<void()> const& render_overlay)
 {
-	auto render_pixel_wrapper = [&](int x, int y, RaytracingContext const &ctx, ThreadLocalData *tld)
-		-> glm::vec3
-		{
-			RenderData data(context, tld);
-			switch(context.params.render_mode) {
-
-				case RaytracingParameters::RECURSIVE:
-					if (context.params.stereo)
-					{
-						data.camera_mode = Camera::StereoLeft;
-						auto const left = render_pixel(x, y, ctx, data);
-						data.camera_mode = Camera::StereoRight;
-						auto const right = render_pixel(x, y, ctx, data);
-						return combine_stereo(left, right);
-					}
-					else
-					{
-						return render_pixel(x, y, ctx, data);
-					}
-
-				case RaytracingParameters::DESATURATE:
-					if (context.params.stereo)
-					{
-						data.camera_mode = Camera::StereoLeft;
-						auto const left = render_pixel(x, y, ctx, data);
-						data.camera_mode = Camera::StereoRight;
-						auto const right = render_pixel(x, y, ctx, data);
-						return combine_stereo(desaturate(left), desaturate(right));
-					}
-					else
-					{
-						return desaturate(render_pixel(x, y, ctx, data));
-					}
-
-				case RaytracingParameters::NUM_RAYS:
-					render_pixel(x, y, ctx, data);
-					return heatmap(float(data.num_cast_rays - 1) / 64.0f);
-				case RaytracingParameters::NORMAL:
-					render_pixel(x, y, ctx, data);
-					if (context.params.normal_mapping)
-						return glm::normalize(data.isect.shading_normal) * 0.5f + glm::vec3(0.5f);
-					else
-					{
-						if (data.isect.isValid())
-							return glm::normalize(data.isect.normal) * 0.5f + glm::vec3(0.5f);
-						else
-							return glm::vec3(0.0f);
-					}
-				case RaytracingParameters::BVH_TIME:
-				case RaytracingParameters::TIME: {
- 					Timer timer;
- 					timer.start();
- 					if(context.params.render_mode == RaytracingParameters::TIME) {
- 					    auto const color = render_pixel(x, y, ctx, data);
- 					    (void) color;
- 					}
-					else {
-						Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
-						for(auto& o: context.get_active_scene()->objects) {
-							BVH *bvh = dynamic_cast<BVH *>(o.get());
-							if(bvh) {
-								bvh->intersect(ray, nullptr);
-							}
-						}
-					}
-					timer.stop();
-					return heatmap(static_cast<float>(timer.getElapsedTimeInMilliSec()) * context.params.scale_render_time);
-				}
-				case RaytracingParameters::DUDV: {
-					auto const color = render_pixel(x, y, ctx, data);
-					(void) color;
-					if(!data.isect.isValid())
-						return glm::vec3(0.0);
-					return heatmap(std::log(1.0f + 5.0f * glm::length(data.isect.dudv)));
-				}
-				case RaytracingParameters::AABB_INTERSECT_COUNT: {
-					Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
-					glm::vec3 accum(0.0f);
-					for(auto& o: context.get_active_scene()->objects) {
-						auto *bvh = dynamic_cast<BVH *>(o.get());
-						if(bvh) {
-							accum += bvh->intersect_count(ray, 0, 0) * 0.02f;
-						}
-					}
-					return accum;
-				}
-				default: /* should never happen */
-				return glm::vec3(1, 0, 1);
-			}
-		};
-
 	if (context.params.interactive)
 	{
-		return run_interactive(context, render_pixel_wrapper, render_overlay);
+		return run_interactive(context, select_tile_func, render_overlay);
 	}
 	else
 	{
-		return run_noninteractive(context, render_pixel_wrapper, 
+		return run_noninteractive(context, select_tile_func, 
 				kill_timeout_seconds);
 	}
 }
 
 // -----------------------------------------------------------------------------
 
+FrameBuffer::FrameBuffer(int width, int height, bool progressive) :
+	color(width, height),
+	accum(progressive ? width : 0, progressive ? height : 0),
+	sample_count(width * height, 0),
+	luminance_moments(progressive ? width * height : 0, glm::vec2(0.f)),
+	num_rays(0),
+	num_dropped_rays(0),
+	display(progressive ? width : 0, progressive ? height : 0),
+	num_rows(height),
+	generation(0),
+	frame_start(0),
+	first_tile_done(true),
+	first_tile_latency_sum(0),
+	num_first_tiles(0)
+{
+}
+
+static long long steady_clock_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void FrameBuffer::set_tiling(int tile_size_, int num_tiles_x_, int num_tiles_y_)
+{
+	tile_size   = tile_size_;
+	num_tiles_x = num_tiles_x_;
+	num_tiles_y = num_tiles_y_;
+
+	int const num_tiles = num_tiles_x * num_tiles_y;
+	tile_generation.reset(new std::atomic<unsigned>[num_tiles]);
+	tile_busy.reset(new std::atomic<bool>[num_tiles]);
+	tile_seconds.reset(new std::atomic<float>[num_tiles]);
+	for (int i = 0; i < num_tiles; ++i)
+	{
+		tile_generation[i].store(0);
+		tile_busy[i].store(false);
+		tile_seconds[i].store(0.f);
+	}
+	tile_presented.assign(num_tiles, 0);
+}
+
+bool FrameBuffer::has_tiling(int tile_size_, int num_tiles_x_, int num_tiles_y_) const
+{
+	return tile_size == tile_size_ && num_tiles_x == num_tiles_x_ && num_tiles_y == num_tiles_y_;
+}
+
+int FrameBuffer::tile_index(int tile_x, int tile_y) const
+{
+	cg_assert(tile_x >= 0 && tile_x < num_tiles_x);
+	cg_assert(tile_y >= 0 && tile_y < num_tiles_y);
+	return tile_y * num_tiles_x + tile_x;
+}
+
+unsigned FrameBuffer::begin_frame()
+{
+	// Generation 0 marks tiles that were never finished.
+	unsigned gen = generation.load() + 1;
+	if (gen == 0)
+		gen = 1;
+	frame_start.store(steady_clock_ns());
+	first_tile_done.store(false);
+	generation.store(gen);
+	return gen;
+}
+
+FrameBuffer::TileLock::TileLock(FrameBuffer& fb, int tile_x, int tile_y) :
+	busy(fb.tile_busy[fb.tile_index(tile_x, tile_y)])
+{
+	// Only a tile of an older frame can hold the lock. It sees its
+	// terminate flag after at most one pixel.
+	while (busy.exchange(true, std::memory_order_acquire))
+		std::this_thread::yield();
+}
+
+FrameBuffer::TileLock::~TileLock()
+{
+	busy.store(false, std::memory_order_release);
+}
+
+bool FrameBuffer::commit_tile(int tile_x, int tile_y, unsigned gen, long long num_tile_rays, float seconds)
+{
+	if (gen != generation.load())
+		return false;
+
+	int const tile = tile_index(tile_x, tile_y);
+	num_rays += num_tile_rays;
+	tile_seconds[tile].store(seconds);
+	tile_generation[tile].store(gen, std::memory_order_release);
+
+	if (!first_tile_done.exchange(true))
+	{
+		first_tile_latency_sum += steady_clock_ns() - frame_start.load();
+		num_first_tiles++;
+	}
+	return true;
+}
+
+float FrameBuffer::tile_cost(int tile_x, int tile_y) const
+{
+	return tile_seconds[tile_index(tile_x, tile_y)].load();
+}
+
+bool FrameBuffer::present_completed_tiles()
+{
+	int const width  = color.getWidth();
+	int const height = color.getHeight();
+	unsigned const gen = generation.load();
+
+	bool changed = false;
+	for (int tile = 0; tile < num_tiles_x * num_tiles_y; ++tile)
+	{
+		if (tile_presented[tile] == gen
+		 || tile_generation[tile].load(std::memory_order_acquire) != gen)
+			continue;
+
+		// A frame launched while we copy may already write into the tile, which
+		// still carries the old stamp. Copy into scratch first and drop the copy
+		// if the generation changed, the remaining tiles are outdated as well.
+		int const baseX = (tile % num_tiles_x) * tile_size;
+		int const baseY = (tile / num_tiles_x) * tile_size;
+		int const endX  = std::min(baseX + tile_size, width);
+		int const endY  = std::min(baseY + tile_size, height);
+		int const tile_width = endX - baseX;
+		present_scratch.resize(std::size_t(tile_width) * (endY - baseY));
+		for (int y = baseY; y < endY; ++y)
+		{
+			std::copy(color.getPixels() + y * width + baseX,
+			          color.getPixels() + y * width + endX,
+			          present_scratch.begin() + (y - baseY) * tile_width);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (generation.load() != gen)
+			break;
+
+		for (int y = baseY; y < endY; ++y)
+		{
+			std::copy(present_scratch.begin() + (y - baseY) * tile_width,
+			          present_scratch.begin() + (y - baseY + 1) * tile_width,
+			          display.getPixels() + y * width + baseX);
+		}
+		tile_presented[tile] = gen;
+		changed = true;
+	}
+	return changed;
+}
+
+double FrameBuffer::average_first_tile_latency() const
+{
+	int const frames = num_first_tiles.load();
+	return (frames > 0) ? 1e-9 * double(first_tile_latency_sum.load()) / double(frames) : 0.0;
+}
+
+double FrameBuffer::average_sample_count() const
+{
+	long long total_samples = 0;
+	for (int n : sample_count)
+		total_samples += n;
+	return double(total_samples) / double(std::max<std::size_t>(1, sample_count.size()));
+}
+
+double FrameBuffer::covered_fraction() const
+{
+	int const num_pixels = num_rows * color.getWidth();
+	int const covered = static_cast<int>(std::count_if(sample_count.begin(), sample_count.begin() + num_pixels,
+		[](int n) { return n > 0; }));
+	return double(covered) / double(std::max(1, num_pixels));
+}
+
+void FrameBuffer::save_sample_count(std::string const& path, int max_count) const
+{
+	Image img;
+	sample_count_image(&img, max_count);
+	img.save(path, 1.f);
+}
+
+void FrameBuffer::sample_count_image(Image* img, int max_count) const
+{
+	img->setSize(color.getWidth(), color.getHeight());
+	for (int i = 0; i < int(sample_count.size()); ++i)
+	{
+		img->getPixels()[i] = glm::vec4(heatmap(float(sample_count[i]) / float(std::max(1, max_count))), 1.f);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
 void HostRender::generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
 {
 	/* Generate tile indices in the order of a spiral that starts in the center of the image.
@@ -154,20 +253,169 @@ void HostRender::generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector
 
 // -----------------------------------------------------------------------------
 
+void HostRender::generate_hilbert_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
+{
+	/* Walk a Hilbert curve over the smallest power of two square that covers
+	 * all tiles and skip the positions outside the image. Consecutive tiles
+	 * are neighbors, which keeps the scene data they touch in the caches.
+	 */
+	int n = 1;
+	while (n < std::max(num_tiles_x, num_tiles_y))
+		n *= 2;
+
+	tile_idx->clear();
+	tile_idx->reserve(num_tiles_x * num_tiles_y);
+	for (int d = 0; d < n * n; ++d)
+	{
+		int x = 0;
+		int y = 0;
+		for (int s = 1, t = d; s < n; s *= 2, t /= 4)
+		{
+			int const rx = 1 & (t / 2);
+			int const ry = 1 & (t ^ rx);
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+		}
+		if (x < num_tiles_x && y < num_tiles_y)
+			tile_idx->push_back(glm::ivec2(x, y));
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void HostRender::order_tiles(FrameBuffer const* fb, ThreadPool const& thread_pool, Parameters const& params,
+		int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
+{
+	if (params.tile_order == Parameters::TILE_ORDER_HILBERT)
+		generate_hilbert_tile_idx(num_tiles_x, num_tiles_y, tile_idx);
+	else
+		generate_tile_idx(num_tiles_x, num_tiles_y, tile_idx);
+
+	if (thread_pool.num_nodes() > 1)
+		distribute_tiles(thread_pool, tile_idx);
+
+	if (params.tile_order != Parameters::TILE_ORDER_COST)
+		return;
+
+	// Most expensive first. Ties, such as all tiles of the first frame,
+	// keep the spiral order. Sort within the block of every node.
+	std::vector<float> cost(num_tiles_x * num_tiles_y);
+	for (glm::ivec2 const& idx : *tile_idx)
+		cost[idx[1] * num_tiles_x + idx[0]] = fb->tile_cost(idx[0], idx[1]);
+
+	int const num_tiles = static_cast<int>(tile_idx->size());
+	for (int node = 0; node < thread_pool.num_nodes(); ++node)
+	{
+		std::stable_sort(tile_idx->begin() + thread_pool.node_first_job(node, num_tiles),
+		                 tile_idx->begin() + thread_pool.node_first_job(node + 1, num_tiles),
+			[&](glm::ivec2 const& a, glm::ivec2 const& b)
+			{
+				return cost[a[1] * num_tiles_x + a[0]] > cost[b[1] * num_tiles_x + b[0]];
+			});
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void HostRender::distribute_tiles(ThreadPool const& thread_pool, std::vector<glm::ivec2>* tile_idx)
+{
+	// The pool queues a contiguous block of jobs on every NUMA node. Make
+	// each block a horizontal band of the image and keep the order within
+	// the band.
+	std::vector<glm::ivec2> const base = *tile_idx;
+	int const num_tiles = static_cast<int>(base.size());
+
+	std::vector<int> order(num_tiles);
+	for (int i = 0; i < num_tiles; ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+		{
+			return base[a][1] < base[b][1] || (base[a][1] == base[b][1] && base[a][0] < base[b][0]);
+		});
+
+	for (int node = 0; node < thread_pool.num_nodes(); ++node)
+	{
+		int const begin = thread_pool.node_first_job(node, num_tiles);
+		int const end   = thread_pool.node_first_job(node + 1, num_tiles);
+		std::sort(order.begin() + begin, order.begin() + end);
+		for (int i = begin; i < end; ++i)
+			(*tile_idx)[i] = base[order[i]];
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+bool HostRender::render_split(ThreadPool& thread_pool, TileFunc const& render_tile, FrameBuffer* fb, RaytracingContext const& context,
+		Tile const& tile, int min_size, std::vector<ThreadLocalData>& worker_tld, std::atomic<bool>& terminate,
+		long long* num_rays, double* seconds)
+{
+	std::atomic<bool>      finished(true);
+	std::atomic<long long> rays(0);
+	std::atomic<long long> nanoseconds(0);
+
+	TaskGroup group(thread_pool);
+	for (int y = tile.baseY; y < tile.endY; y += min_size)
+	{
+		for (int x = tile.baseX; x < tile.endX; x += min_size)
+		{
+			Tile const sub = { x, y, std::min(x + min_size, tile.endX), std::min(y + min_size, tile.endY), tile.sample_pass };
+			group.spawn([&, sub]
+				{
+					auto const start = std::chrono::steady_clock::now();
+					long long sub_rays = 0;
+					ThreadLocalData* tld = &worker_tld[thread_pool.current_worker()];
+					if (!render_tile(fb, context, sub, tld, terminate, &sub_rays))
+						finished.store(false);
+					rays += sub_rays;
+					nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+						std::chrono::steady_clock::now() - start).count();
+				});
+		}
+	}
+	group.sync();
+
+	*num_rays = rays.load();
+	*seconds  = 1e-9 * double(nanoseconds.load());
+	return finished.load();
+}
+
+// -----------------------------------------------------------------------------
+
 int HostRender::run_noninteractive(RaytracingContext& context, 
-		PixelFuncRaw const& render_pixel, int kill_timeout_seconds)
+		TileFuncSelector const& select_tile_func, int kill_timeout_seconds)
 {
-	Image      frame_buffer(context.params.image_width, context.params.image_height);
-	ThreadPool thread_pool(context.params.num_threads);
-	std::vector<glm::ivec2> tile_idx;
+	if (context.params.stream_rows > 0)
+	{
+		return run_streaming(context, select_tile_func, kill_timeout_seconds);
+	}
+
+	FrameBuffer frame_buffer(context.params.image_width, context.params.image_height);
+	ThreadPool& thread_pool = ThreadPool::global();
 
-	Timer timer;
-	timer.start();
 	context.get_active_scene()->refresh_scene(context.params);
-	launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+	thread_pool.reset_stats();
 
-	if (kill_timeout_seconds > 0)
+	// The time budget and the reported times only cover rendering.
+	auto const time_start = std::chrono::steady_clock::now();
+	if (context.params.time_budget > 0.f)
+	{
+		auto const deadline = time_start + std::chrono::microseconds(
+				static_cast<long long>(1e6 * double(context.params.time_budget)));
+		render_until_deadline(&frame_buffer, thread_pool, &context, select_tile_func, deadline);
+	}
+	else if (kill_timeout_seconds > 0)
 	{
+		launch(&frame_buffer, thread_pool, &context, select_tile_func);
+
 		if (thread_pool.kill_at_timeout(kill_timeout_seconds))
 		{
 			cg_assert(!bool("Process ran into timeout - is there an infinite "
@@ -176,24 +424,201 @@ int HostRender::run_noninteractive(RaytracingContext& context,
 	}
 	else
 	{
+		launch(&frame_buffer, thread_pool, &context, select_tile_func);
 		thread_pool.wait();
 	}
 	thread_pool.poll_exceptions();
-	timer.stop();
-	std::cout << "Rendering time: " << timer.getElapsedTimeInMilliSec() << "ms" << std::endl;
-	frame_buffer.save(context.params.output_file_name.c_str(), 2.2f);
+	double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+	long long const num_rays = frame_buffer.num_rays.load() + frame_buffer.num_dropped_rays.load();
+	std::cout << "Rendering time: " << 1e3 * seconds << "ms" << std::endl;
+	std::cout << "Samples per pixel: " << frame_buffer.average_sample_count();
+	if (frame_buffer.num_passes > 0)
+		std::cout << " (" << frame_buffer.num_passes << " progressive passes)";
+	std::cout << std::endl;
+	std::cout << "Rays per second: " << double(num_rays) / std::max(seconds, 1e-6)
+		<< " (" << num_rays << " rays)" << std::endl;
+	std::cout << "Dispatch latency: " << 1e6 * thread_pool.average_dispatch_latency() << "us"
+		<< " (average over " << thread_pool.num_runs() << " runs)" << std::endl;
+	if (context.params.auto_tile_size)
+		std::cout << "Tile size: " << context.params.tile_size << " (auto)" << std::endl;
+	if (context.params.stats)
+		thread_pool.stats().print(std::cout);
+	frame_buffer.color.save(context.params.output_file_name.c_str(), 2.2f);
+
+	if (context.params.adaptive_sampling)
+	{
+		frame_buffer.save_sample_count(context.params.get_sample_count_file_name(), context.params.max_spp);
+	}
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int HostRender::run_streaming(RaytracingContext& context, TileFuncSelector const& select_tile_func,
+		int kill_timeout_seconds)
+{
+	int const width     = context.params.image_width;
+	int const height    = context.params.image_height;
+	int const tile_size = context.params.tile_size;
+	int const band_rows = std::min(height, (context.params.stream_rows + tile_size - 1) / tile_size * tile_size);
+	int const num_bands = (height + band_rows - 1) / band_rows;
+
+	ImageWriter writer;
+	if (!writer.open(context.params.output_file_name, width, height, 2.2f))
+	{
+		return 1;
+	}
+	// The file order decides which end of the image is rendered first. The
+	// sample counts have the format of the output if it is a pfm, so both
+	// files take the rows in the same order.
+	ImageWriter sample_writer;
+	if (context.params.adaptive_sampling
+	 && !sample_writer.open(context.params.get_sample_count_file_name(), width, height, 1.f))
+	{
+		return 1;
+	}
+
+	ThreadPool& thread_pool = ThreadPool::global();
+	context.get_active_scene()->refresh_scene(context.params);
+	thread_pool.reset_stats();
+	auto const time_start = std::chrono::steady_clock::now();
+
+	// One band is rendered while the previous one is written. Bands are
+	// rendered in one pass, so they only need colors and sample counts.
+	FrameBuffer band_0(width, band_rows, false);
+	FrameBuffer band_1(width, band_rows, false);
+	FrameBuffer* const bands[2] = { &band_0, &band_1 };
+	auto const render_band = [&](int band)
+	{
+		FrameBuffer& fb = *bands[band % 2];
+		int const begin = writer.bottom_up() ? band * band_rows : std::max(0, height - (band + 1) * band_rows);
+		int const end   = writer.bottom_up() ? std::min(height, begin + band_rows) : height - band * band_rows;
+		fb.first_row = begin;
+		fb.num_rows  = end - begin;
+		launch(&fb, thread_pool, &context, select_tile_func);
+	};
+
+	long long num_rays      = 0;
+	long long total_samples = 0;
+	Image     sample_count;
+	render_band(0);
+	for (int band = 0; band < num_bands; ++band)
+	{
+		// The timeout holds for the whole image, as without streaming.
+		if (kill_timeout_seconds > 0)
+		{
+			int const seconds_left = kill_timeout_seconds - static_cast<int>(
+				std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count());
+			if ((seconds_left > 0 || !thread_pool.done())
+				&& thread_pool.kill_at_timeout(std::max(0, seconds_left)))
+			{
+				cg_assert(!bool("Process ran into timeout - is there an infinite "
+							"loop?"));
+			}
+		}
+		thread_pool.wait();
+		thread_pool.poll_exceptions();
+		FrameBuffer& fb = *bands[band % 2];
+		num_rays += fb.num_rays.load();
+		for (int i = 0; i < fb.num_rows * width; ++i)
+			total_samples += fb.sample_count[i];
+
+		if (band + 1 < num_bands)
+			render_band(band + 1);
 
+		writer.write_rows(fb.color, 0, fb.num_rows);
+		if (sample_writer.is_open())
+		{
+			fb.sample_count_image(&sample_count, context.params.max_spp);
+			sample_writer.write_rows(sample_count, 0, fb.num_rows);
+		}
+	}
+	writer.close();
+	if (sample_writer.is_open())
+		sample_writer.close();
+
+	double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+	std::cout << "Rendering time: " << 1e3 * seconds << "ms" << std::endl;
+	std::cout << "Streamed " << num_bands << " bands of " << band_rows << " rows, "
+		<< 2.0 * (sizeof(glm::vec4) + sizeof(int)) * width * band_rows / (1024.0 * 1024.0)
+		<< " MB of frame buffers" << std::endl;
+	std::cout << "Samples per pixel: " << double(total_samples) / (double(width) * height) << std::endl;
+	std::cout << "Rays per second: " << double(num_rays) / std::max(seconds, 1e-6)
+		<< " (" << num_rays << " rays)" << std::endl;
+	if (context.params.stats)
+		thread_pool.stats().print(std::cout);
 	return 0;
 }
 
 // -----------------------------------------------------------------------------
 
-int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const& render_pixel,
+void HostRender::render_until_deadline(FrameBuffer* fb,
+		ThreadPool& thread_pool,
+		RaytracingContext* context,
+		TileFuncSelector const& select_tile_func,
+		std::chrono::steady_clock::time_point deadline)
+{
+	// Render progressive passes until we run out of time or every pass of
+	// progressive_target_passes is done, further passes would repeat their
+	// samples. Pixels that are not finished at the deadline are dropped, so
+	// every pixel holds the average of all its completed samples.
+	TileSizeTuner tuner;
+	if (context->params.auto_tile_size)
+		context->params.tile_size = tuner.tile_size();
+
+	int sample_pass = 0;
+	long long rays_before_pass = 0;
+	auto pass_start = std::chrono::steady_clock::now();
+	launch(fb, thread_pool, context, select_tile_func, sample_pass);
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		thread_pool.poll_exceptions();
+		if (thread_pool.done())
+		{
+			if (sample_pass + 1 >= progressive_target_passes(*context))
+				break;
+
+			// With adaptive sampling, a pass without rays means every pixel converged.
+			long long const rays = fb->num_rays.load();
+			if (context->params.adaptive_sampling && sample_pass > 0 && rays == rays_before_pass)
+				break;
+			rays_before_pass = rays;
+
+			auto const now = std::chrono::steady_clock::now();
+			if (context->params.auto_tile_size)
+			{
+				tuner.report(std::chrono::duration<double>(now - pass_start).count());
+				context->params.tile_size = tuner.tile_size();
+			}
+			pass_start = now;
+			launch(fb, thread_pool, context, select_tile_func, ++sample_pass);
+			continue;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Passes that were cut off only count partially. Check before
+	// terminating, which drops the remaining jobs.
+	bool const cut_off = !thread_pool.done();
+	if (cut_off)
+		fb->num_passes = sample_pass;
+	thread_pool.terminate();
+
+	if (cut_off && sample_pass == 0)
+	{
+		std::cerr << "warning: the time budget ran out during the first pass, only "
+			<< 100.0 * fb->covered_fraction() << "% of the pixels were rendered" << std::endl;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+int HostRender::run_interactive(RaytracingContext& context, TileFuncSelector const& select_tile_func,
 		std::function<void()> const& render_overlay)
 {
-	Image      frame_buffer(context.params.image_width, context.params.image_height);
-	ThreadPool thread_pool(context.params.num_threads);
-	std::vector<glm::ivec2> tile_idx;
+	FrameBuffer frame_buffer(context.params.image_width, context.params.image_height);
+	ThreadPool& thread_pool = ThreadPool::global();
 
 	if (!GUI::init_host(context.params))
 	{
@@ -204,7 +629,13 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 		context.get_active_scene()->set_active_camera();
 
 	// Launch first render.
-	launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+	TileSizeTuner tuner;
+	if (context.params.auto_tile_size)
+		context.params.tile_size = tuner.tile_size();
+	int sample_pass = context.params.progressive ? 0 : -1;
+	launch(&frame_buffer, thread_pool, &context, select_tile_func, sample_pass);
+	auto launch_time  = std::chrono::steady_clock::now();
+	bool pass_timed   = false;
 
 	auto time_last_frame = std::chrono::high_resolution_clock::now();
 
@@ -220,7 +651,9 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 		if (cam && cam->requires_restart())
 			update_flags |= GUI::FLAG_REDRAW;
 
-		if(update_flags) {
+		// Restarts do not wait for the old frame, launch cancels it. Only a
+		// scene refresh has to wait, tiles that are still running read the scene.
+		if(update_flags & GUI::FLAG_REFRESH_SCENE) {
 			thread_pool.terminate();
 		}
 
@@ -240,6 +673,8 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 				if(context.get_active_scene()) {
 					context.get_active_scene()->set_active_camera();
 					context.get_active_scene()->refresh_scene(context.params);
+					Scene* scene = context.get_active_scene();
+					scene->light_tree.build(scene->lights);
 				}
 			}
 			if(context.params.spp < oldParams.spp)
@@ -258,52 +693,187 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 				}
 			}
 			oldParams = context.params;
-			launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+			sample_pass = context.params.progressive ? 0 : -1;
+			launch(&frame_buffer, thread_pool, &context, select_tile_func, sample_pass);
+			launch_time = std::chrono::steady_clock::now();
+			pass_timed  = false;
 			update_flags = 0;
 		}
 
+		// Tile size tuning times every pass that was not interrupted.
+		if (context.params.auto_tile_size && !pass_timed && thread_pool.done())
+		{
+			tuner.report(std::chrono::duration<double>(std::chrono::steady_clock::now() - launch_time).count());
+			context.params.tile_size = tuner.tile_size();
+			pass_timed = true;
+		}
+
+		// In progressive mode, start the next pass as soon as the current
+		// one is done, and show every finished pass.
+		bool pass_finished = false;
+		if (sample_pass >= 0 && thread_pool.done())
+		{
+			pass_finished = true;
+			frame_buffer.present_completed_tiles(); // before the next pass resets the tile bitmap
+			if (++sample_pass < progressive_target_passes(context))
+			{
+				launch(&frame_buffer, thread_pool, &context, select_tile_func, sample_pass);
+				launch_time = std::chrono::steady_clock::now();
+				pass_timed  = false;
+			}
+			else
+			{
+				sample_pass = -1;
+			}
+		}
+
 		// Update the texture displayed online in regular intervals so that
 		// we don't waste many cycles uploading all the time.
 		auto const now = std::chrono::high_resolution_clock::now();
 		float const mspf = 1000.f / static_cast<float>(context.params.fps);
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(now-time_last_frame).count() > mspf)
+		if (pass_finished || std::chrono::duration_cast<std::chrono::milliseconds>(now-time_last_frame).count() > mspf)
 		{
-			update_flags = GUI::display_host(frame_buffer, render_overlay);
+			frame_buffer.present_completed_tiles();
+			update_flags = GUI::display_host(frame_buffer.display, render_overlay, [&]() {
+				if (context.params.stats)
+					display_thread_pool_stats(thread_pool);
+			});
 		}
 	}
 
 	GUI::cleanup();
 
+	std::cout << "First tile latency: " << 1e3 * frame_buffer.average_first_tile_latency() << "ms"
+		<< " (average over " << frame_buffer.num_measured_frames() << " frames)" << std::endl;
+	if (context.params.stats)
+		thread_pool.stats().print(std::cout);
+
 	return 0;
 }
 
 // -----------------------------------------------------------------------------
 
-void HostRender::launch(Image* fb, 
+void HostRender::display_thread_pool_stats(ThreadPool& thread_pool)
+{
+	ThreadPoolStats const stats = thread_pool.stats();
+
+	ImGui::Begin("Thread Pool");
+	ImGui::Text("Utilization: %.1f %%   Imbalance: %.2f", 100.0 * stats.utilization(), stats.imbalance());
+	ImGui::Text("Runs: %d   Dispatch latency: %.1f us", stats.num_runs, 1e6 * stats.dispatch_latency_seconds);
+	ImGui::Text("Terminate: %d calls, %.2f ms total, %.2f ms max",
+		stats.num_terminates, 1e3 * stats.terminate_seconds, 1e3 * stats.max_terminate_seconds);
+	if (ImGui::Button("Reset"))
+		thread_pool.reset_stats();
+
+	ImGui::Columns(4, "workers");
+	ImGui::Text("Worker"); ImGui::NextColumn();
+	ImGui::Text("Busy");   ImGui::NextColumn();
+	ImGui::Text("Jobs");   ImGui::NextColumn();
+	ImGui::Text("Steals"); ImGui::NextColumn();
+	ImGui::Separator();
+	for (std::size_t i = 0; i < stats.workers.size(); ++i)
+	{
+		ThreadPoolStats::Worker const& worker = stats.workers[i];
+		float const busy = (stats.seconds > 0.0) ? float(worker.busy_seconds / stats.seconds) : 0.f;
+		ImGui::Text("%d", int(i)); ImGui::NextColumn();
+		ImGui::ProgressBar(busy, ImVec2(-1.f, 0.f)); ImGui::NextColumn();
+		ImGui::Text("%lld", worker.num_jobs); ImGui::NextColumn();
+		ImGui::Text("%lld", worker.num_steals); ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+
+	// Up to the longest bucket that was hit.
+	float durations[ThreadPoolStats::NUM_DURATION_BUCKETS];
+	int num_buckets = 1;
+	for (int i = 0; i < ThreadPoolStats::NUM_DURATION_BUCKETS; ++i)
+	{
+		durations[i] = float(stats.job_durations[i]);
+		if (stats.job_durations[i] > 0)
+			num_buckets = i + 1;
+	}
+	ImGui::PlotHistogram("##job_durations", durations, num_buckets, 0,
+		"Job durations, log2(us)", 0.f, FLT_MAX, ImVec2(-1.f, 80.f));
+	ImGui::End();
+}
+
+// -----------------------------------------------------------------------------
+
+int HostRender::progressive_target_passes(RaytracingContext const& context)
+{
+	return context.params.get_progressive_passes();
+}
+
+// -----------------------------------------------------------------------------
+
+void HostRender::launch(FrameBuffer* fb, 
 		ThreadPool& thread_pool, 
 		RaytracingContext const* context, 
-		std::vector<glm::ivec2>* tile_idx,
-		PixelFuncRaw render_pixel)
+		TileFuncSelector const& select_tile_func,
+		int sample_pass)
 {
 	if (!thread_pool.enough_progress())
 	{
 		//return;
 	}
 
-	// Clean up.
-	thread_pool.terminate();
-	fb->clear(glm::vec4(0.f));
-
 	// Compute number of tiles (work units).
-	int const width  = fb->getWidth();
-	int const height = fb->getHeight();
+	int const width  = fb->color.getWidth();
+	int const height = fb->num_rows;
 	int const tile_size   = context->params.tile_size;
 	int const num_tiles_x = static_cast<int>(std::ceil(float(width) / float(tile_size)));
 	int const num_tiles_y = static_cast<int>(std::ceil(float(height) / float(tile_size)));
 	int const num_tiles   = num_tiles_x * num_tiles_y;
 
-	// New tile indices.
-	generate_tile_idx(num_tiles_x, num_tiles_y, tile_idx);
+	// Tiles of the previous frame may still be running, they are cancelled
+	// by the next run. Only wait for them if we change data they read.
+	Scene* scene = context->get_active_scene();
+	bool const retile = !fb->has_tiling(tile_size, num_tiles_x, num_tiles_y);
+	bool const rebuild_lights = context->params.light_sampling
+		&& scene->light_tree.num_lights() != int(scene->lights.size());
+	if (retile || rebuild_lights)
+	{
+		thread_pool.terminate();
+	}
+	if (retile)
+	{
+		fb->set_tiling(tile_size, num_tiles_x, num_tiles_y);
+	}
+	if (rebuild_lights)
+	{
+		scene->light_tree.build(scene->lights);
+	}
+
+	// Every launch has its own tile order, running tiles of older frames keep theirs.
+	std::shared_ptr<std::vector<glm::ivec2>> const tile_idx = std::make_shared<std::vector<glm::ivec2>>();
+	order_tiles(fb, thread_pool, context->params, num_tiles_x, num_tiles_y, tile_idx.get());
+
+	std::shared_ptr<std::atomic<int>> const tiles_started = std::make_shared<std::atomic<int>>(0);
+
+	// Progressive passes other than the first keep accumulating, the first
+	// pass overwrites the old frame tile by tile.
+	fb->num_passes = (sample_pass >= 0) ? sample_pass + 1 : 0;
+	if (sample_pass <= 0)
+	{
+		fb->num_rays.store(0);
+		fb->num_dropped_rays.store(0);
+	}
+	unsigned const generation = fb->begin_frame();
+
+	// Sub-tiles of split tiles run on any worker and use its thread local data.
+	// Every frame draws new random numbers, so progressive passes differ.
+	int const min_split_size = 8;
+	bool const split = context->params.split_tiles && tile_size >= 2 * min_split_size;
+	std::shared_ptr<std::vector<ThreadLocalData>> const worker_tld = std::make_shared<std::vector<ThreadLocalData>>();
+	if (split)
+	{
+		worker_tld->resize(thread_pool.num_threads());
+		for (int i = 0; i < thread_pool.num_threads(); ++i)
+			(*worker_tld)[i].initialize(thread_pool.num_threads() + i, generation);
+	}
+
+	// Select the tile loop for the current render mode once per launch.
+	TileFunc const render_tile = select_tile_func(context->params);
+	ThreadPool* const pool = &thread_pool;
 
 	// Launch threads.
 	thread_pool.run<ThreadLocalData>(num_tiles, 
@@ -311,34 +881,58 @@ void HostRender::launch(Image* fb,
 			[=](int tile, ThreadLocalData* tld, std::atomic<bool>& terminate)
 			{
 				glm::ivec2 const idx = (*tile_idx)[tile];
-				int const baseX = std::max<int>(idx[0] * tile_size, 0);
-				int const endX  = std::min<int>(baseX + tile_size, width);
-
-				int const baseY = std::max<int>(idx[1] * tile_size, 0);
-				int const endY  = std::min<int>(baseY + tile_size, height);
-
-				Image img(endX-baseX, endY-baseY);
-				for (int y = baseY; y < endY; y++) 
+				Tile t;
+				t.baseX = std::max<int>(idx[0] * tile_size, 0);
+				t.endX  = std::min<int>(t.baseX + tile_size, width);
+				t.baseY = fb->first_row + std::max<int>(idx[1] * tile_size, 0);
+				t.endY  = std::min<int>(t.baseY + tile_size, fb->first_row + height);
+				t.sample_pass = sample_pass;
+
+				// Tiles are disjoint, write directly into the frame buffer.
+				FrameBuffer::TileLock const lock(*fb, idx[0], idx[1]);
+				long long num_rays = 0;
+				double    seconds  = 0.0;
+				bool      finished = false;
+
+				// Near the end of the frame, let idle workers help with the remaining tiles.
+				int const tiles_left = num_tiles - ++(*tiles_started);
+				if (split && tiles_left < pool->num_threads())
 				{
-					for (int x = baseX; x < endX; x++) 
-					{
-						if (terminate.load())
-							return;
-
-						glm::vec3 const color = render_pixel(x, y, *context, dynamic_cast<ThreadLocalData*>(tld));
-						img.setPixel(x-baseX, y-baseY, glm::vec4(color, 1.f));
-					}
+					finished = render_split(*pool, render_tile, fb, *context, t, min_split_size, *worker_tld, terminate,
+						&num_rays, &seconds);
 				}
-
-				std::lock_guard<std::mutex> lock(mutex);
-				for (int y = baseY; y < endY; y++) 
+				else
 				{
-					for (int x = baseX; x < endX; x++) 
-					{
-						fb->setPixel(x, y, img.getPixel(x-baseX, y-baseY));
-					}
+					auto const start = std::chrono::steady_clock::now();
+					finished = render_tile(fb, *context, t, tld, terminate, &num_rays);
+					seconds  = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 				}
 
+				if (!finished || !fb->commit_tile(idx[0], idx[1], generation, num_rays, static_cast<float>(seconds)))
+				{
+					fb->num_dropped_rays += num_rays;
+				}
 			}
 	);
 }
+
+// -----------------------------------------------------------------------------
+
+TileSizeTuner::TileSizeTuner() :
+	candidates({ 8, 16, 32, 64 }),
+	pass_seconds(candidates.size(), 0.0)
+{
+}
+
+void TileSizeTuner::report(double seconds)
+{
+	if (!tuning())
+		return;
+
+	pass_seconds[current++] = seconds;
+	if (!tuning())
+	{
+		int const fastest = static_cast<int>(std::min_element(pass_seconds.begin(), pass_seconds.end()) - pass_seconds.begin());
+		best = candidates[fastest];
+	}
+}
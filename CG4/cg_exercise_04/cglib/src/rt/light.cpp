@@ -0,0 +1,130 @@
+#include <cglib/rt/light.h>
+
+#include <cglib/core/assert.h>
+
+#include <numeric>
+
+namespace {
+
+float luminance(glm::vec3 const& c)
+{
+	return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+} // namespace
+
+void LightTree::
+build(std::vector<std::unique_ptr<Light>> const& lights)
+{
+	nodes.clear();
+	light_positions.clear();
+	light_powers.clear();
+	if (lights.empty())
+		return;
+
+	for (auto const& light : lights)
+	{
+		cg_assert(light);
+		light_positions.push_back(light->getPosition());
+		light_powers.push_back(std::max(0.f, luminance(light->getPower())));
+	}
+
+	std::vector<int> light_indices(lights.size());
+	std::iota(light_indices.begin(), light_indices.end(), 0);
+	nodes.reserve(2 * lights.size() - 1);
+	build_recursive(light_indices, 0, static_cast<int>(lights.size()));
+}
+
+int LightTree::
+build_recursive(std::vector<int>& light_indices, int first, int count)
+{
+	cg_assert(count > 0);
+
+	int const node_idx = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+
+	AABB aabb;
+	float power = 0.f;
+	for (int i = first; i < first + count; ++i)
+	{
+		aabb.extend(light_positions[light_indices[i]]);
+		power += light_powers[light_indices[i]];
+	}
+	nodes[node_idx].aabb  = aabb;
+	nodes[node_idx].power = power;
+
+	if (count == 1)
+	{
+		nodes[node_idx].light_idx = light_indices[first];
+		return node_idx;
+	}
+
+	// Median split along the largest extent, just like the BVH.
+	glm::vec3 const extent = aabb.max - aabb.min;
+	int axis = 0;
+	if (extent[1] > extent[axis]) axis = 1;
+	if (extent[2] > extent[axis]) axis = 2;
+
+	int const half = count / 2;
+	std::nth_element(
+		light_indices.begin() + first,
+		light_indices.begin() + first + half,
+		light_indices.begin() + first + count,
+		[&](int a, int b) { return light_positions[a][axis] < light_positions[b][axis]; });
+
+	// Note: nodes may reallocate during recursion, so do not hold references.
+	int const left  = build_recursive(light_indices, first, half);
+	int const right = build_recursive(light_indices, first + half, count - half);
+	nodes[node_idx].left  = left;
+	nodes[node_idx].right = right;
+	return node_idx;
+}
+
+float LightTree::
+importance(Node const& node, glm::vec3 const& P) const
+{
+	// Power over squared distance to the cluster. The distance is clamped
+	// to the cluster size so that shading points inside a cluster do not
+	// blow up the estimate.
+	glm::vec3 const center   = 0.5f * (node.aabb.min + node.aabb.max);
+	glm::vec3 const diagonal = node.aabb.max - node.aabb.min;
+	float const dist2 = std::max(glm::dot(P - center, P - center), 0.25f * glm::dot(diagonal, diagonal));
+	return node.power / std::max(dist2, 1e-8f);
+}
+
+int LightTree::
+sample(glm::vec3 const& P, float u, float* pdf) const
+{
+	cg_assert(pdf);
+
+	*pdf = 0.f;
+	if (nodes.empty())
+		return -1;
+
+	float p = 1.f;
+	int node_idx = 0;
+	while (nodes[node_idx].light_idx < 0)
+	{
+		Node const& node = nodes[node_idx];
+		float const w_left  = importance(nodes[node.left],  P);
+		float const w_right = importance(nodes[node.right], P);
+		float const p_left  = (w_left + w_right > 0.f) ? w_left / (w_left + w_right) : 0.5f;
+
+		// Reuse u for the next decision by rescaling it to [0, 1).
+		if (u < p_left)
+		{
+			u = std::min(u / p_left, 0.99999994f);
+			p *= p_left;
+			node_idx = node.left;
+		}
+		else
+		{
+			u = std::min((u - p_left) / (1.f - p_left), 0.99999994f);
+			p *= 1.f - p_left;
+			node_idx = node.right;
+		}
+	}
+
+	*pdf = p;
+	return nodes[node_idx].light_idx;
+}
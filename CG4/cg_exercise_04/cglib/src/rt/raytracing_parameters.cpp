@@ -3,6 +3,11 @@
 #include <cglib/rt/raytracing_context.h>
 #include <cglib/rt/scene.h>
 
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+
 /*
  * ImGui Notes:
  * - every element needs to have a unique name
@@ -21,10 +26,107 @@ TextureWrapMode RaytracingParameters::get_tex_wrap_mode() const
 	return (TextureWrapMode)tex_wrap_mode;
 }
 
+std::string RaytracingParameters::get_sample_count_file_name() const
+{
+	// A pfm output gets a pfm, so that streaming can write both files in the same row order.
+	std::size_t const dot = output_file_name.find_last_of('.');
+	if (dot == std::string::npos)
+		return output_file_name + "_spp.png";
+	std::string const extension = (output_file_name.substr(dot + 1) == "pfm") ? ".pfm" : ".png";
+	return output_file_name.substr(0, dot) + "_spp" + extension;
+}
+
+int RaytracingParameters::get_progressive_passes() const
+{
+	int const samples   = std::max(1, adaptive_sampling ? std::max(min_spp, max_spp) : spp);
+	int const grid_size = std::max(1, int(std::sqrt(float(samples))));
+	return grid_size * grid_size;
+}
+
+bool RaytracingParameters::adaptive_converged(int n, float mean, float m2) const
+{
+	if (n < std::max(1, min_spp) || n < 2)
+		return false;
+	float const variance  = m2 / float(n - 1);
+	float const std_error = std::sqrt(variance / float(n));
+	return std_error <= adaptive_threshold * std::max(mean, 1e-3f);
+}
+
 void RaytracingParameters::initialize()
 {
 }
 
+int RaytracingParameters::derived_parse_option(std::string const& arg, int argc, char const** argv, int i)
+{
+	if (arg == "--adaptive")
+	{
+		adaptive_sampling = true;
+		return 1;
+	}
+
+	if (arg != "--min-spp" && arg != "--max-spp" && arg != "--adaptive-threshold"
+	 && arg != "--light-sampling" && arg != "--num-lights" && arg != "--dispersion-tolerance")
+		return 0;
+
+	if (i + 1 >= argc)
+	{
+		std::cerr << "Option " << arg << " requires a parameter." << std::endl;
+		return -1;
+	}
+
+	std::istringstream is(argv[i + 1]);
+	bool success = true;
+	if (arg == "--min-spp")
+	{
+		success = bool(is >> min_spp);
+		min_spp = std::max(1, min_spp);
+	}
+	else if (arg == "--max-spp")
+	{
+		success = bool(is >> max_spp);
+		max_spp = std::max(1, max_spp);
+	}
+	else if (arg == "--adaptive-threshold")
+	{
+		success = bool(is >> adaptive_threshold);
+	}
+	else if (arg == "--light-sampling")
+	{
+		success = bool(is >> light_samples) && light_samples > 0;
+		light_sampling = true;
+	}
+	else if (arg == "--dispersion-tolerance")
+	{
+		success = bool(is >> dispersion_tolerance) && dispersion_tolerance >= 0.f;
+		dispersion = true;
+	}
+	else
+	{
+		success = bool(is >> num_lights) && num_lights > 0;
+	}
+
+	if (!success)
+	{
+		std::cerr << "Invalid parameter for option " << arg << ": '" << argv[i + 1] << "'" << std::endl;
+		return -1;
+	}
+	return 2;
+}
+
+void RaytracingParameters::derived_print_help(std::ostream& os) const
+{
+	os
+		<< "--adaptive           Use adaptive sampling.\n"
+		<< "--min-spp N          Minimum number of samples per pixel (adaptive sampling).\n"
+		<< "--max-spp N          Maximum number of samples per pixel (adaptive sampling).\n"
+		<< "--adaptive-threshold E\n"
+		<< "                     Relative error below which sampling stops (adaptive sampling).\n"
+		<< "--light-sampling N   Shade with N lights per shading point, chosen from a light tree.\n"
+		<< "--num-lights N       Number of lights in the Sponza scene.\n"
+		<< "--dispersion-tolerance DEG\n"
+		<< "                     Render dispersion; color channels refracted within DEG degrees share one ray.\n";
+}
+
 int RaytracingParameters::display_parameters()
 {
 	bool redraw = false;
@@ -52,6 +154,10 @@ int RaytracingParameters::display_parameters()
 		refresh_scene |= ImGui::Combo("Image", &gauss_mode, gauss_mode_names, GAUSS_MODE_COUNT);
 		refresh_scene |= ImGui::InputFloat("Sigma", &sigma);
 		refresh_scene |= ImGui::InputInt("Kernel Radius", &kernel_radius);
+		if (gauss_mode == GAUSS_AUTO) {
+			GaussScene const* scene = static_cast<GaussScene *>(RaytracingContext::get_active()->get_active_scene());
+			ImGui::Text("Algorithm: %s", Image::filter_algorithm_name(scene->auto_algorithm));
+		}
 	}
 	if(is_fourier) {
 		redraw |= ImGui::Combo("Image##Fourier", &fourier_mode, fourier_mode_names, FOURIER_MODE_COUNT);
@@ -64,6 +170,12 @@ int RaytracingParameters::display_parameters()
 		}
 	}
 
+	if(dynamic_cast<SponzaScene *>(RaytracingContext::get_active()->get_active_scene())) {
+		if(ImGui::CollapsingHeader("Scene Settings")) {
+			refresh_scene |= ImGui::SliderInt("Number of Lights", &num_lights, 1, 1 << 10);
+		}
+	}
+
 	if(draw_render_settings && ImGui::CollapsingHeader("Render Settings"))
 	{
 		redraw |= ImGui::Combo("Render Mode", &render_mode, &render_mode_names[0], RENDER_MODE_COUNT);
@@ -78,6 +190,7 @@ int RaytracingParameters::display_parameters()
 "du dv:                   texture coordinate gradient length\n"
 "AABB Intersection Count: Number of AABBs that could be intersected by ray\n"
 "BVH Traversal Time:      Time spent on bvh traversal for primary hit\n"
+"Sample Count:            Number of samples taken for each pixel\n"
 			);
 		}
 		if (render_mode == TIME
@@ -90,8 +203,20 @@ int RaytracingParameters::display_parameters()
 		redraw |= ImGui::DragFloat("Ray Epsilon", &ray_epsilon, 0.00001f, 0.0f, 0.f, "%.7f");
 		redraw |= ImGui::DragFloat("Field of View Y", &fovy);
 		redraw |= ImGui::InputInt("Render Threads", &num_threads);
+		ImGui::Checkbox("Thread Pool Statistics", &stats);
 		redraw |= ImGui::Checkbox("Stratified Samples", &stratified);
-		redraw |= ImGui::InputInt("Pixel Samples", &spp);
+		redraw |= ImGui::Checkbox("Progressive Rendering", &progressive);
+		redraw |= ImGui::Checkbox("Adaptive Sampling", &adaptive_sampling);
+		if (adaptive_sampling) {
+			redraw |= ImGui::InputInt("Min Pixel Samples", &min_spp);
+			redraw |= ImGui::InputInt("Max Pixel Samples", &max_spp);
+			redraw |= ImGui::DragFloat("Error Threshold", &adaptive_threshold, 0.001f, 0.f, 1.f, "%.4f");
+			min_spp = std::max(1, min_spp);
+			max_spp = std::max(min_spp, max_spp);
+		}
+		else {
+			redraw |= ImGui::InputInt("Pixel Samples", &spp);
+		}
 		redraw |= ImGui::Checkbox("Stereo Rendering", &stereo);
 		if (stereo) {
 			redraw |= ImGui::DragFloat("Eye Separation", &eye_separation, 0.01f, 0.f, 0.f);
@@ -106,7 +231,17 @@ int RaytracingParameters::display_parameters()
 		redraw |= ImGui::Checkbox("Ambient Lighting", &ambient);
 		redraw |= ImGui::Checkbox("Diffuse Lighting", &diffuse);
 		redraw |= ImGui::Checkbox("Specular Lighting", &specular);
+		redraw |= ImGui::Checkbox("Light Sampling", &light_sampling);
+		if (light_sampling) {
+			redraw |= ImGui::InputInt("Light Samples", &light_samples);
+			light_samples = std::max(1, light_samples);
+		}
 		redraw |= ImGui::Checkbox("Reflection", &reflection);
+		redraw |= ImGui::Checkbox("Dispersion", &dispersion);
+		if (dispersion) {
+			redraw |= ImGui::DragFloat("Dispersion Tolerance", &dispersion_tolerance, 0.01f, 0.f, 10.f, "%.3f");
+			dispersion_tolerance = std::max(0.f, dispersion_tolerance);
+		}
 		redraw |= ImGui::Checkbox("Transform Objects", &transform_objects);
 		redraw |= ImGui::Checkbox("Normal Mapping", &normal_mapping);
 	}
@@ -99,6 +99,7 @@ bool visible(
 	glm::vec3 const& to)
 {
 	data.num_cast_rays++;
+	data.num_traced_rays++;
     const glm::vec3 d = glm::normalize(to-from);
     const float dist = glm::length(to-from) - 2.f*data.context.params.ray_epsilon;
     Ray ray_eps(from + data.context.params.ray_epsilon * d, d);
@@ -117,6 +118,7 @@ bool shoot_ray(RenderData &data, Ray const& ray, Intersection* isect)
     Object* object = nullptr;
 
     cg_assert(isect);
+    data.num_traced_rays++;
     
 	Ray ray_eps(ray.origin + data.context.params.ray_epsilon * ray.direction, ray.direction);
 
@@ -149,6 +151,7 @@ bool shoot_ray(
     Object* object = nullptr;
 
     cg_assert(isect);
+    data.num_traced_rays++;
     Ray ray_eps(ray.origin + data.context.params.ray_epsilon * ray.direction, ray.direction);
 
     bool found_intersection = false;
@@ -196,6 +199,50 @@ glm::vec3 evaluate_ambient(
 	return contribution;
 }
 
+// Phong contribution of a single light.
+static glm::vec3 evaluate_phong_light(
+	RenderData &data,
+	MaterialSample const& mat,
+	glm::vec3 const& P,
+	glm::vec3 const& N,
+	glm::vec3 const& V,
+	Light const* light)
+{
+	// TODO: calculate the (normalized) direction to the light
+	const glm::vec3 L = glm::normalize(light->getPosition() - P);
+
+	float visibility = 1.f;
+	if (data.context.params.shadows) {
+		// TODO: check if light source is visible
+		if (!visible(data, P, light->getPosition())) {
+			visibility = 0.f;
+		}
+	}
+
+	glm::vec3 diffuse(0.f);
+	if (data.context.params.diffuse) {
+		// TODO: compute diffuse component of phong model
+		if (visibility > 0.f) {
+			diffuse = std::max(0.f, glm::dot(N, L)) * mat.k_d;
+		}
+	}
+
+	glm::vec3 specular(0.f);
+	if (data.context.params.specular) {
+		// TODO: compute specular component of phong model
+		if ((visibility > 0.f) && (glm::dot(L, N) > 0.f)) {
+			const glm::vec3 R = reflect(L, N);
+			specular = std::pow(std::max(0.f, glm::dot(R, V)), mat.n) * mat.k_s;
+		}
+	}
+
+	glm::vec3 ambient = data.context.params.ambient ? mat.k_a : glm::vec3(0.0f);
+
+	// TODO: modify this and implement the phong model as specified on the exercise sheet
+	const float dist = glm::length(light->getPosition() - P);
+	return (visibility * (diffuse + specular) + ambient) * light->getEmission(-L) / (dist*dist);
+}
+
 glm::vec3 evaluate_phong(
 	RenderData &data,			// class containing raytracing information
 	MaterialSample const& mat,	// the material at position
@@ -206,42 +253,31 @@ glm::vec3 evaluate_phong(
 	cg_assert(std::fabs(glm::length(N) - 1.f) < EPSILON);
 	cg_assert(std::fabs(glm::length(V) - 1.f) < EPSILON);
 
+	Scene const* scene = data.context.get_active_scene();
 	glm::vec3 contribution(0.f);
-	// iterate over lights and sum up their contribution
-	for (auto& light : data.context.get_active_scene()->lights) {
-		// TODO: calculate the (normalized) direction to the light
-		const glm::vec3 L = glm::normalize(light->getPosition() - P);
 
-		float visibility = 1.f;
-		if (data.context.params.shadows) {
-			// TODO: check if light source is visible
-			if (!visible(data, P, light->getPosition())) {
-				visibility = 0.f;
-			}
-		}
-
-		glm::vec3 diffuse(0.f);
-		if (data.context.params.diffuse) {
-			// TODO: compute diffuse component of phong model
-			if (visibility > 0.f) {
-				diffuse = std::max(0.f, glm::dot(N, L)) * mat.k_d;
-			}
-		}
-
-		glm::vec3 specular(0.f);
-		if (data.context.params.specular) {
-			// TODO: compute specular component of phong model
-			if ((visibility > 0.f) && (glm::dot(L, N) > 0.f)) {
-				const glm::vec3 R = reflect(L, N);
-				specular = std::pow(std::max(0.f, glm::dot(R, V)), mat.n) * mat.k_s;
+	// With many lights, estimate the sum over all lights from a few lights
+	// picked in proportion to their estimated contribution.
+	int const num_samples = std::max(1, data.context.params.light_samples);
+	if (data.context.params.light_sampling
+	 && int(scene->lights.size()) > num_samples
+	 && scene->light_tree.num_lights() == int(scene->lights.size()))
+	{
+		cg_assert(data.tld);
+		for (int i = 0; i < num_samples; ++i) {
+			float pdf = 0.f;
+			const int light_idx = scene->light_tree.sample(P, data.tld->rand(), &pdf);
+			if (light_idx >= 0 && pdf > 0.f) {
+				contribution += evaluate_phong_light(data, mat, P, N, V, scene->lights[light_idx].get())
+					/ (pdf * float(num_samples));
 			}
 		}
+		return contribution;
+	}
 
-		glm::vec3 ambient = data.context.params.ambient ? mat.k_a : glm::vec3(0.0f);
-
-		// TODO: modify this and implement the phong model as specified on the exercise sheet
-		const float dist = glm::length(light->getPosition() - P);
-		contribution += (visibility * (diffuse + specular) + ambient) * light->getEmission(-L) / (dist*dist);
+	// iterate over lights and sum up their contribution
+	for (auto& light : scene->lights) {
+		contribution += evaluate_phong_light(data, mat, P, N, V, light.get());
 	}
 
 	return contribution;
@@ -313,11 +349,57 @@ glm::vec3 handle_transmissive_material(
 	glm::vec3 const& eta_of_channel)
 {
 	if (data.context.params.dispersion && !(eta_of_channel[0] == eta_of_channel[1] && eta_of_channel[0] == eta_of_channel[2])) {
-		// TODO: split ray into 3 rays (one for each color channel) and implement dispersion here
+		// Trace the color channels as one bundle. The reflection does not
+		// depend on eta and is shared by all channels. Refracted rays are
+		// only split for channels whose directions diverge.
+		glm::vec3 F(0.f);
+		glm::vec3 T[3];
+		bool refracted[3] = { false, false, false };
+		for (int i = 0; i < 3; ++i) {
+			if (!(data.active_channels & (1 << i))) {
+				continue;
+			}
+			if (data.context.params.fresnel) {
+				F[i] = fresnel(V, N, eta_of_channel[i]);
+			}
+			refracted[i] = refract(V, N, eta_of_channel[i], &T[i]);
+		}
+
 		glm::vec3 contribution(0.f);
+		if (F[0] > 0.f || F[1] > 0.f || F[2] > 0.f) {
+			contribution += F * evaluate_reflection(data, depth, P, N, V);
+		}
+
+		const float cos_tolerance = std::cos(glm::radians(data.context.params.dispersion_tolerance));
+		const int parent_channels = data.active_channels;
+		int traced_channels = 0;
 		for (int i = 0; i < 3; ++i) {
-			float eta = eta_of_channel[i];
-			contribution[i] += handle_transmissive_material_single_ior(data, depth, P, N, V, eta)[i];
+			if (!refracted[i] || (traced_channels & (1 << i))) {
+				continue;
+			}
+
+			// Gather all channels that refract close to channel i.
+			int bundle = 1 << i;
+			glm::vec3 dir = T[i];
+			for (int j = i + 1; j < 3; ++j) {
+				if (refracted[j] && !(traced_channels & (1 << j)) && glm::dot(T[i], T[j]) >= cos_tolerance) {
+					bundle |= 1 << j;
+					dir += T[j];
+				}
+			}
+			traced_channels |= bundle;
+			dir = glm::normalize(dir);
+
+			Ray ray_transmission(P + data.context.params.ray_epsilon * dir, dir);
+			data.active_channels = bundle;
+			const glm::vec3 transmitted = trace_recursive(data, ray_transmission, depth + 1);
+			data.active_channels = parent_channels;
+
+			for (int j = 0; j < 3; ++j) {
+				if (bundle & (1 << j)) {
+					contribution[j] += (1.f - F[j]) * transmitted[j];
+				}
+			}
 		}
 		return contribution;
 	}
@@ -13,7 +13,11 @@
 
 #include <cglib/core/camera.h>
 #include <cglib/core/image.h>
+#include <cglib/core/obj_mesh.h>
+#include <cglib/core/parallel.h>
+#include <cglib/core/task_graph.h>
 
+#include <iostream>
 #include <sstream>
 #include <random>
 
@@ -21,6 +25,91 @@ Scene::~Scene()
 {
 }
 
+namespace
+{
+
+/*
+ * The tasks that load an .obj file as part of a scene's task graph.
+ *
+ * The material libraries are read up front, which is cheap, so every
+ * texture map is decoded and mip mapped in its own task while the geometry
+ * is parsed. The BVH is built as soon as the triangle soup has its
+ * positions, and the textures are bound to the materials in parallel to it.
+ * Only the bind task touches the texture container.
+ */
+struct ObjLoad
+{
+	ObjLoad(TaskGraph& graph, std::string const& path, TextureContainer* textures)
+	{
+		OBJFile header;
+		header.loadMaterialLibraries(path);
+		maps = TriangleSoup::texture_maps(header);
+		map_textures.resize(maps.size());
+
+		std::vector<TaskGraph::TaskId> bind_after;
+		for (std::size_t i = 0; i < maps.size(); ++i) {
+			bind_after.push_back(graph.add("texture " + maps[i].path, [this, i] {
+				map_textures[i] = TriangleSoup::load_texture_map(maps[i]);
+			}));
+		}
+
+		TaskGraph::TaskId const parsed = graph.add("parse " + path, [this, path] {
+			obj.loadFile(path);
+		});
+		TaskGraph::TaskId const geometry = graph.add("triangle soup " + path, [this] {
+			soup = std::make_shared<TriangleSoup>(obj);
+		}, { parsed });
+		graph.add("bvh " + path, [this] {
+			bvh.reset(new BVH(*soup));
+		}, { geometry });
+
+		bind_after.push_back(geometry);
+		graph.add("bind textures " + path, [this, textures] {
+			for (std::size_t i = 0; i < maps.size(); ++i) {
+				textures->insert({maps[i].path, map_textures[i]});
+			}
+			soup->bind_textures(obj, textures);
+		}, bind_after);
+	}
+
+	OBJFile obj;
+	std::vector<TriangleSoup::TextureMap> maps;
+	std::vector<std::shared_ptr<ImageTexture>> map_textures;
+	std::shared_ptr<TriangleSoup> soup;
+	std::unique_ptr<BVH> bvh;
+};
+
+void run_load_graph(TaskGraph& graph, const char* scene_name, RaytracingParameters const& params)
+{
+	graph.run(ThreadPool::global());
+	std::cout << "Loaded " << scene_name << " in " << graph.wall_seconds() << " s"
+	          << " (longest chain " << graph.critical_path_seconds() << " s"
+	          << ", serial " << graph.serial_seconds() << " s)" << std::endl;
+	if (params.stats)
+		graph.print_timings(std::cout);
+}
+
+void print_texture_memory(TextureContainer const& textures)
+{
+	std::size_t bytes = 0;
+	int count[PIXEL_FORMAT_COUNT + 1] = {};
+	for (auto const& texture : textures) {
+		bytes += texture.second->memory_bytes();
+		count[texture.second->is_compressed()
+			? texture.second->get_storage_format() : PIXEL_FORMAT_COUNT]++;
+	}
+	std::cout << "  textures: " << bytes / (1024.0 * 1024.0) << " MB";
+	for (int f = 0; f < PIXEL_FORMAT_COUNT; ++f) {
+		if (count[f] > 0)
+			std::cout << ", " << count[f] << " " << pixel_format_names[f];
+	}
+	if (count[PIXEL_FORMAT_COUNT] > 0)
+		std::cout << ", " << count[PIXEL_FORMAT_COUNT] << " uncompressed";
+	std::cout << std::endl;
+}
+
+} // namespace
+
 void Scene::
 set_active_camera()
 {
@@ -48,16 +137,49 @@ void GaussScene::init_scene(RaytracingParameters const& params)
       *filtered.get(), NEAREST, ZERO)}); 
   textures.insert({"filtered_separable", std::make_shared<ImageTexture>(
       *filtered.get(), NEAREST, ZERO)}); 
+  textures.insert({"filtered_recursive", std::make_shared<ImageTexture>(
+      *filtered.get(), NEAREST, ZERO)}); 
+  textures.insert({"filtered_auto", std::make_shared<ImageTexture>(
+      *filtered.get(), NEAREST, ZERO)}); 
 }
 
 void GaussScene::refresh_scene(RaytracingParameters const& params)
 {
+	// Changing the mode refreshes the scene, so only filter the image that is shown.
 	auto &img_src = textures["input"]->get_mip_levels()[0];
-	auto &img_tgt_naive = textures["filtered_naive"]->get_mip_levels()[0];
-	auto &img_tgt_separable = textures["filtered_separable"]->get_mip_levels()[0];
-
-	img_src->filter_gaussian(img_tgt_naive.get(), params.sigma, params.kernel_radius * 2 + 1);
-	img_src->filter_gaussian_separable(img_tgt_separable.get(), params.sigma, params.kernel_radius * 2 + 1);
+	switch (params.gauss_mode)
+	{
+		case RaytracingParameters::GAUSS_NAIVE:
+		{
+			auto &img_tgt_naive = textures["filtered_naive"]->get_mip_levels()[0];
+			img_src->filter_gaussian(img_tgt_naive.get(), params.sigma, params.kernel_radius * 2 + 1);
+			break;
+		}
+		case RaytracingParameters::GAUSS_SEPARATED:
+		{
+			auto &img_tgt_separable = textures["filtered_separable"]->get_mip_levels()[0];
+			img_src->filter_gaussian_separable(img_tgt_separable.get(), params.sigma, params.kernel_radius * 2 + 1);
+			break;
+		}
+		case RaytracingParameters::GAUSS_RECURSIVE:
+		{
+			auto &img_tgt_recursive = textures["filtered_recursive"]->get_mip_levels()[0];
+			img_src->filter_gaussian_recursive(img_tgt_recursive.get(), params.sigma);
+			break;
+		}
+		case RaytracingParameters::GAUSS_AUTO:
+		{
+			// The 2d kernel of the naive mode, with the algorithm that is fastest for its size.
+			auto &img_tgt_auto = textures["filtered_auto"]->get_mip_levels()[0];
+			int const kernel_size = params.kernel_radius * 2 + 1;
+			std::vector<float> kernel(kernel_size * kernel_size);
+			Image::create_gaussian_kernel_2d(params.sigma, kernel_size, kernel.data());
+			auto_algorithm = img_src->filter_auto(img_tgt_auto.get(), kernel_size, kernel.data());
+			break;
+		}
+		default:
+			break;
+	}
 }
 
 FourierScene::FourierScene(RaytracingParameters& params)
@@ -87,14 +209,18 @@ void FourierScene::refresh_scene(RaytracingParameters const& params)
 	std::shared_ptr<Image> amplitude = std::make_shared<Image>(
 			img_spectrum->getWidth(), img_spectrum->getHeight());
 	glm::vec4 *ampl_data = amplitude->getPixels();
-	for(int i = 0; i < img_spectrum->getWidth() * img_spectrum->getHeight(); i++)
-	{
-		float re = spec_data[i].r;
-		float im = spec_data[i].g;
-		float a  = sqrtf(re*re+im*im);
-
-		ampl_data[i] = glm::vec4(a, a, a, 1.0f);
-	}
+	parallel_for(BlockedRange(0, img_spectrum->getWidth() * img_spectrum->getHeight()), 4096,
+		[&](BlockedRange const& r)
+		{
+			for(int i = r.begin; i < r.end; i++)
+			{
+				float re = spec_data[i].r;
+				float im = spec_data[i].g;
+				float a  = sqrtf(re*re+im*im);
+
+				ampl_data[i] = glm::vec4(a, a, a, 1.0f);
+			}
+		});
 
 	textures.insert({"amplitude", std::make_shared<ImageTexture>(
 				*amplitude.get(), NEAREST, ZERO)});
@@ -104,14 +230,18 @@ void FourierScene::refresh_scene(RaytracingParameters const& params)
 	std::shared_ptr<Image> phase = std::make_shared<Image>(
 			img_spectrum->getWidth(), img_spectrum->getHeight());
 	glm::vec4 *phase_data = phase->getPixels();
-	for(int i = 0; i < img_spectrum->getWidth() * img_spectrum->getHeight(); i++)
-	{
-		float re = spec_data[i].r;
-		float im = spec_data[i].g;
-		float ph = (std::atan2(im, re)+M_PI)/(2.0f*M_PI);
-
-		phase_data[i] = glm::vec4(ph, ph, ph, 1.0f);
-	}
+	parallel_for(BlockedRange(0, img_spectrum->getWidth() * img_spectrum->getHeight()), 4096,
+		[&](BlockedRange const& r)
+		{
+			for(int i = r.begin; i < r.end; i++)
+			{
+				float re = spec_data[i].r;
+				float im = spec_data[i].g;
+				float ph = (std::atan2(im, re)+M_PI)/(2.0f*M_PI);
+
+				phase_data[i] = glm::vec4(ph, ph, ph, 1.0f);
+			}
+		});
 
 	textures.insert({"phase", std::make_shared<ImageTexture>(
 				*phase.get(), NEAREST, ZERO)});
@@ -228,22 +358,34 @@ void MonkeyScene::init_scene(RaytracingParameters const& params)
     soups.clear();
 
 
-    textures.insert({"floor", std::make_shared<ImageTexture>(
-		"assets/checker.tga", params.get_tex_filter_mode(), 
-		params.get_tex_wrap_mode(), 2.2f)});
-	textures["floor"]->create_mipmap();
-
-	std::shared_ptr<Image> appartment = std::make_shared<Image>();
-	appartment->load("assets/appartment.jpg", 1.f);
-    textures.insert({"appartment_env",          
-		std::make_shared<ImageTexture>(*appartment,
-		BILINEAR, REPEAT)});
-	textures["appartment_env"]->create_mipmap();
+	std::shared_ptr<ImageTexture> floor, appartment_env;
+	TaskGraph graph;
+	graph.add("texture assets/checker.tga", [&] {
+		floor = std::make_shared<ImageTexture>(
+			"assets/checker.tga", params.get_tex_filter_mode(), 
+			params.get_tex_wrap_mode(), 2.2f);
+		floor->create_mipmap();
+		floor->compress();
+	});
+	graph.add("texture assets/appartment.jpg", [&] {
+		Image appartment;
+		appartment.load("assets/appartment.jpg", 1.f);
+		appartment_env = std::make_shared<ImageTexture>(appartment,
+			BILINEAR, REPEAT);
+		appartment_env->create_mipmap();
+		appartment_env->compress();
+	});
+	ObjLoad suzanne(graph, "assets/suzanne.obj", &this->textures);
+	run_load_graph(graph, get_name(), params);
+
+    textures.insert({"floor", floor});
+    textures.insert({"appartment_env", appartment_env});
 	env_map = textures["appartment_env"].get();
+	if (params.stats)
+		print_texture_memory(textures);
 	
-    soups.push_back(std::make_shared<TriangleSoup>(
-		"assets/suzanne.obj", &this->textures));
-    objects.emplace_back(new BVH(*soups.back()));
+    soups.push_back(suzanne.soup);
+    objects.emplace_back(suzanne.bvh.release());
 	objects.back()->set_transform_object_to_world(
 		glm::translate(glm::vec3(0.f, 2.f, 0.f)) * 
 		glm::scale(glm::vec3(3.f, 3.f, 3.f)));
@@ -295,14 +437,30 @@ void SponzaScene::init_scene(RaytracingParameters const& params)
 		objects.back()->material->k_r = std::shared_ptr<ConstTexture>(new ConstTexture(glm::vec3(0.4f)));
 	}
 
-	auto objTriangles = std::make_shared<TriangleSoup>("assets/crytek-sponza/sponza_subdiv3.obj", &this->textures);
-	soups.push_back(objTriangles);
-	objects.emplace_back(new BVH(*objTriangles));
+	TaskGraph graph;
+	ObjLoad sponza(graph, "assets/crytek-sponza/sponza_subdiv3.obj", &this->textures);
+	run_load_graph(graph, get_name(), params);
+	if (params.stats)
+		print_texture_memory(textures);
+
+	soups.push_back(sponza.soup);
+	objects.emplace_back(sponza.bvh.release());
 	objects.back()->set_transform_object_to_world(
 		glm::scale(glm::vec3(0.01f)));
 	
-	for (int i = 0; i < 2; ++i) {
-		lights.emplace_back(new Light(glm::vec3(-2.5f+5.f*i, 6.f, 0.f), glm::vec3(10.f)));
+	create_lights(params.num_lights);
+}
+
+void SponzaScene::create_lights(int num_lights)
+{
+	// A row of lights along the atrium. The total power stays the same
+	// regardless of the number of lights.
+	lights.clear();
+	num_lights = std::max(1, num_lights);
+	const float spacing = 10.f / float(num_lights);
+	for (int i = 0; i < num_lights; ++i) {
+		const float x = spacing * (float(i) - 0.5f * float(num_lights - 1));
+		lights.emplace_back(new Light(glm::vec3(x, 6.f, 0.f), glm::vec3(20.f / float(num_lights))));
 	}
 }
 
@@ -312,6 +470,9 @@ void SponzaScene::refresh_scene(RaytracingParameters const& params)
 		init_scene(params);
 		scene_loaded = true;
 	}
+	if (int(lights.size()) != std::max(1, params.num_lights)) {
+		create_lights(params.num_lights);
+	}
 	for (auto &tex : textures) {
 		tex.second->filter_mode = params.get_tex_filter_mode();
 		tex.second->wrap_mode = params.get_tex_wrap_mode();
@@ -3,6 +3,7 @@
 #include <cglib/core/image.h>
 #include <cglib/core/glmstream.h>
 #include <cglib/core/assert.h>
+#include <cglib/core/parallel.h>
 
 #include <algorithm>
 
@@ -23,7 +24,8 @@ ImageTexture::ImageTexture(
     float gamma_) :
     Texture(),
     filter_mode(filter_mode_),
-    wrap_mode(wrap_mode_)
+    wrap_mode(wrap_mode_),
+    gamma(gamma_)
 {
     mip_levels.emplace_back(new Image());
     mip_levels.back()->load(filename.c_str(), gamma_);
@@ -35,7 +37,8 @@ ImageTexture::ImageTexture(
     TextureWrapMode wrap_mode_) :
     Texture(),
     filter_mode(filter_mode_),
-    wrap_mode(wrap_mode_)
+    wrap_mode(wrap_mode_),
+    gamma(1.f)
 {
     mip_levels.emplace_back(new Image(image));
 }
@@ -57,6 +60,8 @@ evaluate(glm::vec2 const& uv, glm::vec2 const& dudv) const
 void ImageTexture::
 create_mipmap()
 {
+	cg_assert(!is_compressed());
+
 	/* iteratively downsample until only a 1x1 image is left */
 	int size_x = mip_levels[0]->getWidth();
 	int size_y = mip_levels[0]->getHeight();
@@ -71,27 +76,89 @@ create_mipmap()
 		size_x = std::max(1, size_x/2);
 		size_y = std::max(1, size_y/2);
 		mip_levels.emplace_back(new Image(size_x, size_y));
-		for (int x = 0; x < size_x; x++) {
-			for (int y = 0; y < size_y; y++) {
-				glm::vec4 mean(0.f);
-				for (int xx = 0; xx < cx; xx++) {
-					for (int yy = 0; yy < cy; yy++) {
-						mean += mip_levels[level]->getPixel(2*x+xx, 2*y+yy);
+		Image const& src = *mip_levels[level];
+		Image& dst = *mip_levels[level+1];
+		parallel_for(BlockedRange2D(0, size_x, 0, size_y), 64, [&](BlockedRange2D const& r) {
+			for (int y = r.y.begin; y < r.y.end; y++) {
+				for (int x = r.x.begin; x < r.x.end; x++) {
+					glm::vec4 mean(0.f);
+					for (int xx = 0; xx < cx; xx++) {
+						for (int yy = 0; yy < cy; yy++) {
+							mean += src.getPixel(2*x+xx, 2*y+yy);
+						}
 					}
+					dst.setPixel(x, y, mean/float(cx*cy));
 				}
-				mip_levels[level+1]->setPixel(x, y, mean/float(cx*cy));
 			}
-		}
+		});
+	}
+}
+
+PixelFormat ImageTexture::
+compress()
+{
+	cg_assert(!mip_levels.empty());
+	PixelFormat const format = CompactImage::smallest_exact_format(*mip_levels[0], gamma);
+	compress(format);
+	return format;
+}
+
+void ImageTexture::
+compress(PixelFormat format)
+{
+	cg_assert(!is_compressed());
+	for (auto const& level : mip_levels)
+	{
+		compact_levels.emplace_back(new CompactImage(*level, format, gamma));
+	}
+	mip_levels.clear();
+}
+
+PixelFormat ImageTexture::
+get_storage_format() const
+{
+	return is_compressed() ? compact_levels[0]->getFormat() : PIXEL_RGBA32F;
+}
+
+int ImageTexture::
+get_num_levels() const
+{
+	return is_compressed() ? int(compact_levels.size()) : int(mip_levels.size());
+}
+
+int ImageTexture::
+get_width(int level) const
+{
+	return is_compressed() ? compact_levels[level]->getWidth() : mip_levels[level]->getWidth();
+}
+
+int ImageTexture::
+get_height(int level) const
+{
+	return is_compressed() ? compact_levels[level]->getHeight() : mip_levels[level]->getHeight();
+}
+
+std::size_t ImageTexture::
+memory_bytes() const
+{
+	std::size_t bytes = 0;
+	for (auto const& level : compact_levels)
+	{
+		bytes += level->size_bytes();
 	}
+	for (auto const& level : mip_levels)
+	{
+		bytes += std::size_t(level->getWidth()) * level->getHeight() * sizeof(glm::vec4);
+	}
+	return bytes;
 }
 
 glm::vec4 ImageTexture::
 evaluate_nearest(int level, glm::vec2 const& uv) const
 {
-	cg_assert(level >= 0 && level < static_cast<int>(mip_levels.size()));
-	cg_assert(mip_levels[level]);
-	int const width = mip_levels[level]->getWidth();
-	int const height = mip_levels[level]->getHeight();
+	cg_assert(level >= 0 && level < get_num_levels());
+	int const width = get_width(level);
+	int const height = get_height(level);
 	int const s = (int)std::floor(uv[0]*width);
 	int const t = (int)std::floor(uv[1]*height);
 	return get_texel(level, s, t);
@@ -100,10 +167,9 @@ evaluate_nearest(int level, glm::vec2 const& uv) const
 glm::vec4 ImageTexture::
 evaluate_bilinear(int level, glm::vec2 const& uv) const
 {
-	cg_assert(level >= 0 && level < static_cast<int>(mip_levels.size()));
-	cg_assert(mip_levels[level]);
-	int const width = mip_levels[level]->getWidth();
-	int const height = mip_levels[level]->getHeight();
+	cg_assert(level >= 0 && level < get_num_levels());
+	int const width = get_width(level);
+	int const height = get_height(level);
 	float fs = uv[0]*width+0.5f;
 	float ft = uv[1]*height+0.5f;
 	float const ffs = std::floor(fs);
@@ -121,12 +187,12 @@ glm::vec4 ImageTexture::
 evaluate_trilinear(glm::vec2 const& uv, glm::vec2 const& dudv) const
 {
 	const float footprint_size = std::max(1.f, std::max(
-		dudv[0]*mip_levels[0]->getWidth(), dudv[1]*mip_levels[0]->getHeight()));
+		dudv[0]*get_width(0), dudv[1]*get_height(0)));
 
 	const float level = std::log2(footprint_size);
 	const float alpha = glm::fract(level);
-	const int lower = std::min<int>(std::max<int>(0, static_cast<int>(std::floor(level))), mip_levels.size()-1);
-	const int upper = std::min<int>(std::max<int>(0, static_cast<int>(std::ceil(level))), mip_levels.size()-1);
+	const int lower = std::min<int>(std::max<int>(0, static_cast<int>(std::floor(level))), get_num_levels()-1);
+	const int upper = std::min<int>(std::max<int>(0, static_cast<int>(std::ceil(level))), get_num_levels()-1);
 
 	// visualization of mipmap level
 	//return       alpha  * glm::vec3(float(upper)/(mip_levels.size()-1)) 
@@ -167,9 +233,11 @@ get_texel(int level, int x, int y) const
 		{ 1, 0, 1, 0 },
 		{ 0, 1, 1, 0 },
 	};
-	cg_assert(level >= 0 && level < int(mip_levels.size()));
-	cg_assert(mip_levels.at(level)->getWidth() > 0);
-	cg_assert(mip_levels.at(level)->getHeight() > 0);
+	cg_assert(level >= 0 && level < get_num_levels());
+	int const width = get_width(level);
+	int const height = get_height(level);
+	cg_assert(width > 0);
+	cg_assert(height > 0);
 
 	if(filter_mode == DEBUG_MIP) {
 		int l = level % (sizeof(mip_level_debug_colors)
@@ -180,18 +248,18 @@ get_texel(int level, int x, int y) const
 	switch (wrap_mode)
 	{
 		case REPEAT:
-			x = TEXTURE_WRAP_CLASS::wrap_repeat(x, mip_levels[level]->getWidth());
-			y = TEXTURE_WRAP_CLASS::wrap_repeat(y, mip_levels[level]->getHeight());
+			x = TEXTURE_WRAP_CLASS::wrap_repeat(x, width);
+			y = TEXTURE_WRAP_CLASS::wrap_repeat(y, height);
 			break;
 
 		case CLAMP:
-			x = TEXTURE_WRAP_CLASS::wrap_clamp(x, mip_levels[level]->getWidth());
-			y = TEXTURE_WRAP_CLASS::wrap_clamp(y, mip_levels[level]->getHeight());
+			x = TEXTURE_WRAP_CLASS::wrap_clamp(x, width);
+			y = TEXTURE_WRAP_CLASS::wrap_clamp(y, height);
 			break;
 
 		case ZERO:
-			if (x < 0 || x >= mip_levels[level]->getWidth()
-			 || y < 0 || y >= mip_levels[level]->getHeight())
+			if (x < 0 || x >= width
+			 || y < 0 || y >= height)
 			{
 				return glm::vec4(0);
 			}
@@ -201,19 +269,24 @@ get_texel(int level, int x, int y) const
 			return glm::vec4(0);
 	}
 
-	cg_assert(x >= 0 && x < mip_levels[level]->getWidth());
-	cg_assert(y >= 0 && y < mip_levels[level]->getHeight());
+	cg_assert(x >= 0 && x < width);
+	cg_assert(y >= 0 && y < height);
 
+	if (is_compressed()) {
+		return compact_levels[level]->getPixel(x, y);
+	}
 	return mip_levels[level]->getPixel(x, y);
 }
 
 void ImageTexture::set_texel(int level, int x, int y, glm::vec4 const& value)
 {
-	cg_assert(level >= 0 && level < int(mip_levels.size()));
-	cg_assert(mip_levels.at(level)->getWidth() > 0);
-	cg_assert(mip_levels.at(level)->getHeight() > 0);
-	cg_assert(x >= 0 && x < mip_levels.at(level)->getWidth());
-	cg_assert(y >= 0 && y < mip_levels.at(level)->getHeight());
+	cg_assert(level >= 0 && level < get_num_levels());
+	cg_assert(x >= 0 && x < get_width(level));
+	cg_assert(y >= 0 && y < get_height(level));
+	if (is_compressed()) {
+		compact_levels[level]->setPixel(x, y, value);
+		return;
+	}
 	mip_levels[level]->setPixel(x, y, value);
 }
 
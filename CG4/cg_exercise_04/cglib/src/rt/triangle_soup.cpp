@@ -31,10 +31,26 @@ TriangleSoup(std::vector<glm::vec3>&& vertices_,
 TriangleSoup::
 TriangleSoup(const std::string &obj_path, TextureContainer *textures)
 {
-    bool verbose = false;
-	OBJFile obj(verbose);
+	OBJFile obj;
 	obj.loadFile(obj_path);
 
+	load_geometry(obj);
+	if (textures) {
+		bind_textures(obj, textures);
+	}
+}
+
+TriangleSoup::
+TriangleSoup(OBJFile const& obj)
+{
+	load_geometry(obj);
+}
+
+void TriangleSoup::
+load_geometry(OBJFile const& obj)
+{
+    bool verbose = false;
+
 	cg_assert(obj.getModelCount() > 0);
 
 	num_triangles = obj.getFaceCount();
@@ -61,39 +77,8 @@ TriangleSoup(const std::string &obj_path, TextureContainer *textures)
 			auto &mat = materials.back();
 			auto &obj_mat = *(s[j]->material);
 
-			// --- diffuse
-			auto it = obj_mat.additionalInfo.find("map_Kd");
-			if(textures && it != obj_mat.additionalInfo.end()) {
-				std::string texturePath = it->second;
-
-                if (textures->find(texturePath) == textures->end()) {
-                    if (verbose) std::cout << "create texture: " << texturePath << std::endl;
-                    textures->insert({texturePath, std::make_shared<ImageTexture>(texturePath, NEAREST, REPEAT)});
-					(*textures)[texturePath]->create_mipmap();
-                }
-
-				mat.k_d = (*textures)[texturePath];
-			}
-			else {
-				mat.k_d = std::make_shared<ConstTexture>(obj_mat.diffuse);
-			}
-			
-			// --- specular
-			it = obj_mat.additionalInfo.find("map_Ks");
-			if(textures && it != obj_mat.additionalInfo.end()) {
-				std::string texturePath = it->second;
-
-                if (textures->find(texturePath) == textures->end()) {
-                    if (verbose) std::cout << "create texture: " << texturePath << std::endl;
-                    textures->insert({texturePath, std::make_shared<ImageTexture>(texturePath, NEAREST, REPEAT)});
-                }
-
-				mat.k_s = (*textures)[texturePath];
-			}
-			else {
-				mat.k_s = std::make_shared<ConstTexture>(obj_mat.specular);
-			}
-
+			mat.k_d = std::make_shared<ConstTexture>(obj_mat.diffuse);
+			mat.k_s = std::make_shared<ConstTexture>(obj_mat.specular);
 			mat.n = obj_mat.shininess;
 
 			for(uint k = 0; k < s[j]->getFaceCount(); k++)
@@ -121,6 +106,76 @@ TriangleSoup(const std::string &obj_path, TextureContainer *textures)
     cg_assert(material_ids.size() == uint32_t(num_triangles));
 }
 
+void TriangleSoup::
+bind_textures(OBJFile const& obj, TextureContainer *textures)
+{
+	cg_assert(textures);
+
+	auto lookup = [&](std::string const& path, bool diffuse) {
+		auto it = textures->find(path);
+		if (it == textures->end()) {
+			it = textures->insert({path, load_texture_map(TextureMap{path, diffuse})}).first;
+		}
+		return it->second;
+	};
+
+	// one material per surface, in the order of load_geometry()
+	std::size_t material = 0;
+	for(uint i = 0; i < obj.getModelCount(); i++) {
+		for(auto const& surface : obj.getModel(i)->getSurfaces()) {
+			cg_assert(material < materials.size());
+			auto &mat = materials[material++];
+			auto const& info = surface->material->additionalInfo;
+
+			auto it = info.find("map_Kd");
+			if(it != info.end())
+				mat.k_d = lookup(it->second, true);
+
+			it = info.find("map_Ks");
+			if(it != info.end())
+				mat.k_s = lookup(it->second, false);
+		}
+	}
+	cg_assert(material == materials.size());
+}
+
+std::vector<TriangleSoup::TextureMap> TriangleSoup::
+texture_maps(OBJFile const& obj)
+{
+	std::vector<TextureMap> maps;
+	auto add = [&](std::string const& path, bool diffuse) {
+		for (auto& map : maps) {
+			if (map.path == path) {
+				map.diffuse = map.diffuse || diffuse;
+				return;
+			}
+		}
+		maps.push_back(TextureMap{path, diffuse});
+	};
+
+	for(uint i = 0; i < obj.getMaterialCount(); i++) {
+		auto const& info = obj.getMaterial(i)->additionalInfo;
+		auto it = info.find("map_Kd");
+		if(it != info.end())
+			add(it->second, true);
+		it = info.find("map_Ks");
+		if(it != info.end())
+			add(it->second, false);
+	}
+	return maps;
+}
+
+std::shared_ptr<ImageTexture> TriangleSoup::
+load_texture_map(TextureMap const& map)
+{
+	auto texture = std::make_shared<ImageTexture>(map.path, NEAREST, REPEAT);
+	if (map.diffuse) {
+		texture->create_mipmap();
+	}
+	texture->compress();
+	return texture;
+}
+
 void TriangleSoup::
 fill_intersection(
 		Intersection* isect,